@@ -0,0 +1,102 @@
+// Replays an update image end to end on the simulated board: the factory
+// app finds it on the card, installs it and restarts. Reports the
+// throughput of the transfer, how much of the card reads and flash
+// writes overlapped, and the memory the install needed
+//
+// Usage: ota_bench_<variant> [--image update.bin] [--scale s]
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "bench"
+
+static void run_until_restart(void *arg)
+{
+    sim_delay_ms(120000);
+}
+
+// Memory the variant reserves at build time for the install path
+static uint32_t static_reservation(void)
+{
+    uint32_t size = 0;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    const task_slot_t *slots[] = {
+        &sd_task, &ota_task, &reader_task, &health_task,
+#ifdef CONFIG_OTA_BACKGROUND_ERASE
+        &eraser_task,
+#endif
+#ifdef CONFIG_OTA_DEFERRED_LOG
+        &log_task,
+#endif
+        &house_task,
+    };
+    for (int i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+        size += slots[i]->stack_size + sizeof(StaticTask_t);
+    }
+    size += sizeof(ota_buffer_arena);
+#ifdef CONFIG_OTA_DEFERRED_LOG
+    size += CONFIG_OTA_DEFERRED_LOG_SIZE;
+#endif
+#endif
+    return size;
+}
+
+// Runs in the booted app right before the restart into the new image
+static void report(void)
+{
+    int64_t total_us[TRACE_PHASES];
+    int count[TRACE_PHASES];
+    trace_totals(total_us, count);
+    // The partition is erased within the transfer phase, once the header
+    // of the image was checked. Reads stall while it runs
+    int64_t erase_us = total_us[TRACE_ERASE];
+    int64_t stream_us = total_us[TRACE_TRANSFER] - erase_us;
+    int64_t install_us = total_us[TRACE_OPEN] + total_us[TRACE_TRANSFER]
+                         + total_us[TRACE_VALIDATE] + total_us[TRACE_SET_BOOT];
+
+    printf("%-12s %6d %8u %7" PRId64 " %7" PRId64 " %7" PRId64 " %7" PRId64 " %7" PRId64 " %6d %5.2f %6llu %6llu %7u %7u\n",
+           BENCH_VARIANT, ota_buffer_size, trace_write_bytes, install_us / 1000, erase_us / 1000,
+           stream_us / 1000, trace_read_us / 1000, trace_write_us / 1000,
+           trace_kbps(trace_write_bytes, stream_us),
+           stream_us > 0 ? (double)(trace_read_us + trace_write_us) / stream_us : 0.0,
+           (unsigned long long)sim_stats.card_commands, (unsigned long long)sim_stats.card_read_calls,
+           (uint32_t)sim_heap_peak(), static_reservation());
+    printf("\n");
+    sim_report_stacks();
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = SIM_BUILDS_DIR "/update.bin";
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    sim_config.time_scale = 0.25;
+    sim_config.log_level = ESP_LOG_WARN;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            sim_config.time_scale = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--image update.bin] [--scale s]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    sim_init(work_dir);
+    if (!sim_flash_load("factory", SIM_BUILDS_DIR "/current.bin") || !sim_card_copy(CARD, "update.bin", image)) {
+        fprintf(stderr, "Cannot set up the board with %s\n", image);
+        return 1;
+    }
+    sim_card_insert(CARD);
+    sim_set_restart_hook(report);
+
+    printf("%-12s %6s %8s %7s %7s %7s %7s %7s %6s %5s %6s %6s %7s %7s\n",
+           "variant", "chunk", "bytes", "inst_ms", "eras_ms", "strm_ms", "read_ms", "writ_ms",
+           "KB/s", "ovlp", "cmds", "reads", "heap", "static");
+    int code = sim_boot(run_until_restart, NULL);
+    if (code != SIM_EXIT_RESTART || strcmp(sim_boot_label(), "ota_0") != 0) {
+        fprintf(stderr, "Install failed (exit %d)\n", code);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "driver/sdmmc_types.h"
+
+#define SDMMC_HOST_SLOT_0 0
+#define SDMMC_HOST_SLOT_1 1
+
+#define SDMMC_HOST_DEFAULT() { \
+    .flags = SDMMC_HOST_FLAG_4BIT | SDMMC_HOST_FLAG_1BIT, \
+    .slot = SDMMC_HOST_SLOT_1, \
+    .max_freq_khz = SDMMC_FREQ_DEFAULT, \
+    .io_voltage = 3.3f, \
+    .command_timeout_ms = 0, \
+}
+
+#define SDMMC_SLOT_NO_CD      ((gpio_num_t) -1)
+#define SDMMC_SLOT_NO_WP      ((gpio_num_t) -1)
+#define SDMMC_SLOT_WIDTH_DEFAULT 0
+
+typedef struct {
+    gpio_num_t gpio_cd;
+    gpio_num_t gpio_wp;
+    uint8_t width;
+    uint32_t flags;
+} sdmmc_slot_config_t;
+
+#define SDMMC_SLOT_CONFIG_DEFAULT() { \
+    .gpio_cd = SDMMC_SLOT_NO_CD, \
+    .gpio_wp = SDMMC_SLOT_NO_WP, \
+    .width = SDMMC_SLOT_WIDTH_DEFAULT, \
+    .flags = 0, \
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+    int mfg_id;
+    int oem_id;
+    char name[8];
+    int revision;
+    int serial;
+    int date;
+} sdmmc_cid_t;
+
+typedef struct {
+    int csd_ver;
+    int mmc_ver;
+    int capacity;
+    int sector_size;
+    int read_block_len;
+    int card_command_class;
+    int tr_speed;
+} sdmmc_csd_t;
+
+typedef struct {
+    uint32_t flags;
+#define SDMMC_HOST_FLAG_1BIT    (1 << 0)
+#define SDMMC_HOST_FLAG_4BIT    (1 << 1)
+#define SDMMC_HOST_FLAG_8BIT    (1 << 2)
+#define SDMMC_HOST_FLAG_SPI     (1 << 3)
+    int slot;
+    int max_freq_khz;
+#define SDMMC_FREQ_DEFAULT      20000
+#define SDMMC_FREQ_HIGHSPEED    40000
+#define SDMMC_FREQ_PROBING      400
+    float io_voltage;
+    int command_timeout_ms;
+} sdmmc_host_t;
+
+typedef struct {
+    sdmmc_host_t host;
+    uint32_t ocr;
+    sdmmc_cid_t cid;
+    sdmmc_csd_t csd;
+    uint32_t rca;
+    uint16_t max_freq_khz;
+    uint32_t is_mem : 1;
+    uint32_t is_sdio : 1;
+    uint32_t is_mmc : 1;
+    uint32_t num_io_functions : 3;
+    uint32_t log_bus_width : 2;
+    uint32_t is_ddr : 1;
+} sdmmc_card_t;
@@ -0,0 +1,30 @@
+#pragma once
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "driver/sdmmc_types.h"
+
+#define SDSPI_DEFAULT_HOST 1
+
+#define SDSPI_HOST_DEFAULT() { \
+    .flags = SDMMC_HOST_FLAG_SPI, \
+    .slot = SDSPI_DEFAULT_HOST, \
+    .max_freq_khz = SDMMC_FREQ_DEFAULT, \
+    .io_voltage = 3.3f, \
+    .command_timeout_ms = 0, \
+}
+
+typedef struct {
+    int host_id;
+    gpio_num_t gpio_cs;
+    gpio_num_t gpio_cd;
+    gpio_num_t gpio_wp;
+    gpio_num_t gpio_int;
+} sdspi_device_config_t;
+
+#define SDSPI_DEVICE_CONFIG_DEFAULT() { \
+    .host_id = SDSPI_DEFAULT_HOST, \
+    .gpio_cs = 13, \
+    .gpio_cd = -1, \
+    .gpio_wp = -1, \
+    .gpio_int = -1, \
+}
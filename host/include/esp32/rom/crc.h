@@ -0,0 +1,4 @@
+#pragma once
+#include <stdint.h>
+
+uint32_t crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+
+#define ESP_PARTITION_MAGIC 0x50AA
+#define ESP_PARTITION_TABLE_OFFSET 0x8000
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+} esp_partition_pos_t;
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_flash_partitions.h"
+#include "esp_app_format.h"
+
+typedef enum {
+    ESP_IMAGE_VERIFY,
+    ESP_IMAGE_VERIFY_SILENT,
+} esp_image_load_mode_t;
+
+typedef struct {
+    uint32_t start_addr;
+    esp_image_header_t image;
+    esp_image_segment_header_t segments[ESP_IMAGE_MAX_SEGMENTS];
+    uint32_t segment_data[ESP_IMAGE_MAX_SEGMENTS];
+    uint32_t image_len;
+    uint8_t image_digest[32];
+} esp_image_metadata_t;
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *part, esp_image_metadata_t *data);
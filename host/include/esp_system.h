@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+#include "sdkconfig.h"
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+    ESP_MAC_WIFI_SOFTAP,
+    ESP_MAC_BT,
+    ESP_MAC_ETH,
+} esp_mac_type_t;
+
+void esp_restart(void) __attribute__((noreturn));
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac);
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type);
+
+// newlib provides strlcpy, glibc before 2.38 does not
+#include <stddef.h>
+size_t strlcpy(char *dst, const char *src, size_t size);
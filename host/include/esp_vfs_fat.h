@@ -0,0 +1,56 @@
+// Host stand-in for the FAT VFS. Paths under the mount point are served
+// from the simulated card directory, with the card's latency and removal
+// applied to every read
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "esp_err.h"
+#include "driver/sdmmc_host.h"
+#include "driver/sdspi_host.h"
+#include "sdmmc_cmd.h"
+
+typedef struct {
+    bool format_if_mount_failed;
+    int max_files;
+    size_t allocation_unit_size;
+} esp_vfs_fat_mount_config_t;
+
+typedef esp_vfs_fat_mount_config_t esp_vfs_fat_sdmmc_mount_config_t;
+
+esp_err_t esp_vfs_fat_sdmmc_mount(const char *base_path, const sdmmc_host_t *host_config,
+                                  const void *slot_config, const esp_vfs_fat_mount_config_t *mount_config,
+                                  sdmmc_card_t **out_card);
+esp_err_t esp_vfs_fat_sdspi_mount(const char *base_path, const sdmmc_host_t *host_config_input,
+                                  const sdspi_device_config_t *slot_config,
+                                  const esp_vfs_fat_mount_config_t *mount_config, sdmmc_card_t **out_card);
+esp_err_t esp_vfs_fat_sdcard_unmount(const char *base_path, sdmmc_card_t *card);
+
+FILE *sim_vfs_fopen(const char *path, const char *mode);
+int sim_vfs_fclose(FILE *stream);
+size_t sim_vfs_fread(void *ptr, size_t size, size_t count, FILE *stream);
+size_t sim_vfs_fwrite(const void *ptr, size_t size, size_t count, FILE *stream);
+int sim_vfs_ferror(FILE *stream);
+int sim_vfs_stat(const char *path, struct stat *st);
+int sim_vfs_unlink(const char *path);
+int sim_vfs_rename(const char *from, const char *to);
+int sim_vfs_mkdir(const char *path, mode_t mode);
+DIR *sim_vfs_opendir(const char *path);
+struct dirent *sim_vfs_readdir(DIR *dir);
+
+#ifndef SIM_NO_VFS_REDIRECT
+#define fopen(path, mode)               sim_vfs_fopen(path, mode)
+#define fclose(stream)                  sim_vfs_fclose(stream)
+#define fread(ptr, size, count, stream) sim_vfs_fread(ptr, size, count, stream)
+#define fwrite(ptr, size, count, stream) sim_vfs_fwrite(ptr, size, count, stream)
+#define ferror(stream)                  sim_vfs_ferror(stream)
+#define stat(path, st)                  sim_vfs_stat(path, st)
+#define unlink(path)                    sim_vfs_unlink(path)
+#define rename(from, to)                sim_vfs_rename(from, to)
+#define mkdir(path, mode)               sim_vfs_mkdir(path, mode)
+#define opendir(path)                   sim_vfs_opendir(path)
+#define readdir(dir)                    sim_vfs_readdir(dir)
+#endif
@@ -0,0 +1,89 @@
+// Host stand-in for the parts of FatFs the raw sector reader uses. The
+// volume is an image the simulation builds from the card directory
+#pragma once
+#include <stdint.h>
+#include "sdkconfig.h"
+
+typedef unsigned int UINT;
+typedef unsigned char BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef uint64_t QWORD;
+typedef char TCHAR;
+typedef DWORD FSIZE_t;
+typedef DWORD LBA_t;
+
+#define FF_MIN_SS 512
+#define FF_MAX_SS CONFIG_WL_SECTOR_SIZE
+
+#define FS_FAT12 1
+#define FS_FAT16 2
+#define FS_FAT32 3
+#define FS_EXFAT 4
+
+#define FA_READ          0x01
+#define FA_WRITE         0x02
+#define FA_OPEN_EXISTING 0x00
+
+typedef struct {
+    BYTE fs_type;
+    BYTE pdrv;
+    BYTE n_fats;
+    BYTE wflag;
+    BYTE fsi_flag;
+    WORD id;
+    WORD n_rootdir;
+    WORD csize;
+    WORD ssize;
+    DWORD last_clst;
+    DWORD free_clst;
+    DWORD n_fatent;
+    DWORD fsize;
+    LBA_t volbase;
+    LBA_t fatbase;
+    LBA_t dirbase;
+    LBA_t database;
+    LBA_t winsect;
+    BYTE win[FF_MAX_SS];
+} FATFS;
+
+typedef struct {
+    FATFS *fs;
+    WORD id;
+    BYTE attr;
+    BYTE stat;
+    DWORD sclust;
+    FSIZE_t objsize;
+} FFOBJID;
+
+typedef struct {
+    FFOBJID obj;
+    BYTE flag;
+    BYTE err;
+    FSIZE_t fptr;
+    DWORD clust;
+    LBA_t sect;
+    LBA_t dir_sect;
+    BYTE *dir_ptr;
+    BYTE buf[FF_MAX_SS];
+} FIL;
+
+typedef enum {
+    FR_OK = 0,
+    FR_DISK_ERR,
+    FR_INT_ERR,
+    FR_NOT_READY,
+    FR_NO_FILE,
+    FR_NO_PATH,
+    FR_INVALID_NAME,
+    FR_DENIED,
+    FR_EXIST,
+    FR_INVALID_OBJECT,
+    FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE,
+    FR_NOT_ENABLED,
+    FR_NO_FILESYSTEM,
+} FRESULT;
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
@@ -0,0 +1,54 @@
+// Host stand-in for FreeRTOS. Tasks are POSIX threads, kernel objects
+// are built on one kernel lock, ticks follow the simulated clock
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include <assert.h>
+#include "esp_attr.h"
+#include "esp_bit_defs.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS  ((TickType_t)1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(((TickType_t)(ms) * (TickType_t)CONFIG_FREERTOS_HZ) / (TickType_t)1000))
+
+#define configMAX_PRIORITIES 25
+#define tskIDLE_PRIORITY     0
+#define tskNO_AFFINITY       0x7FFFFFFF
+#define PRO_CPU_NUM          0
+#define APP_CPU_NUM          1
+
+// Control block sizes of the ESP32 port, so static reservations match
+// the device. The simulation keeps its own state outside these
+typedef struct { uint8_t reserved[352]; } StaticTask_t;
+typedef struct { uint8_t reserved[84]; } StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct { uint8_t reserved[32]; } StaticEventGroup_t;
+typedef struct { uint8_t reserved[100]; } StaticRingbuffer_t;
+
+typedef struct {
+    int owner;
+    int count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { .owner = 0, .count = 0 }
+
+void sim_enter_critical(portMUX_TYPE *mux);
+void sim_exit_critical(portMUX_TYPE *mux);
+
+#define portENTER_CRITICAL(mux)     sim_enter_critical(mux)
+#define portEXIT_CRITICAL(mux)      sim_exit_critical(mux)
+#define portENTER_CRITICAL_ISR(mux) sim_enter_critical(mux)
+#define portEXIT_CRITICAL_ISR(mux)  sim_exit_critical(mux)
+#define portYIELD_FROM_ISR()        do { } while (0)
@@ -0,0 +1,18 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_ringbuf *RingbufHandle_t;
+
+typedef enum {
+    RINGBUF_TYPE_NOSPLIT = 0,
+    RINGBUF_TYPE_ALLOWSPLIT,
+    RINGBUF_TYPE_BYTEBUF,
+} RingbufferType_t;
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type);
+RingbufHandle_t xRingbufferCreateStatic(size_t size, RingbufferType_t type, uint8_t *storage,
+                                        StaticRingbuffer_t *buffer);
+UBaseType_t xRingbufferSend(RingbufHandle_t ring, const void *data, size_t size, TickType_t ticks_to_wait);
+void *xRingbufferReceive(RingbufHandle_t ring, size_t *size, TickType_t ticks_to_wait);
+void vRingbufferReturnItem(RingbufHandle_t ring, void *item);
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t ring);
@@ -0,0 +1,46 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef enum {
+    eRunning = 0,
+    eReady,
+    eBlocked,
+    eSuspended,
+    eDeleted,
+    eInvalid
+} eTaskState;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                                   void *param, UBaseType_t priority, TaskHandle_t *created_task,
+                                   BaseType_t core_id);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                                           void *param, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *tcb, BaseType_t core_id);
+
+static inline BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                                     void *param, UBaseType_t priority, TaskHandle_t *created_task)
+{
+    return xTaskCreatePinnedToCore(task, name, stack_depth, param, priority, created_task, tskNO_AFFINITY);
+}
+
+static inline TaskHandle_t xTaskCreateStatic(TaskFunction_t task, const char *name, uint32_t stack_depth,
+                                             void *param, UBaseType_t priority, StackType_t *stack,
+                                             StaticTask_t *tcb)
+{
+    return xTaskCreateStaticPinnedToCore(task, name, stack_depth, param, priority, stack, tcb, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task);
+void vTaskSuspend(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+eTaskState eTaskGetState(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+TickType_t xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
@@ -0,0 +1,30 @@
+// Host stand-in for the generated sdkconfig.h. The values mirror
+// current/sdkconfig, tests and benchmarks override single options by
+// including this header first and redefining them before main.c
+#pragma once
+
+#define CONFIG_IDF_TARGET "esp32"
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_IDF_FIRMWARE_CHIP_ID 0x0000
+#define CONFIG_ESP32_XTAL_FREQ 40
+#define CONFIG_FREERTOS_HZ 100
+#define CONFIG_FREERTOS_SUPPORT_STATIC_ALLOCATION 1
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_PM_ENABLE 1
+#define CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE 1
+#define CONFIG_WL_SECTOR_SIZE 4096
+
+#define CONFIG_OTA_CHUNK_SIZE 16384
+#define CONFIG_OTA_CHECKPOINT_SECTORS 32
+#define CONFIG_OTA_TRACE 1
+#define CONFIG_OTA_PROGRESS_PERCENT 10
+#define CONFIG_OTA_PROGRESS_INTERVAL_MS 1000
+#define CONFIG_OTA_DEFERRED_LOG 1
+#define CONFIG_OTA_DEFERRED_LOG_SIZE 4096
+#define CONFIG_OTA_HEALTH_TIMEOUT_MS 5000
+#define CONFIG_OTA_HEALTH_MIN_FREE_HEAP 16384
+#define CONFIG_OTA_SD_AUTOTUNE 1
+#define CONFIG_OTA_STATIC_MEMORY 1
+#define CONFIG_OTA_HEAP_CYCLE_TEST 0
+#define CONFIG_OTA_POWER_SAVE 1
+#define CONFIG_OTA_RECEIPT_LOG_SIZE 65536
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdio.h>
+#include "esp_err.h"
+#include "driver/sdmmc_types.h"
+
+void sdmmc_card_print_info(FILE *stream, const sdmmc_card_t *card);
+esp_err_t sdmmc_read_sectors(sdmmc_card_t *card, void *dst, size_t start_sector, size_t sector_count);
+esp_err_t sdmmc_write_sectors(sdmmc_card_t *card, const void *src, size_t start_sector, size_t sector_count);
@@ -0,0 +1,171 @@
+// Host simulation of the board the update apps run on. Flash, NVS and
+// the SD card are files in a work directory, the card bus and the flash
+// follow configurable latency models, and every boot of the app is a
+// child process, so restarts and power loss behave like on the device
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Latency models and board setup. Times are device time, the simulated
+// clock runs time_scale real seconds per device second
+typedef struct {
+    double time_scale;
+    int log_level;
+
+    // SD card. A read command costs card_command_us plus the transfer at
+    // the bus clock, capped at card_max_kbps. Reads through stdio and the
+    // FAT VFS add vfs_read_us per call and one command per cluster
+    uint32_t card_command_us;
+    uint32_t card_max_kbps;
+    uint32_t card_max_khz;
+    uint32_t vfs_read_us;
+    uint32_t card_mount_us;
+
+    // Flash. A 64 KB block erase is used where the range covers one
+    uint32_t flash_sector_erase_us;
+    uint32_t flash_block_erase_us;
+    uint32_t flash_write_kbps;
+    uint32_t flash_read_kbps;
+
+    // Internal RAM the heap allocator hands out
+    size_t heap_size;
+
+    // UART of the console the device logs to
+    uint32_t console_baud;
+
+    // Card detect and write protect pins of the board
+    int cd_gpio;
+    int wp_gpio;
+
+    // Real seconds a boot may run before it is killed
+    unsigned boot_timeout_s;
+} sim_config_t;
+
+extern sim_config_t sim_config;
+
+// Layout of the FAT volume built from a card directory for raw sector
+// reads. fragment_gap free clusters are left after every fragment_run
+// clusters of a file, 0 writes files contiguously
+typedef struct {
+    int fat_type;
+    int cluster_sectors;
+    int fragment_run;
+    int fragment_gap;
+} sim_card_layout_t;
+
+extern sim_card_layout_t sim_card_layout;
+
+// Counters of the current boot
+typedef struct {
+    uint64_t card_bytes_read;
+    uint64_t card_read_calls;
+    uint64_t card_commands;
+    int64_t card_busy_us;
+    uint64_t card_bytes_written;
+    uint32_t card_mounts;
+    uint64_t flash_bytes_written;
+    uint64_t flash_bytes_erased;
+    uint64_t flash_dirty_writes;
+    int64_t flash_busy_us;
+    uint32_t ota_set_boot_calls;
+    uint32_t pm_lock_acquires;
+    uint32_t task_wakeups;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+// Exit codes of a boot, see sim_boot
+#define SIM_EXIT_DONE       0
+#define SIM_EXIT_FAILED     1
+#define SIM_EXIT_RESTART    64
+#define SIM_EXIT_POWER_LOSS 65
+#define SIM_EXIT_ABORT      66
+
+// Work directory setup, done before the first boot
+void sim_init(const char *work_dir);
+const char *sim_work_path(const char *name, char *path, size_t size);
+
+// Flash
+void sim_flash_erase_all(void);
+bool sim_flash_load(const char *label, const char *image_path);
+bool sim_flash_read(const char *label, size_t offset, void *data, size_t size);
+const char *sim_boot_label(void);
+
+// Faults armed before a boot apply to that boot only. The power is cut
+// once flash_bytes more bytes were programmed, the card is pulled once
+// bytes more bytes were read from it, or stays in the slot but fails
+// every read once bytes more bytes were read
+void sim_power_loss_after(uint64_t flash_bytes);
+void sim_card_remove_after(uint64_t bytes);
+void sim_card_fail_reads_after(uint64_t bytes);
+
+// Recomputes the checksum and appended SHA-256 of an app image edited in
+// memory, so it is valid again
+bool sim_image_seal(uint8_t *image, size_t size);
+// Version in the app description of an image, NULL if it has none, and
+// a change of it that seals the image again
+const char *sim_image_version(const uint8_t *image, size_t size);
+bool sim_image_set_version(uint8_t *image, size_t size, const char *version);
+
+// Card contents, by card name. A card is a directory of the work dir
+const char *sim_card_path(const char *card, const char *file, char *path, size_t size);
+bool sim_card_put(const char *card, const char *file, const void *data, size_t size);
+bool sim_card_copy(const char *card, const char *file, const char *source_path);
+bool sim_card_exists(const char *card, const char *file);
+// Modification time of a file or directory of a card, 0 if it is missing
+time_t sim_card_mtime(const char *card, const char *file);
+bool sim_card_set_mtime(const char *card, const char *file, time_t mtime);
+void sim_card_clear(const char *card);
+
+// Card slot. Before the first boot these set the state the board powers
+// up with, during a boot they raise the card detect interrupt
+void sim_card_insert(const char *card);
+void sim_card_remove(void);
+void sim_card_set_write_protect(bool is_protected);
+void sim_gpio_set(int gpio, int level);
+
+// Boots the app in a child process and runs scenario there once
+// app_main returns. Returns the exit code of the boot, or SIM_EXIT_ABORT
+// when it crashed
+int sim_boot(void (*scenario)(void *arg), void *arg);
+extern void app_main(void);
+
+// Scenario helpers, in device time
+void sim_delay_ms(uint32_t ms);
+bool sim_wait_for(bool (*condition)(void), uint32_t timeout_ms);
+int64_t sim_time_us(void);
+void sim_set_restart_hook(void (*hook)(void));
+
+// Memory and stacks
+size_t sim_heap_peak(void);
+void sim_report_stacks(void);
+uint32_t sim_stack_used(const char *task_name);
+
+// Small file helpers for tests and benchmarks
+void *sim_read_file(const char *path, size_t *size);
+bool sim_write_file(const char *path, const void *data, size_t size);
+
+// Test fixtures. The work directory of a test is named after its
+// executable, sim_board_init starts it over with builds/current.bin in
+// the factory partition and nothing else on the board
+const char *sim_test_work_dir(const char *argv0);
+void sim_board_init(const char *work_dir);
+
+// Scenario that lets the app run until it restarts into another image
+void sim_run_until_restart(void *arg);
+
+// sim_check_installed checks that the last boot left image in ota_0 and
+// booting next, sim_expect_install boots until that happens
+void sim_check_installed(const void *image, size_t size);
+void sim_expect_install(const void *image, size_t size);
+
+// Ends the boot, or the test when called outside a boot, as failed
+void sim_fail(const char *file, int line, const char *expression) __attribute__((noreturn));
+
+#define SIM_CHECK(expression) do {                          \
+        if (!(expression)) {                                \
+            sim_fail(__FILE__, __LINE__, #expression);      \
+        }                                                   \
+    } while (0)
@@ -0,0 +1,764 @@
+// SD card slot, card detect and write protect pins, the SDMMC driver
+// and the FAT VFS. A card is a directory of the work directory; for raw
+// sector reads a FAT volume holding the same files is built from it
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#define SIM_NO_VFS_REDIRECT
+#include "esp_vfs_fat.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "driver/gpio.h"
+#include "driver/spi_common.h"
+#include "ff.h"
+#include "diskio_sdmmc.h"
+#include "sim_internal.h"
+
+#define GPIO_COUNT      40
+#define SECTOR_SIZE     512
+#define VOLUME_START    2048
+#define MAX_CARD_FILES  64
+#define MAX_OPEN_FILES  16
+
+static const char *TAG = "sim_card";
+
+// GPIO
+
+static int gpio_levels[GPIO_COUNT];
+static gpio_isr_t gpio_handlers[GPIO_COUNT];
+static void *gpio_handler_args[GPIO_COUNT];
+static gpio_int_type_t gpio_intr_types[GPIO_COUNT];
+static pthread_mutex_t gpio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sim_gpio_start(void)
+{
+    memset(gpio_handlers, 0, sizeof(gpio_handlers));
+    memset(gpio_intr_types, 0, sizeof(gpio_intr_types));
+}
+
+static bool is_intr_edge(gpio_int_type_t type, int level)
+{
+    switch (type) {
+    case GPIO_INTR_ANYEDGE:
+        return true;
+    case GPIO_INTR_POSEDGE:
+    case GPIO_INTR_HIGH_LEVEL:
+        return level == 1;
+    case GPIO_INTR_NEGEDGE:
+    case GPIO_INTR_LOW_LEVEL:
+        return level == 0;
+    default:
+        return false;
+    }
+}
+
+// Changes the level of an input pin, running its interrupt handler in
+// the calling thread as the ISR would
+void sim_gpio_set(int gpio, int level)
+{
+    pthread_mutex_lock(&gpio_lock);
+    bool is_changed = __atomic_exchange_n(&gpio_levels[gpio], level, __ATOMIC_SEQ_CST) != level;
+    gpio_isr_t handler = gpio_handlers[gpio];
+    bool is_raised = is_changed && handler != NULL && is_intr_edge(gpio_intr_types[gpio], level);
+    if (is_raised) {
+        handler(gpio_handler_args[gpio]);
+    }
+    pthread_mutex_unlock(&gpio_lock);
+}
+
+esp_err_t gpio_config(const gpio_config_t *config)
+{
+    for (int i = 0; i < GPIO_COUNT; i++) {
+        if (config->pin_bit_mask & (1ULL << i)) {
+            gpio_intr_types[i] = config->intr_type;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+    gpio_intr_types[gpio_num] = GPIO_INTR_DISABLE;
+    return ESP_OK;
+}
+
+void gpio_pad_select_gpio(uint8_t gpio_num)
+{
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    __atomic_store_n(&gpio_levels[gpio_num], level != 0, __ATOMIC_SEQ_CST);
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    return __atomic_load_n(&gpio_levels[gpio_num], __ATOMIC_SEQ_CST);
+}
+
+esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    gpio_intr_types[gpio_num] = intr_type;
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void *args)
+{
+    pthread_mutex_lock(&gpio_lock);
+    gpio_handlers[gpio_num] = isr_handler;
+    gpio_handler_args[gpio_num] = args;
+    pthread_mutex_unlock(&gpio_lock);
+    return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t *bus_config, int dma_chan)
+{
+    return ESP_OK;
+}
+
+esp_err_t spi_bus_free(spi_host_device_t host)
+{
+    return ESP_OK;
+}
+
+// Card slot
+
+// Host paths are kept off the task stacks, which are measured against
+// the stack sizes of the device
+#define HOST_PATH_SIZE 512
+
+typedef struct {
+    char path[256];
+    uint32_t size;
+    uint32_t first_cluster;
+} card_file_t;
+
+typedef struct {
+    FILE *file;
+    uint64_t position;
+    bool is_write;
+    bool has_error;
+} open_file_t;
+
+static char inserted_card[64];
+static bool is_write_protected;
+static uint64_t remove_budget = UINT64_MAX;
+static uint64_t read_error_budget = UINT64_MAX;
+static bool is_failing_reads;
+
+static bool is_mounted;
+static char mount_base[32];
+static char mount_dir[256];
+static int max_open_files;
+static int card_width;
+static sdmmc_card_t *mounted_card;
+static void *vfs_context;
+static open_file_t open_files[MAX_OPEN_FILES];
+static pthread_mutex_t card_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FAT volume of the mounted card
+static FATFS fatfs;
+static uint8_t *volume;
+static size_t volume_sectors;
+static card_file_t card_files[MAX_CARD_FILES];
+static int card_file_count;
+
+void sim_card_start(void)
+{
+    is_mounted = false;
+    is_failing_reads = false;
+    memset(open_files, 0, sizeof(open_files));
+}
+
+bool sim_card_is_present(void)
+{
+    return gpio_get_level(sim_config.cd_gpio) == 0 && inserted_card[0] != '\0';
+}
+
+void sim_card_insert(const char *card)
+{
+    strncpy(inserted_card, card, sizeof(inserted_card) - 1);
+    sim_gpio_set(sim_config.wp_gpio, is_write_protected);
+    sim_gpio_set(sim_config.cd_gpio, 0);
+}
+
+void sim_card_remove(void)
+{
+    sim_gpio_set(sim_config.cd_gpio, 1);
+    inserted_card[0] = '\0';
+}
+
+void sim_card_set_write_protect(bool is_protected)
+{
+    is_write_protected = is_protected;
+    sim_gpio_set(sim_config.wp_gpio, is_protected);
+}
+
+void sim_card_remove_after(uint64_t bytes)
+{
+    remove_budget = bytes;
+}
+
+void sim_card_fail_reads_after(uint64_t bytes)
+{
+    read_error_budget = bytes;
+}
+
+void sim_card_account_read(uint64_t bytes)
+{
+    sim_stats.card_bytes_read += bytes;
+    if (read_error_budget != UINT64_MAX) {
+        if (bytes >= read_error_budget) {
+            read_error_budget = UINT64_MAX;
+            is_failing_reads = true;
+            ESP_LOGW(TAG, "Card reads fail after %llu bytes", (unsigned long long)sim_stats.card_bytes_read);
+        } else {
+            read_error_budget -= bytes;
+        }
+    }
+    if (remove_budget == UINT64_MAX) {
+        return;
+    }
+    if (bytes >= remove_budget) {
+        remove_budget = UINT64_MAX;
+        ESP_LOGW(TAG, "Card pulled after %llu bytes", (unsigned long long)sim_stats.card_bytes_read);
+        sim_card_remove();
+    } else {
+        remove_budget -= bytes;
+    }
+}
+
+static uint32_t bus_kbps(void)
+{
+    uint32_t kbps = mounted_card->max_freq_khz * card_width / 8;
+    return (kbps < sim_config.card_max_kbps) ? kbps : sim_config.card_max_kbps;
+}
+
+// A command is issued and completed by code running from flash, the
+// data moves by DMA
+static void card_transfer(uint32_t commands, uint64_t bytes)
+{
+    sim_cache_wait();
+    int64_t us = (int64_t)commands * sim_config.card_command_us + (int64_t)bytes * 1000 / bus_kbps() * 1000 / 1024;
+    sim_delay_us(us);
+    sim_cache_wait();
+    sim_stats.card_commands += commands;
+    sim_stats.card_busy_us += us;
+}
+
+// FAT volume
+
+static uint32_t cluster_bytes(void)
+{
+    return sim_card_layout.cluster_sectors * SECTOR_SIZE;
+}
+
+static void scan_dir(const char *dir, const char *prefix)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL && card_file_count < MAX_CARD_FILES) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char *path = malloc(HOST_PATH_SIZE);
+        struct stat st;
+        snprintf(path, HOST_PATH_SIZE, "%s/%s", dir, entry->d_name);
+        card_file_t *file = &card_files[card_file_count];
+        snprintf(file->path, sizeof(file->path), "%s%s", prefix, entry->d_name);
+        bool is_found = stat(path, &st) == 0;
+        if (is_found && S_ISDIR(st.st_mode)) {
+            char *sub_prefix = malloc(sizeof(file->path) + 2);
+            snprintf(sub_prefix, sizeof(file->path) + 2, "%s/", file->path);
+            scan_dir(path, sub_prefix);
+            free(sub_prefix);
+        } else if (is_found && S_ISREG(st.st_mode)) {
+            file->size = st.st_size;
+            card_file_count++;
+        }
+        free(path);
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+}
+
+static void set_fat_entry(uint32_t cluster, uint32_t value)
+{
+    for (int copy = 0; copy < fatfs.n_fats; copy++) {
+        uint8_t *fat = volume + (size_t)(fatfs.fatbase + copy * fatfs.fsize) * SECTOR_SIZE;
+        if (fatfs.fs_type == FS_FAT32) {
+            fat[cluster * 4] = value;
+            fat[cluster * 4 + 1] = value >> 8;
+            fat[cluster * 4 + 2] = value >> 16;
+            fat[cluster * 4 + 3] = value >> 24;
+        } else {
+            fat[cluster * 2] = value;
+            fat[cluster * 2 + 1] = value >> 8;
+        }
+    }
+}
+
+// Lays the card files out in clusters, fragmented as sim_card_layout
+// asks, and copies their content into the volume
+static void build_volume(void)
+{
+    bool is_fat32 = sim_card_layout.fat_type == 32;
+    uint32_t first_cluster = is_fat32 ? 3 : 2;
+    uint32_t cluster = first_cluster;
+    card_file_count = 0;
+    scan_dir(mount_dir, "");
+    for (int i = 0; i < card_file_count; i++) {
+        uint32_t clusters = (card_files[i].size + cluster_bytes() - 1) / cluster_bytes();
+        card_files[i].first_cluster = (clusters > 0) ? cluster : 0;
+        for (uint32_t n = 1; n <= clusters; n++) {
+            cluster++;
+            if (sim_card_layout.fragment_run > 0 && n % sim_card_layout.fragment_run == 0) {
+                cluster += sim_card_layout.fragment_gap;
+            }
+        }
+    }
+    uint32_t n_fatent = cluster + 16;
+    uint32_t entry_size = is_fat32 ? 4 : 2;
+    memset(&fatfs, 0, sizeof(fatfs));
+    fatfs.fs_type = is_fat32 ? FS_FAT32 : FS_FAT16;
+    fatfs.n_fats = 2;
+    fatfs.csize = sim_card_layout.cluster_sectors;
+    fatfs.ssize = SECTOR_SIZE;
+    fatfs.n_fatent = n_fatent;
+    fatfs.fsize = (n_fatent * entry_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    fatfs.volbase = VOLUME_START;
+    fatfs.fatbase = VOLUME_START + (is_fat32 ? 32 : 1);
+    fatfs.n_rootdir = is_fat32 ? 0 : 512;
+    fatfs.dirbase = is_fat32 ? 2 : fatfs.fatbase + fatfs.n_fats * fatfs.fsize;
+    fatfs.database = fatfs.fatbase + fatfs.n_fats * fatfs.fsize + fatfs.n_rootdir * 32 / SECTOR_SIZE;
+    volume_sectors = fatfs.database + (size_t)(n_fatent - 2) * fatfs.csize;
+    free(volume);
+    volume = calloc(volume_sectors, SECTOR_SIZE);
+
+    set_fat_entry(0, is_fat32 ? 0x0ffffff8 : 0xfff8);
+    set_fat_entry(1, is_fat32 ? 0x0fffffff : 0xffff);
+    if (is_fat32) {
+        set_fat_entry(2, 0x0fffffff);
+    }
+    uint32_t end_of_chain = is_fat32 ? 0x0fffffff : 0xffff;
+    for (int i = 0; i < card_file_count; i++) {
+        card_file_t *file = &card_files[i];
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", mount_dir, file->path);
+        size_t size;
+        uint8_t *data = sim_read_file(path, &size);
+        uint32_t offset = 0;
+        uint32_t current = file->first_cluster;
+        for (uint32_t n = 1; data != NULL && offset < file->size; n++) {
+            uint32_t length = file->size - offset;
+            if (length > cluster_bytes()) {
+                length = cluster_bytes();
+            }
+            memcpy(volume + ((size_t)fatfs.database + (size_t)(current - 2) * fatfs.csize) * SECTOR_SIZE,
+                   data + offset, length);
+            offset += length;
+            uint32_t next = current + 1;
+            if (sim_card_layout.fragment_run > 0 && n % sim_card_layout.fragment_run == 0) {
+                next += sim_card_layout.fragment_gap;
+            }
+            set_fat_entry(current, (offset < file->size) ? next : end_of_chain);
+            current = next;
+        }
+        free(data);
+    }
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode)
+{
+    const char *colon = strchr(path, ':');
+    const char *name = (colon != NULL) ? colon + 1 : path;
+    while (*name == '/') {
+        name++;
+    }
+    memset(fp, 0, sizeof(*fp));
+    if (!is_mounted || !sim_card_is_present()) {
+        return FR_NOT_READY;
+    }
+    if (mode & FA_WRITE) {
+        return FR_DENIED;
+    }
+    build_volume();
+    // The directory lookup reads a FAT and a directory sector
+    card_transfer(2, 2 * SECTOR_SIZE);
+    for (int i = 0; i < card_file_count; i++) {
+        if (strcmp(card_files[i].path, name) == 0) {
+            fp->obj.fs = &fatfs;
+            fp->obj.sclust = card_files[i].first_cluster;
+            fp->obj.objsize = card_files[i].size;
+            fp->flag = mode;
+            return FR_OK;
+        }
+    }
+    return FR_NO_FILE;
+}
+
+FRESULT f_close(FIL *fp)
+{
+    fp->obj.fs = NULL;
+    return FR_OK;
+}
+
+BYTE ff_diskio_get_pdrv_card(const sdmmc_card_t *card)
+{
+    return 0;
+}
+
+// SDMMC
+
+esp_err_t sdmmc_read_sectors(sdmmc_card_t *card, void *dst, size_t start_sector, size_t sector_count)
+{
+    if (!sim_card_is_present() || card != mounted_card) {
+        return ESP_ERR_TIMEOUT;
+    }
+    sim_stats.card_read_calls++;
+    card_transfer(1, (uint64_t)sector_count * SECTOR_SIZE);
+    if (card->max_freq_khz > sim_config.card_max_khz || is_failing_reads) {
+        return ESP_ERR_INVALID_CRC;
+    }
+    for (size_t i = 0; i < sector_count; i++) {
+        uint8_t *sector = (uint8_t *)dst + i * SECTOR_SIZE;
+        if (start_sector + i < volume_sectors) {
+            memcpy(sector, volume + (start_sector + i) * SECTOR_SIZE, SECTOR_SIZE);
+        } else {
+            memset(sector, 0, SECTOR_SIZE);
+        }
+    }
+    sim_card_account_read((uint64_t)sector_count * SECTOR_SIZE);
+    return ESP_OK;
+}
+
+esp_err_t sdmmc_write_sectors(sdmmc_card_t *card, const void *src, size_t start_sector, size_t sector_count)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void sdmmc_card_print_info(FILE *stream, const sdmmc_card_t *card)
+{
+    fprintf(stream, "Name: %s\n", card->cid.name);
+    fprintf(stream, "Type: SDHC/SDXC\n");
+    fprintf(stream, "Speed: %s\n", (card->max_freq_khz > SDMMC_FREQ_DEFAULT) ? "high speed" : "default speed");
+    fprintf(stream, "Size: %lluMB\n", (unsigned long long)card->csd.capacity * card->csd.sector_size / (1024 * 1024));
+}
+
+// Mounting
+
+static esp_err_t mount(const char *base_path, const sdmmc_host_t *host_config, int width,
+                       const esp_vfs_fat_mount_config_t *mount_config, sdmmc_card_t **out_card)
+{
+    pthread_mutex_lock(&card_lock);
+    if (is_mounted) {
+        pthread_mutex_unlock(&card_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    pthread_mutex_unlock(&card_lock);
+    sim_delay_us(sim_config.card_mount_us);
+    if (!sim_card_is_present()) {
+        return ESP_ERR_TIMEOUT;
+    }
+    char dir[256];
+    struct stat st;
+    sim_card_path(inserted_card, NULL, dir, sizeof(dir));
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return ESP_FAIL;
+    }
+
+    // The card structure and the VFS context with its FATFS and one FIL
+    // per file that may be open are allocated as in the IDF
+    sdmmc_card_t *card = heap_caps_malloc(sizeof(sdmmc_card_t), MALLOC_CAP_DEFAULT);
+    void *context = heap_caps_malloc(sizeof(FATFS) + 128 + mount_config->max_files * sizeof(FIL), MALLOC_CAP_DEFAULT);
+    if (card == NULL || context == NULL) {
+        heap_caps_free(card);
+        heap_caps_free(context);
+        return ESP_ERR_NO_MEM;
+    }
+    memset(card, 0, sizeof(*card));
+    card->host = *host_config;
+    card->is_mem = 1;
+    card->max_freq_khz = (host_config->max_freq_khz < SDMMC_FREQ_HIGHSPEED)
+                         ? host_config->max_freq_khz : SDMMC_FREQ_HIGHSPEED;
+    card->log_bus_width = (width == 4) ? 2 : 0;
+    snprintf(card->cid.name, sizeof(card->cid.name), "SIM%.4s", inserted_card);
+    card->cid.mfg_id = 3;
+    card->cid.serial = (int)crc32(0, (const Bytef *)inserted_card, strlen(inserted_card));
+    card->csd.capacity = 15523840;
+    card->csd.sector_size = SECTOR_SIZE;
+
+    pthread_mutex_lock(&card_lock);
+    strncpy(mount_base, base_path, sizeof(mount_base) - 1);
+    strcpy(mount_dir, dir);
+    max_open_files = mount_config->max_files;
+    card_width = (width == 4) ? 4 : 1;
+    mounted_card = card;
+    vfs_context = context;
+    is_mounted = true;
+    build_volume();
+    pthread_mutex_unlock(&card_lock);
+    sim_stats.card_mounts++;
+    *out_card = card;
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_sdmmc_mount(const char *base_path, const sdmmc_host_t *host_config,
+                                  const void *slot_config, const esp_vfs_fat_mount_config_t *mount_config,
+                                  sdmmc_card_t **out_card)
+{
+    int width = ((const sdmmc_slot_config_t *)slot_config)->width;
+    return mount(base_path, host_config, (width == 0) ? 4 : width, mount_config, out_card);
+}
+
+esp_err_t esp_vfs_fat_sdspi_mount(const char *base_path, const sdmmc_host_t *host_config_input,
+                                  const sdspi_device_config_t *slot_config,
+                                  const esp_vfs_fat_mount_config_t *mount_config, sdmmc_card_t **out_card)
+{
+    return mount(base_path, host_config_input, 1, mount_config, out_card);
+}
+
+esp_err_t esp_vfs_fat_sdcard_unmount(const char *base_path, sdmmc_card_t *card)
+{
+    pthread_mutex_lock(&card_lock);
+    if (!is_mounted || card != mounted_card || strcmp(base_path, mount_base) != 0) {
+        pthread_mutex_unlock(&card_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].file != NULL) {
+            ESP_LOGW(TAG, "Card unmounted with a file still open");
+        }
+    }
+    is_mounted = false;
+    mounted_card = NULL;
+    heap_caps_free(vfs_context);
+    heap_caps_free(card);
+    vfs_context = NULL;
+    pthread_mutex_unlock(&card_lock);
+    return ESP_OK;
+}
+
+// VFS
+
+// Maps a path under the mount point to the card directory. Returns NULL
+// with errno set when the card is not mounted
+static const char *card_path(const char *path, char *host_path, size_t size)
+{
+    size_t base_length = strlen(mount_base);
+    if (!is_mounted || strncmp(path, mount_base, base_length) != 0
+            || (path[base_length] != '/' && path[base_length] != '\0')) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (!sim_card_is_present()) {
+        errno = EIO;
+        return NULL;
+    }
+    snprintf(host_path, size, "%s%s", mount_dir, path + base_length);
+    return host_path;
+}
+
+static open_file_t *find_open_file(FILE *stream)
+{
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].file == stream && stream != NULL) {
+            return &open_files[i];
+        }
+    }
+    return NULL;
+}
+
+FILE *sim_vfs_fopen(const char *path, const char *mode)
+{
+    static __thread char host_path[HOST_PATH_SIZE];
+    pthread_mutex_lock(&card_lock);
+    if (card_path(path, host_path, sizeof(host_path)) == NULL) {
+        pthread_mutex_unlock(&card_lock);
+        return NULL;
+    }
+    int count = 0;
+    open_file_t *slot = NULL;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].file != NULL) {
+            count++;
+        } else if (slot == NULL) {
+            slot = &open_files[i];
+        }
+    }
+    // The VFS has room for max_files open files
+    if (count >= max_open_files || slot == NULL) {
+        pthread_mutex_unlock(&card_lock);
+        errno = ENFILE;
+        return NULL;
+    }
+    FILE *file = fopen(host_path, mode);
+    if (file != NULL) {
+        slot->file = file;
+        slot->position = 0;
+        slot->is_write = strpbrk(mode, "wa+") != NULL;
+        slot->has_error = false;
+    }
+    pthread_mutex_unlock(&card_lock);
+    if (file != NULL) {
+        card_transfer(2, 2 * SECTOR_SIZE);
+    }
+    return file;
+}
+
+int sim_vfs_fclose(FILE *stream)
+{
+    pthread_mutex_lock(&card_lock);
+    open_file_t *open_file = find_open_file(stream);
+    if (open_file != NULL) {
+        open_file->file = NULL;
+    }
+    pthread_mutex_unlock(&card_lock);
+    return fclose(stream);
+}
+
+// A read through stdio and FatFs costs the VFS call, then one command per
+// cluster touched, plus one for a partial first sector
+size_t sim_vfs_fread(void *ptr, size_t size, size_t count, FILE *stream)
+{
+    pthread_mutex_lock(&card_lock);
+    open_file_t *open_file = find_open_file(stream);
+    pthread_mutex_unlock(&card_lock);
+    if (open_file == NULL) {
+        return fread(ptr, size, count, stream);
+    }
+    if (!sim_card_is_present() || !is_mounted || is_failing_reads) {
+        open_file->has_error = true;
+        errno = EIO;
+        return 0;
+    }
+    uint64_t position = ftell(stream);
+    size_t items = fread(ptr, size, count, stream);
+    uint64_t bytes = (uint64_t)items * size;
+    if (bytes > 0) {
+        uint64_t first = position / cluster_bytes();
+        uint64_t last = (position + bytes - 1) / cluster_bytes();
+        uint32_t commands = (uint32_t)(last - first + 1) + ((position % SECTOR_SIZE != 0) ? 1 : 0);
+        sim_delay_us(sim_config.vfs_read_us);
+        sim_stats.card_read_calls++;
+        card_transfer(commands, bytes);
+        sim_card_account_read(bytes);
+    }
+    return items;
+}
+
+int sim_vfs_ferror(FILE *stream)
+{
+    pthread_mutex_lock(&card_lock);
+    open_file_t *open_file = find_open_file(stream);
+    bool has_error = open_file != NULL && open_file->has_error;
+    pthread_mutex_unlock(&card_lock);
+    return has_error || ferror(stream);
+}
+
+size_t sim_vfs_fwrite(const void *ptr, size_t size, size_t count, FILE *stream)
+{
+    pthread_mutex_lock(&card_lock);
+    open_file_t *open_file = find_open_file(stream);
+    pthread_mutex_unlock(&card_lock);
+    if (open_file == NULL) {
+        return fwrite(ptr, size, count, stream);
+    }
+    if (!sim_card_is_present() || !is_mounted) {
+        errno = EIO;
+        return 0;
+    }
+    size_t items = fwrite(ptr, size, count, stream);
+    sim_delay_us(sim_config.vfs_read_us);
+    card_transfer(1, (uint64_t)items * size);
+    sim_stats.card_bytes_written += (uint64_t)items * size;
+    return items;
+}
+
+int sim_vfs_stat(const char *path, struct stat *st)
+{
+    static __thread char host_path[HOST_PATH_SIZE];
+    if (card_path(path, host_path, sizeof(host_path)) == NULL) {
+        return -1;
+    }
+    card_transfer(1, SECTOR_SIZE);
+    return stat(host_path, st);
+}
+
+int sim_vfs_unlink(const char *path)
+{
+    static __thread char host_path[HOST_PATH_SIZE];
+    if (card_path(path, host_path, sizeof(host_path)) == NULL) {
+        return -1;
+    }
+    return unlink(host_path);
+}
+
+int sim_vfs_rename(const char *from, const char *to)
+{
+    static __thread char host_from[HOST_PATH_SIZE];
+    static __thread char host_to[HOST_PATH_SIZE];
+    if (card_path(from, host_from, sizeof(host_from)) == NULL || card_path(to, host_to, sizeof(host_to)) == NULL) {
+        return -1;
+    }
+    // FatFs does not replace an existing file
+    struct stat st;
+    if (stat(host_to, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(host_from, host_to);
+}
+
+int sim_vfs_mkdir(const char *path, mode_t mode)
+{
+    static __thread char host_path[HOST_PATH_SIZE];
+    if (card_path(path, host_path, sizeof(host_path)) == NULL) {
+        return -1;
+    }
+    return mkdir(host_path, mode);
+}
+
+DIR *sim_vfs_opendir(const char *path)
+{
+    static __thread char host_path[HOST_PATH_SIZE];
+    if (card_path(path, host_path, sizeof(host_path)) == NULL) {
+        return NULL;
+    }
+    return opendir(host_path);
+}
+
+// FatFs lists no . and .. entries
+struct dirent *sim_vfs_readdir(DIR *dir)
+{
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)) {
+    }
+    return entry;
+}
@@ -0,0 +1,43 @@
+// Board setup and checks shared by the tests
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include "sim_internal.h"
+
+const char *sim_test_work_dir(const char *argv0)
+{
+    static char path[256];
+    char name[256];
+    snprintf(name, sizeof(name), "%s", argv0);
+    snprintf(path, sizeof(path), SIM_WORK_DIR "/%s", basename(name));
+    return path;
+}
+
+void sim_board_init(const char *work_dir)
+{
+    sim_init(work_dir);
+    SIM_CHECK(sim_flash_load("factory", SIM_BUILDS_DIR "/current.bin"));
+}
+
+void sim_run_until_restart(void *arg)
+{
+    // Returns only if the app never restarted
+    sim_delay_ms(60000);
+}
+
+void sim_check_installed(const void *image, size_t size)
+{
+    uint8_t *written = malloc(size);
+    SIM_CHECK(written != NULL);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+    SIM_CHECK(sim_flash_read("ota_0", 0, written, size));
+    SIM_CHECK(memcmp(written, image, size) == 0);
+    free(written);
+}
+
+void sim_expect_install(const void *image, size_t size)
+{
+    SIM_CHECK(sim_boot(sim_run_until_restart, NULL) == SIM_EXIT_RESTART);
+    sim_check_installed(image, size);
+}
@@ -0,0 +1,724 @@
+// SPI flash with the board's partition table, kept in flash.bin of the
+// work directory. Writes can only clear bits, as on NOR flash, and the
+// OTA data partition holds the boot selection the simulated bootloader
+// acts on at every boot
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "mbedtls/sha256.h"
+#include "sim_internal.h"
+
+#define FLASH_SIZE        (4 * 1024 * 1024)
+#define FLASH_BLOCK_SIZE  (64 * 1024)
+#define FLASH_PAGE_SIZE   256
+#define OTADATA_MAGIC     0x41544f53
+#define NO_SLOT           -1
+
+static const char *TAG = "sim_flash";
+
+// The two OTA slot layout of the board, plus a data partition bundles
+// can write to
+static const esp_partition_t partitions[] = {
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x4000, "nvs", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0xd000, 0x2000, "otadata", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_PHY, 0xf000, 0x1000, "phy_init", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, 0x10000, 0x100000, "factory", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x110000, 0x100000, "ota_0", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x210000, 0x100000, "ota_1", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x310000, 0x40000, "storage", false },
+};
+
+#define PARTITION_COUNT (sizeof(partitions) / sizeof(partitions[0]))
+#define FACTORY   (&partitions[3])
+#define OTA_SLOT(n) (&partitions[4 + (n)])
+#define OTADATA   (&partitions[1])
+
+typedef struct {
+    uint32_t magic;
+    int32_t boot_slot;
+    uint32_t state[2];
+} otadata_t;
+
+typedef struct {
+    const esp_partition_t *partition;
+    size_t wrote_size;
+    size_t erased_size;
+    void *heap_block;
+} ota_handle_entry_t;
+
+static uint8_t *flash;
+static const esp_partition_t *running;
+static esp_app_desc_t running_desc;
+static ota_handle_entry_t ota_handles[4];
+static uint64_t power_loss_budget = UINT64_MAX;
+
+// While the flash is busy the caches are off and code running from flash
+// on either core stalls, the card driver included. Tasks get the cache
+// back in the order they waited for it
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_turn = PTHREAD_COND_INITIALIZER;
+static uint64_t cache_next_ticket;
+static uint64_t cache_serving;
+
+static uint8_t *flash_map(void)
+{
+    if (flash != NULL) {
+        return flash;
+    }
+    char path[256];
+    sim_work_path("flash.bin", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, FLASH_SIZE) != 0) {
+        perror(path);
+        exit(SIM_EXIT_FAILED);
+    }
+    flash = mmap(NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (flash == MAP_FAILED) {
+        perror("mmap");
+        exit(SIM_EXIT_FAILED);
+    }
+    return flash;
+}
+
+static const esp_partition_t *find_label(const char *label)
+{
+    for (size_t i = 0; i < PARTITION_COUNT; i++) {
+        if (strcmp(partitions[i].label, label) == 0) {
+            return &partitions[i];
+        }
+    }
+    return NULL;
+}
+
+static void cache_acquire(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    uint64_t ticket = cache_next_ticket++;
+    while (ticket != cache_serving) {
+        pthread_cond_wait(&cache_turn, &cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_release(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_serving++;
+    pthread_cond_broadcast(&cache_turn);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void flash_busy(int64_t us)
+{
+    cache_acquire();
+    sim_stats.flash_busy_us += us;
+    sim_delay_us(us);
+    cache_release();
+}
+
+void sim_cache_wait(void)
+{
+    cache_acquire();
+    cache_release();
+}
+
+void sim_power_loss_after(uint64_t flash_bytes)
+{
+    power_loss_budget = flash_bytes;
+}
+
+// Raw flash access
+
+static esp_err_t flash_erase(uint32_t address, uint32_t size)
+{
+    if (address % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0 || address + size > FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t *base = flash_map();
+    uint32_t end = address + size;
+    while (address < end) {
+        uint32_t step = SPI_FLASH_SEC_SIZE;
+        uint32_t us = sim_config.flash_sector_erase_us;
+        if (address % FLASH_BLOCK_SIZE == 0 && end - address >= FLASH_BLOCK_SIZE) {
+            step = FLASH_BLOCK_SIZE;
+            us = sim_config.flash_block_erase_us;
+        }
+        memset(base + address, 0xff, step);
+        flash_busy(us);
+        sim_stats.flash_bytes_erased += step;
+        address += step;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t flash_write(uint32_t address, const void *data, size_t size)
+{
+    if (address + size > FLASH_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t *target = flash_map() + address;
+    const uint8_t *source = data;
+    size_t length = size;
+    bool is_power_lost = false;
+    if (length > power_loss_budget) {
+        length = power_loss_budget;
+        is_power_lost = true;
+    }
+    if (power_loss_budget != UINT64_MAX) {
+        power_loss_budget -= length;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if ((target[i] & source[i]) != source[i]) {
+            sim_stats.flash_dirty_writes++;
+        }
+        target[i] &= source[i];
+    }
+    sim_stats.flash_bytes_written += length;
+    // The caches come back between page programs
+    for (size_t offset = 0; offset < length; offset += FLASH_PAGE_SIZE) {
+        size_t page = (length - offset < FLASH_PAGE_SIZE) ? length - offset : FLASH_PAGE_SIZE;
+        flash_busy((int64_t)page * 1000000 / ((int64_t)sim_config.flash_write_kbps * 1024));
+    }
+    if (is_power_lost) {
+        ESP_LOGW(TAG, "Power lost while writing 0x%x", (unsigned)(address + length));
+        sim_exit(SIM_EXIT_POWER_LOSS);
+    }
+    return ESP_OK;
+}
+
+// Partitions
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    for (size_t i = 0; i < PARTITION_COUNT; i++) {
+        const esp_partition_t *p = &partitions[i];
+        if (p->type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p->subtype == subtype)
+                && (label == NULL || strcmp(p->label, label) == 0)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    if (src_offset > partition->size || size > partition->size - src_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, flash_map() + partition->address + src_offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    if (dst_offset > partition->size || size > partition->size - dst_offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return flash_write(partition->address + dst_offset, src, size);
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return flash_erase(partition->address + offset, size);
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             spi_flash_mmap_memory_t memory, const void **out_ptr,
+                             spi_flash_mmap_handle_t *out_handle)
+{
+    if (offset > partition->size || size > partition->size - offset) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *out_ptr = flash_map() + partition->address + offset;
+    *out_handle = partition->address + offset;
+    return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+}
+
+// Images
+
+// Checks the image header, segments, checksum and appended hash the way
+// the bootloader does, at flash read speed
+static esp_err_t verify_image(uint32_t address, uint32_t size, esp_image_metadata_t *data)
+{
+    const uint8_t *image = flash_map() + address;
+    esp_image_header_t header;
+    memset(data, 0, sizeof(*data));
+    data->start_addr = address;
+    if (size < sizeof(header)) {
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    memcpy(&header, image, sizeof(header));
+    data->image = header;
+    if (header.magic != ESP_IMAGE_HEADER_MAGIC || header.segment_count == 0
+            || header.segment_count > ESP_IMAGE_MAX_SEGMENTS) {
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    uint32_t offset = sizeof(header);
+    uint8_t checksum = 0xef;
+    for (int i = 0; i < header.segment_count; i++) {
+        esp_image_segment_header_t segment;
+        if (offset + sizeof(segment) > size) {
+            return ESP_ERR_IMAGE_INVALID;
+        }
+        memcpy(&segment, image + offset, sizeof(segment));
+        offset += sizeof(segment);
+        if (segment.data_len > size - offset) {
+            return ESP_ERR_IMAGE_INVALID;
+        }
+        data->segments[i] = segment;
+        data->segment_data[i] = address + offset;
+        for (uint32_t j = 0; j < segment.data_len; j++) {
+            checksum ^= image[offset + j];
+        }
+        offset += segment.data_len;
+    }
+    // The checksum byte ends the image, padded to 16 bytes
+    offset = (offset + 16) & ~15u;
+    if (offset > size || image[offset - 1] != checksum) {
+        return ESP_ERR_IMAGE_INVALID;
+    }
+    if (header.hash_appended) {
+        if (offset + 32 > size) {
+            return ESP_ERR_IMAGE_INVALID;
+        }
+        mbedtls_sha256_ret(image, offset, data->image_digest, 0);
+        if (memcmp(data->image_digest, image + offset, 32) != 0) {
+            return ESP_ERR_IMAGE_INVALID;
+        }
+        offset += 32;
+    }
+    data->image_len = offset;
+    sim_delay_us((int64_t)offset * 1000000 / ((int64_t)sim_config.flash_read_kbps * 1024));
+    return ESP_OK;
+}
+
+bool sim_image_seal(uint8_t *image, size_t size)
+{
+    esp_image_header_t header;
+    if (size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, image, sizeof(header));
+    size_t offset = sizeof(header);
+    uint8_t checksum = 0xef;
+    for (int i = 0; i < header.segment_count; i++) {
+        esp_image_segment_header_t segment;
+        if (offset + sizeof(segment) > size) {
+            return false;
+        }
+        memcpy(&segment, image + offset, sizeof(segment));
+        offset += sizeof(segment);
+        if (segment.data_len > size - offset) {
+            return false;
+        }
+        for (uint32_t j = 0; j < segment.data_len; j++) {
+            checksum ^= image[offset + j];
+        }
+        offset += segment.data_len;
+    }
+    offset = (offset + 16) & ~(size_t)15;
+    if (offset + (header.hash_appended ? 32 : 0) > size) {
+        return false;
+    }
+    image[offset - 1] = checksum;
+    if (header.hash_appended) {
+        mbedtls_sha256_ret(image, offset, image + offset, 0);
+    }
+    return true;
+}
+
+static esp_app_desc_t *image_app_desc(const uint8_t *image, size_t size)
+{
+    size_t offset = sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t);
+    if (size < offset + sizeof(esp_app_desc_t)) {
+        return NULL;
+    }
+    esp_app_desc_t *desc = (esp_app_desc_t *)(image + offset);
+    return (desc->magic_word == ESP_APP_DESC_MAGIC_WORD) ? desc : NULL;
+}
+
+const char *sim_image_version(const uint8_t *image, size_t size)
+{
+    const esp_app_desc_t *desc = image_app_desc(image, size);
+    return (desc != NULL) ? desc->version : NULL;
+}
+
+bool sim_image_set_version(uint8_t *image, size_t size, const char *version)
+{
+    esp_app_desc_t *desc = image_app_desc(image, size);
+    if (desc == NULL) {
+        return false;
+    }
+    memset(desc->version, 0, sizeof(desc->version));
+    strncpy(desc->version, version, sizeof(desc->version) - 1);
+    return sim_image_seal(image, size);
+}
+
+esp_err_t esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *part, esp_image_metadata_t *data)
+{
+    return verify_image(part->offset, part->size, data);
+}
+
+static bool is_image_valid(const esp_partition_t *partition)
+{
+    esp_image_metadata_t data;
+    return verify_image(partition->address, partition->size, &data) == ESP_OK;
+}
+
+// OTA data and the bootloader
+
+static otadata_t read_otadata(void)
+{
+    otadata_t otadata;
+    memcpy(&otadata, flash_map() + OTADATA->address, sizeof(otadata));
+    if (otadata.magic != OTADATA_MAGIC) {
+        otadata.magic = OTADATA_MAGIC;
+        otadata.boot_slot = NO_SLOT;
+        otadata.state[0] = ESP_OTA_IMG_UNDEFINED;
+        otadata.state[1] = ESP_OTA_IMG_UNDEFINED;
+    }
+    return otadata;
+}
+
+static void write_otadata(const otadata_t *otadata)
+{
+    flash_erase(OTADATA->address, SPI_FLASH_SEC_SIZE);
+    flash_write(OTADATA->address, otadata, sizeof(*otadata));
+}
+
+static int slot_of(const esp_partition_t *partition)
+{
+    for (int i = 0; i < 2; i++) {
+        if (partition == OTA_SLOT(i)) {
+            return i;
+        }
+    }
+    return NO_SLOT;
+}
+
+static const esp_partition_t *partition_of(int slot)
+{
+    return (slot == NO_SLOT) ? FACTORY : OTA_SLOT(slot);
+}
+
+// The app to fall back to when the selected one fails
+static int fallback_slot(const otadata_t *otadata, int failed)
+{
+    int other = (failed == NO_SLOT) ? NO_SLOT : 1 - failed;
+    if (other != NO_SLOT && otadata->state[other] == ESP_OTA_IMG_VALID && is_image_valid(OTA_SLOT(other))) {
+        return other;
+    }
+    return NO_SLOT;
+}
+
+static void run_bootloader(void)
+{
+    otadata_t otadata = read_otadata();
+    int slot = otadata.boot_slot;
+    if (slot != NO_SLOT) {
+        uint32_t state = otadata.state[slot];
+        if (state == ESP_OTA_IMG_NEW) {
+            otadata.state[slot] = ESP_OTA_IMG_PENDING_VERIFY;
+        } else if (state == ESP_OTA_IMG_PENDING_VERIFY) {
+            // Reset before the app confirmed itself
+            otadata.state[slot] = ESP_OTA_IMG_ABORTED;
+        }
+        if (otadata.state[slot] == ESP_OTA_IMG_ABORTED || otadata.state[slot] == ESP_OTA_IMG_INVALID
+                || !is_image_valid(OTA_SLOT(slot))) {
+            slot = fallback_slot(&otadata, slot);
+            otadata.boot_slot = slot;
+        }
+        write_otadata(&otadata);
+    }
+    running = partition_of(slot);
+    memcpy(&running_desc, flash_map() + running->address + sizeof(esp_image_header_t)
+           + sizeof(esp_image_segment_header_t), sizeof(running_desc));
+    if (running_desc.magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        fprintf(stderr, "No app in %s\n", running->label);
+        sim_exit(SIM_EXIT_FAILED);
+    }
+}
+
+const char *sim_boot_label(void)
+{
+    otadata_t otadata = read_otadata();
+    int slot = otadata.boot_slot;
+    if (slot != NO_SLOT && otadata.state[slot] != ESP_OTA_IMG_INVALID
+            && otadata.state[slot] != ESP_OTA_IMG_ABORTED) {
+        return OTA_SLOT(slot)->label;
+    }
+    return FACTORY->label;
+}
+
+void sim_flash_start(void)
+{
+    flash_map();
+    memset(ota_handles, 0, sizeof(ota_handles));
+    run_bootloader();
+}
+
+void sim_flash_erase_all(void)
+{
+    memset(flash_map(), 0xff, FLASH_SIZE);
+}
+
+bool sim_flash_load(const char *label, const char *image_path)
+{
+    const esp_partition_t *partition = find_label(label);
+    size_t size;
+    uint8_t *image = sim_read_file(image_path, &size);
+    if (partition == NULL || image == NULL || size > partition->size) {
+        free(image);
+        return false;
+    }
+    memset(flash_map() + partition->address, 0xff, partition->size);
+    memcpy(flash_map() + partition->address, image, size);
+    free(image);
+    return true;
+}
+
+bool sim_flash_read(const char *label, size_t offset, void *data, size_t size)
+{
+    const esp_partition_t *partition = find_label(label);
+    if (partition == NULL || offset + size > partition->size) {
+        return false;
+    }
+    memcpy(data, flash_map() + partition->address + offset, size);
+    return true;
+}
+
+// OTA
+
+const esp_app_desc_t *esp_ota_get_app_description(void)
+{
+    return &running_desc;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return running;
+}
+
+const esp_partition_t *esp_ota_get_boot_partition(void)
+{
+    otadata_t otadata = read_otadata();
+    return partition_of(otadata.boot_slot);
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    if (start_from == NULL) {
+        start_from = running;
+    }
+    int slot = slot_of(start_from);
+    return OTA_SLOT((slot == NO_SLOT) ? 0 : 1 - slot);
+}
+
+esp_err_t esp_ota_get_partition_description(const esp_partition_t *partition, esp_app_desc_t *app_desc)
+{
+    if (partition == NULL || app_desc == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(app_desc, flash_map() + partition->address + sizeof(esp_image_header_t)
+           + sizeof(esp_image_segment_header_t), sizeof(*app_desc));
+    if (app_desc->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *ota_state)
+{
+    if (partition == NULL || ota_state == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int slot = slot_of(partition);
+    if (slot == NO_SLOT) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    otadata_t otadata = read_otadata();
+    if (otadata.state[slot] == ESP_OTA_IMG_UNDEFINED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *ota_state = otadata.state[slot];
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_last_invalid_partition(void)
+{
+    otadata_t otadata = read_otadata();
+    for (int slot = 0; slot < 2; slot++) {
+        if (otadata.state[slot] == ESP_OTA_IMG_INVALID || otadata.state[slot] == ESP_OTA_IMG_ABORTED) {
+            return OTA_SLOT(slot);
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    int slot = slot_of(running);
+    if (slot == NO_SLOT) {
+        return ESP_OK;
+    }
+    otadata_t otadata = read_otadata();
+    otadata.state[slot] = ESP_OTA_IMG_VALID;
+    write_otadata(&otadata);
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void)
+{
+    int slot = slot_of(running);
+    if (slot == NO_SLOT) {
+        return ESP_ERR_OTA_ROLLBACK_FAILED;
+    }
+    otadata_t otadata = read_otadata();
+    otadata.state[slot] = ESP_OTA_IMG_INVALID;
+    otadata.boot_slot = fallback_slot(&otadata, slot);
+    write_otadata(&otadata);
+    esp_restart();
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    sim_stats.ota_set_boot_calls++;
+    if (partition == NULL || partition->type != ESP_PARTITION_TYPE_APP) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!is_image_valid(partition)) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    otadata_t otadata = read_otadata();
+    int slot = slot_of(partition);
+    otadata.boot_slot = slot;
+    if (slot != NO_SLOT) {
+        otadata.state[slot] = ESP_OTA_IMG_NEW;
+    }
+    write_otadata(&otadata);
+    return ESP_OK;
+}
+
+static ota_handle_entry_t *get_handle(esp_ota_handle_t handle)
+{
+    if (handle == 0 || handle > sizeof(ota_handles) / sizeof(ota_handles[0])
+            || ota_handles[handle - 1].partition == NULL) {
+        return NULL;
+    }
+    return &ota_handles[handle - 1];
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+    if (partition == NULL || out_handle == NULL || slot_of(partition) == NO_SLOT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (partition == running) {
+        return ESP_ERR_OTA_PARTITION_CONFLICT;
+    }
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGE(TAG, "Running app has not confirmed state (ESP_OTA_IMG_PENDING_VERIFY)");
+        return ESP_ERR_OTA_ROLLBACK_INVALID_STATE;
+    }
+    size_t slot;
+    for (slot = 0; slot < sizeof(ota_handles) / sizeof(ota_handles[0]); slot++) {
+        if (ota_handles[slot].partition == NULL) {
+            break;
+        }
+    }
+    if (slot == sizeof(ota_handles) / sizeof(ota_handles[0])) {
+        return ESP_ERR_NO_MEM;
+    }
+    // The handle entry is allocated, as in the IDF
+    void *block = sim_heap_alloc(32);
+    if (block == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t erase_size = partition->size;
+    if (image_size != OTA_SIZE_UNKNOWN) {
+        erase_size = (image_size / SPI_FLASH_SEC_SIZE + 1) * SPI_FLASH_SEC_SIZE;
+        if (erase_size > partition->size) {
+            erase_size = partition->size;
+        }
+    }
+    esp_err_t err = esp_partition_erase_range(partition, 0, erase_size);
+    if (err != ESP_OK) {
+        sim_heap_free(block);
+        return err;
+    }
+    ota_handles[slot] = (ota_handle_entry_t) {
+        .partition = partition,
+        .erased_size = erase_size,
+        .heap_block = block,
+    };
+    *out_handle = slot + 1;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    ota_handle_entry_t *entry = get_handle(handle);
+    if (entry == NULL || data == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (entry->wrote_size == 0 && size > 0 && ((const uint8_t *)data)[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "OTA image has invalid magic byte (expected 0xE9, saw 0x%02x)", ((const uint8_t *)data)[0]);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    esp_err_t err = esp_partition_write(entry->partition, entry->wrote_size, data, size);
+    if (err == ESP_OK) {
+        entry->wrote_size += size;
+    }
+    return err;
+}
+
+static void release_handle(ota_handle_entry_t *entry)
+{
+    sim_heap_free(entry->heap_block);
+    memset(entry, 0, sizeof(*entry));
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    ota_handle_entry_t *entry = get_handle(handle);
+    if (entry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t err = ESP_OK;
+    if (entry->erased_size == 0 || entry->wrote_size == 0) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (!is_image_valid(entry->partition)) {
+        err = ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    release_handle(entry);
+    return err;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+    ota_handle_entry_t *entry = get_handle(handle);
+    if (entry == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    release_handle(entry);
+    return ESP_OK;
+}
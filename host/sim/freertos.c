@@ -0,0 +1,752 @@
+// FreeRTOS on POSIX threads. All kernel objects share one lock, blocking
+// calls wait on condition variables with deadlines on the simulated clock
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "freertos/ringbuf.h"
+#include "sim_internal.h"
+
+// Host stacks are much larger than the device ones, glibc needs more
+// room than newlib. They are painted so the deepest use can be measured
+#define HOST_STACK_SIZE   (256 * 1024)
+#define STACK_PAINT       0xa5
+#define TCB_SIZE          sizeof(StaticTask_t)
+#define MAX_STACK_RECORDS 32
+
+struct sim_task {
+    pthread_t thread;
+    char name[16];
+    TaskFunction_t function;
+    void *param;
+    uint32_t stack_size;
+    uint8_t *host_stack;
+    uintptr_t stack_top;
+    uintptr_t entry_sp;
+    void *heap_block;
+    uint32_t notify_count;
+    pthread_cond_t cond;
+    eTaskState state;
+    bool is_joined;
+    struct sim_task *next;
+};
+
+struct sim_queue {
+    uint8_t *storage;
+    size_t length;
+    size_t item_size;
+    size_t head;
+    size_t count;
+    void *heap_block;
+    pthread_cond_t cond;
+};
+
+struct sim_event_group {
+    EventBits_t bits;
+    void *heap_block;
+    pthread_cond_t cond;
+};
+
+struct sim_ringbuf {
+    uint8_t *storage;
+    size_t size;
+    size_t head;
+    size_t used;
+    size_t pending;
+    void *heap_block;
+    pthread_cond_t cond;
+};
+
+typedef struct {
+    char name[16];
+    uint32_t stack_size;
+    uint32_t used;
+} stack_record_t;
+
+static pthread_mutex_t kernel = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t critical;
+static struct sim_task *tasks;
+static __thread struct sim_task *current_task;
+static stack_record_t stack_records[MAX_STACK_RECORDS];
+
+void sim_freertos_start(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&critical, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void sim_enter_critical(portMUX_TYPE *mux)
+{
+    pthread_mutex_lock(&critical);
+    mux->count++;
+}
+
+void sim_exit_critical(portMUX_TYPE *mux)
+{
+    mux->count--;
+    pthread_mutex_unlock(&critical);
+}
+
+void sim_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Waits on cond with the kernel lock held. Returns false once the
+// deadline passed, a NULL deadline waits forever
+static bool kernel_wait(pthread_cond_t *cond, const struct timespec *deadline)
+{
+    if (deadline == NULL) {
+        pthread_cond_wait(cond, &kernel);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, &kernel, deadline) != ETIMEDOUT;
+}
+
+static const struct timespec *ticks_deadline(TickType_t ticks, struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY) {
+        return NULL;
+    }
+    sim_deadline((int64_t)ticks * portTICK_PERIOD_MS * 1000, deadline);
+    return deadline;
+}
+
+// Stack use
+
+static uint32_t stack_used(const struct sim_task *task)
+{
+    const uint8_t *p = task->host_stack;
+    const uint8_t *end = task->host_stack + HOST_STACK_SIZE;
+    while (p < end && *p == STACK_PAINT) {
+        p++;
+    }
+    uintptr_t deepest = (uintptr_t)p;
+    if (deepest >= task->entry_sp) {
+        return 0;
+    }
+    return (uint32_t)(task->entry_sp - deepest);
+}
+
+// Keeps the deepest use seen for each task name, across runs of a task
+static void record_stack(const struct sim_task *task)
+{
+    uint32_t used = stack_used(task);
+    for (int i = 0; i < MAX_STACK_RECORDS; i++) {
+        stack_record_t *record = &stack_records[i];
+        if (record->name[0] == '\0') {
+            strncpy(record->name, task->name, sizeof(record->name) - 1);
+        } else if (strcmp(record->name, task->name) != 0) {
+            continue;
+        }
+        record->stack_size = task->stack_size;
+        if (used > record->used) {
+            record->used = used;
+        }
+        return;
+    }
+}
+
+uint32_t sim_stack_used(const char *task_name)
+{
+    uint32_t used = 0;
+    pthread_mutex_lock(&kernel);
+    for (struct sim_task *task = tasks; task != NULL; task = task->next) {
+        if (strcmp(task->name, task_name) == 0 && task->state != eDeleted) {
+            record_stack(task);
+        }
+    }
+    for (int i = 0; i < MAX_STACK_RECORDS; i++) {
+        if (strcmp(stack_records[i].name, task_name) == 0) {
+            used = stack_records[i].used;
+        }
+    }
+    pthread_mutex_unlock(&kernel);
+    return used;
+}
+
+static void write_stacks(FILE *file, const char *format)
+{
+    pthread_mutex_lock(&kernel);
+    for (struct sim_task *task = tasks; task != NULL; task = task->next) {
+        if (task->state != eDeleted) {
+            record_stack(task);
+        }
+    }
+    for (int i = 0; i < MAX_STACK_RECORDS && stack_records[i].name[0] != '\0'; i++) {
+        fprintf(file, format, stack_records[i].name, stack_records[i].stack_size, stack_records[i].used);
+    }
+    pthread_mutex_unlock(&kernel);
+}
+
+void sim_report_stacks(void)
+{
+    printf("%-14s %8s %8s\n", "task", "stack", "used");
+    write_stacks(stdout, "%-14s %8u %8u\n");
+}
+
+// Appends the stacks of the boot to the file named by SIM_STACK_LOG, so
+// the high-water marks of a whole test run can be collected
+void sim_log_stacks(void)
+{
+    const char *path = getenv("SIM_STACK_LOG");
+    FILE *file = (path != NULL) ? fopen(path, "a") : NULL;
+    if (file != NULL) {
+        write_stacks(file, "%s %u %u\n");
+        fclose(file);
+    }
+}
+
+// Tasks
+
+// Stacks of finished threads are only reused once the thread was joined
+static uint8_t *take_host_stack(void)
+{
+    for (struct sim_task *task = tasks; task != NULL; task = task->next) {
+        if (task->state == eDeleted && !task->is_joined && task->host_stack != NULL
+                && !pthread_equal(task->thread, pthread_self())) {
+            uint8_t *stack = task->host_stack;
+            task->host_stack = NULL;
+            task->is_joined = true;
+            pthread_mutex_unlock(&kernel);
+            pthread_join(task->thread, NULL);
+            pthread_mutex_lock(&kernel);
+            return stack;
+        }
+    }
+    uint8_t *stack = mmap(NULL, HOST_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("mmap");
+        abort();
+    }
+    return stack;
+}
+
+static void *task_entry(void *arg)
+{
+    struct sim_task *task = arg;
+    uint8_t marker;
+    current_task = task;
+    task->entry_sp = (uintptr_t)&marker;
+    task->function(task->param);
+    fprintf(stderr, "Task %s returned from its function\n", task->name);
+    abort();
+}
+
+static struct sim_task *create_task(TaskFunction_t function, const char *name, uint32_t stack_size,
+                                    void *param, void *heap_block)
+{
+    struct sim_task *task = calloc(1, sizeof(*task));
+    strncpy(task->name, name, sizeof(task->name) - 1);
+    task->function = function;
+    task->param = param;
+    task->stack_size = stack_size;
+    task->heap_block = heap_block;
+    task->state = eReady;
+    sim_cond_init(&task->cond);
+
+    pthread_mutex_lock(&kernel);
+    task->host_stack = take_host_stack();
+    memset(task->host_stack, STACK_PAINT, HOST_STACK_SIZE);
+    task->next = tasks;
+    tasks = task;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, task->host_stack, HOST_STACK_SIZE);
+    int err = pthread_create(&task->thread, &attr, task_entry, task);
+    pthread_attr_destroy(&attr);
+    pthread_mutex_unlock(&kernel);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+        abort();
+    }
+    return task;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                   void *param, UBaseType_t priority, TaskHandle_t *created_task,
+                                   BaseType_t core_id)
+{
+    // The stack and control block come from the heap, as on the device
+    void *block = sim_heap_alloc(stack_depth + TCB_SIZE);
+    if (block == NULL) {
+        return pdFAIL;
+    }
+    struct sim_task *task = create_task(function, name, stack_depth, param, block);
+    if (created_task != NULL) {
+        *created_task = task;
+    }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                           void *param, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *tcb, BaseType_t core_id)
+{
+    if (stack == NULL || tcb == NULL) {
+        return NULL;
+    }
+    return create_task(function, name, stack_depth, param, NULL);
+}
+
+// Called with the kernel lock held. The thread of a task deleted by
+// another one is parked in vTaskSuspend and leaves from there
+static void delete_task(struct sim_task *task)
+{
+    record_stack(task);
+    task->state = eDeleted;
+    if (task->heap_block != NULL) {
+        sim_heap_free(task->heap_block);
+        task->heap_block = NULL;
+    }
+    pthread_cond_broadcast(&task->cond);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    pthread_mutex_lock(&kernel);
+    if (task == NULL || task == current_task) {
+        delete_task(current_task);
+        pthread_mutex_unlock(&kernel);
+        pthread_exit(NULL);
+    }
+    if (task->state != eSuspended) {
+        fprintf(stderr, "vTaskDelete of running task %s is not simulated\n", task->name);
+        abort();
+    }
+    delete_task(task);
+    pthread_mutex_unlock(&kernel);
+}
+
+void vTaskSuspend(TaskHandle_t task)
+{
+    if (task != NULL && task != current_task) {
+        fprintf(stderr, "vTaskSuspend of another task is not simulated\n");
+        abort();
+    }
+    struct sim_task *self = current_task;
+    pthread_mutex_lock(&kernel);
+    self->state = eSuspended;
+    while (self->state != eDeleted) {
+        kernel_wait(&self->cond, NULL);
+    }
+    pthread_mutex_unlock(&kernel);
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    sim_delay_us((int64_t)ticks * portTICK_PERIOD_MS * 1000);
+}
+
+eTaskState eTaskGetState(TaskHandle_t task)
+{
+    pthread_mutex_lock(&kernel);
+    eTaskState state = (task == current_task) ? eRunning : task->state;
+    pthread_mutex_unlock(&kernel);
+    return state;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return (TickType_t)(sim_time_us() / 1000 / portTICK_PERIOD_MS);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    if (task == NULL) {
+        task = current_task;
+    }
+    uint32_t used = stack_used(task);
+    return (used < task->stack_size) ? task->stack_size - used : 0;
+}
+
+// Notifications
+
+static void notify_give(struct sim_task *task)
+{
+    pthread_mutex_lock(&kernel);
+    task->notify_count++;
+    pthread_cond_broadcast(&task->cond);
+    pthread_mutex_unlock(&kernel);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    notify_give(task);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+{
+    notify_give(task);
+    if (higher_priority_task_woken != NULL) {
+        *higher_priority_task_woken = pdTRUE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct sim_task *self = current_task;
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    self->state = eBlocked;
+    while (self->notify_count == 0 && ticks_to_wait != 0 && kernel_wait(&self->cond, until)) {
+    }
+    self->state = eRunning;
+    uint32_t count = self->notify_count;
+    if (count > 0) {
+        self->notify_count = clear_on_exit ? 0 : count - 1;
+    }
+    sim_stats.task_wakeups++;
+    pthread_mutex_unlock(&kernel);
+    return count;
+}
+
+// Queues and semaphores
+
+static struct sim_queue *create_queue(size_t length, size_t item_size, uint8_t *storage, void *heap_block)
+{
+    struct sim_queue *queue = calloc(1, sizeof(*queue));
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->storage = storage;
+    queue->heap_block = heap_block;
+    sim_cond_init(&queue->cond);
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    uint8_t *block = sim_heap_alloc(sizeof(StaticQueue_t) + length * item_size);
+    if (block == NULL) {
+        return NULL;
+    }
+    return create_queue(length, item_size, block + sizeof(StaticQueue_t), block);
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *queue_buffer)
+{
+    if (queue_buffer == NULL || (item_size > 0 && storage == NULL)) {
+        return NULL;
+    }
+    return create_queue(length, item_size, storage, NULL);
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    if (queue->heap_block != NULL) {
+        sim_heap_free(queue->heap_block);
+    }
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    while (queue->count == queue->length) {
+        if (ticks_to_wait == 0 || !kernel_wait(&queue->cond, until)) {
+            pthread_mutex_unlock(&kernel);
+            return pdFAIL;
+        }
+    }
+    size_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->storage + tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&kernel);
+    return pdPASS;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *higher_priority_task_woken)
+{
+    return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    while (queue->count == 0) {
+        if (ticks_to_wait == 0 || !kernel_wait(&queue->cond, until)) {
+            pthread_mutex_unlock(&kernel);
+            return pdFAIL;
+        }
+    }
+    memcpy(buffer, queue->storage + queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&kernel);
+    return pdPASS;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&kernel);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&kernel);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&kernel);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&kernel);
+    return count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer)
+{
+    return xQueueCreateStatic(1, 0, NULL, buffer);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t mutex = xSemaphoreCreateBinary();
+    if (mutex != NULL) {
+        xSemaphoreGive(mutex);
+    }
+    return mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer)
+{
+    SemaphoreHandle_t mutex = xSemaphoreCreateBinaryStatic(buffer);
+    if (mutex != NULL) {
+        xSemaphoreGive(mutex);
+    }
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    return xQueueReceive(semaphore, NULL, ticks_to_wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return xQueueSend(semaphore, NULL, 0);
+}
+
+// Event groups
+
+static struct sim_event_group *create_event_group(void *heap_block)
+{
+    struct sim_event_group *group = calloc(1, sizeof(*group));
+    group->heap_block = heap_block;
+    sim_cond_init(&group->cond);
+    return group;
+}
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    void *block = sim_heap_alloc(sizeof(StaticEventGroup_t));
+    if (block == NULL) {
+        return NULL;
+    }
+    return create_event_group(block);
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *buffer)
+{
+    return (buffer != NULL) ? create_event_group(NULL) : NULL;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&kernel);
+    group->bits |= bits;
+    EventBits_t result = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&kernel);
+    return result;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+    pthread_mutex_lock(&kernel);
+    EventBits_t result = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&kernel);
+    return result;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+    pthread_mutex_lock(&kernel);
+    EventBits_t result = group->bits;
+    pthread_mutex_unlock(&kernel);
+    return result;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    bool is_met;
+    while (!(is_met = wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0)) {
+        if (ticks_to_wait == 0 || !kernel_wait(&group->cond, until)) {
+            break;
+        }
+    }
+    EventBits_t result = group->bits;
+    if (is_met && clear_on_exit) {
+        group->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&kernel);
+    return result;
+}
+
+// Byte ring buffers. One item may be out at a time, as with the IDF one
+
+static struct sim_ringbuf *create_ringbuf(size_t size, uint8_t *storage, void *heap_block)
+{
+    struct sim_ringbuf *ring = calloc(1, sizeof(*ring));
+    ring->storage = storage;
+    ring->size = size;
+    ring->heap_block = heap_block;
+    sim_cond_init(&ring->cond);
+    return ring;
+}
+
+RingbufHandle_t xRingbufferCreate(size_t size, RingbufferType_t type)
+{
+    if (type != RINGBUF_TYPE_BYTEBUF) {
+        return NULL;
+    }
+    uint8_t *block = sim_heap_alloc(sizeof(StaticRingbuffer_t) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    return create_ringbuf(size, block + sizeof(StaticRingbuffer_t), block);
+}
+
+RingbufHandle_t xRingbufferCreateStatic(size_t size, RingbufferType_t type, uint8_t *storage,
+                                        StaticRingbuffer_t *buffer)
+{
+    if (type != RINGBUF_TYPE_BYTEBUF || storage == NULL || buffer == NULL) {
+        return NULL;
+    }
+    return create_ringbuf(size, storage, NULL);
+}
+
+UBaseType_t xRingbufferSend(RingbufHandle_t ring, const void *data, size_t size, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    while (ring->size - ring->used < size) {
+        if (size > ring->size || ticks_to_wait == 0 || !kernel_wait(&ring->cond, until)) {
+            pthread_mutex_unlock(&kernel);
+            return pdFALSE;
+        }
+    }
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        ring->storage[(ring->head + ring->used + i) % ring->size] = bytes[i];
+    }
+    ring->used += size;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&kernel);
+    return pdTRUE;
+}
+
+void *xRingbufferReceive(RingbufHandle_t ring, size_t *size, TickType_t ticks_to_wait)
+{
+    struct timespec deadline;
+    const struct timespec *until = ticks_deadline(ticks_to_wait, &deadline);
+    pthread_mutex_lock(&kernel);
+    while (ring->used == 0 || ring->pending > 0) {
+        if (ticks_to_wait == 0 || !kernel_wait(&ring->cond, until)) {
+            pthread_mutex_unlock(&kernel);
+            return NULL;
+        }
+    }
+    size_t length = ring->size - ring->head;
+    if (length > ring->used) {
+        length = ring->used;
+    }
+    ring->pending = length;
+    *size = length;
+    void *item = ring->storage + ring->head;
+    pthread_mutex_unlock(&kernel);
+    return item;
+}
+
+void vRingbufferReturnItem(RingbufHandle_t ring, void *item)
+{
+    pthread_mutex_lock(&kernel);
+    ring->head = (ring->head + ring->pending) % ring->size;
+    ring->used -= ring->pending;
+    ring->pending = 0;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&kernel);
+}
+
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t ring)
+{
+    pthread_mutex_lock(&kernel);
+    size_t free_size = ring->size - ring->used;
+    pthread_mutex_unlock(&kernel);
+    return free_size;
+}
+
+// Runs app_main in the main task, as the IDF startup code does, and
+// waits for it to return
+static void main_task(void *param)
+{
+    app_main();
+    pthread_mutex_lock(&kernel);
+    current_task->state = eSuspended;
+    pthread_cond_broadcast(&current_task->cond);
+    while (current_task->state != eDeleted) {
+        kernel_wait(&current_task->cond, NULL);
+    }
+    pthread_mutex_unlock(&kernel);
+    pthread_exit(NULL);
+}
+
+void sim_run_app_main(void)
+{
+    struct sim_task *task = create_task(main_task, "main", 3584, NULL, NULL);
+    pthread_mutex_lock(&kernel);
+    while (task->state != eSuspended) {
+        kernel_wait(&task->cond, NULL);
+    }
+    pthread_mutex_unlock(&kernel);
+}
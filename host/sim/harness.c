@@ -0,0 +1,239 @@
+// Work directory, boots and the helpers scenarios use
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "esp_log.h"
+#include "sim_internal.h"
+
+sim_config_t sim_config = {
+    .time_scale = 1.0,
+    .log_level = ESP_LOG_INFO,
+    .card_command_us = 250,
+    .card_max_kbps = 12000,
+    .card_max_khz = 40000,
+    .vfs_read_us = 120,
+    .card_mount_us = 60000,
+    .flash_sector_erase_us = 45000,
+    .flash_block_erase_us = 150000,
+    .flash_write_kbps = 300,
+    .flash_read_kbps = 20000,
+    .heap_size = 280 * 1024,
+    .console_baud = 115200,
+    .cd_gpio = 25,
+    .wp_gpio = 26,
+    .boot_timeout_s = 120,
+};
+
+sim_card_layout_t sim_card_layout = {
+    .fat_type = 32,
+    .cluster_sectors = 32,
+};
+
+sim_stats_t sim_stats;
+
+static char work_dir[256];
+
+const char *sim_work_path(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s", work_dir, name);
+    return path;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static void remove_tree(const char *path)
+{
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void make_dirs(const char *path)
+{
+    char partial[512];
+    strncpy(partial, path, sizeof(partial) - 1);
+    partial[sizeof(partial) - 1] = '\0';
+    for (char *p = partial + 1; *p != '\0'; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(partial, 0755);
+            *p = '/';
+        }
+    }
+    mkdir(partial, 0755);
+}
+
+void sim_init(const char *dir)
+{
+    strncpy(work_dir, dir, sizeof(work_dir) - 1);
+    remove_tree(work_dir);
+    make_dirs(work_dir);
+    sim_flash_erase_all();
+    // Inputs are pulled up, an empty slot reads as no card
+    for (int gpio = 0; gpio < 40; gpio++) {
+        sim_gpio_set(gpio, 1);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+// Cards
+
+const char *sim_card_path(const char *card, const char *file, char *path, size_t size)
+{
+    if (file == NULL) {
+        snprintf(path, size, "%s/cards/%s", work_dir, card);
+    } else {
+        snprintf(path, size, "%s/cards/%s/%s", work_dir, card, file);
+    }
+    return path;
+}
+
+bool sim_card_put(const char *card, const char *file, const void *data, size_t size)
+{
+    char path[512];
+    sim_card_path(card, file, path, sizeof(path));
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    make_dirs(path);
+    *slash = '/';
+    return sim_write_file(path, data, size);
+}
+
+bool sim_card_copy(const char *card, const char *file, const char *source_path)
+{
+    size_t size;
+    void *data = sim_read_file(source_path, &size);
+    bool is_copied = data != NULL && sim_card_put(card, file, data, size);
+    free(data);
+    return is_copied;
+}
+
+bool sim_card_exists(const char *card, const char *file)
+{
+    char path[512];
+    struct stat st;
+    return stat(sim_card_path(card, file, path, sizeof(path)), &st) == 0;
+}
+
+time_t sim_card_mtime(const char *card, const char *file)
+{
+    char path[512];
+    struct stat st;
+    return (stat(sim_card_path(card, file, path, sizeof(path)), &st) == 0) ? st.st_mtime : 0;
+}
+
+bool sim_card_set_mtime(const char *card, const char *file, time_t mtime)
+{
+    char path[512];
+    struct utimbuf times = { mtime, mtime };
+    return utime(sim_card_path(card, file, path, sizeof(path)), &times) == 0;
+}
+
+void sim_card_clear(const char *card)
+{
+    char path[512];
+    sim_card_path(card, NULL, path, sizeof(path));
+    remove_tree(path);
+    make_dirs(path);
+}
+
+// Boots
+
+int sim_boot(void (*scenario)(void *arg), void *arg)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return SIM_EXIT_FAILED;
+    }
+    if (pid == 0) {
+        alarm(sim_config.boot_timeout_s);
+        memset(&sim_stats, 0, sizeof(sim_stats));
+        sim_time_start();
+        sim_heap_start();
+        sim_freertos_start();
+        sim_gpio_start();
+        sim_card_start();
+        sim_nvs_start();
+        sim_flash_start();
+        sim_run_app_main();
+        if (scenario != NULL) {
+            scenario(arg);
+        }
+        sim_exit(SIM_EXIT_DONE);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    // Faults are armed for one boot
+    sim_card_remove_after(UINT64_MAX);
+    sim_card_fail_reads_after(UINT64_MAX);
+    sim_power_loss_after(UINT64_MAX);
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    fprintf(stderr, "Boot ended by signal %d (%s)\n", WTERMSIG(status), strsignal(WTERMSIG(status)));
+    return SIM_EXIT_ABORT;
+}
+
+bool sim_wait_for(bool (*condition)(void), uint32_t timeout_ms)
+{
+    int64_t deadline = sim_time_us() + (int64_t)timeout_ms * 1000;
+    while (!condition()) {
+        if (sim_time_us() >= deadline) {
+            return false;
+        }
+        sim_delay_ms(1);
+    }
+    return true;
+}
+
+// Files
+
+void *sim_read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(length + 1);
+    if (fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data != NULL) {
+        data[length] = '\0';
+        *size = length;
+    }
+    return data;
+}
+
+bool sim_write_file(const char *path, const void *data, size_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    bool is_written = fwrite(data, 1, size, file) == size;
+    return fclose(file) == 0 && is_written;
+}
+
+void sim_fail(const char *file, int line, const char *expression)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    sim_exit(SIM_EXIT_FAILED);
+}
@@ -0,0 +1,282 @@
+// NVS as a list of entries saved to nvs.bin of the work directory on
+// every change, so a value is either fully written or not at all
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+#include "nvs_flash.h"
+#include "sim_internal.h"
+
+#define NVS_NAME_MAX 15
+#define NVS_MAX_HANDLES 16
+
+typedef struct nvs_entry {
+    char namespace_name[NVS_NAME_MAX + 1];
+    char key[NVS_NAME_MAX + 1];
+    uint32_t length;
+    uint8_t *value;
+    struct nvs_entry *next;
+} nvs_entry_t;
+
+typedef struct {
+    bool is_open;
+    nvs_open_mode_t mode;
+    char namespace_name[NVS_NAME_MAX + 1];
+} nvs_handle_entry_t;
+
+static pthread_mutex_t nvs_lock = PTHREAD_MUTEX_INITIALIZER;
+static nvs_entry_t *entries;
+static bool is_initialized;
+static nvs_handle_entry_t handles[NVS_MAX_HANDLES];
+
+static void save(void)
+{
+    char path[256];
+    char temp[sizeof(path) + 8];
+    sim_work_path("nvs.bin", path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *file = fopen(temp, "wb");
+    if (file == NULL) {
+        perror(temp);
+        sim_exit(SIM_EXIT_FAILED);
+    }
+    for (nvs_entry_t *entry = entries; entry != NULL; entry = entry->next) {
+        fwrite(entry->namespace_name, sizeof(entry->namespace_name), 1, file);
+        fwrite(entry->key, sizeof(entry->key), 1, file);
+        fwrite(&entry->length, sizeof(entry->length), 1, file);
+        fwrite(entry->value, 1, entry->length, file);
+    }
+    fclose(file);
+    rename(temp, path);
+}
+
+static void load(void)
+{
+    char path[256];
+    sim_work_path("nvs.bin", path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return;
+    }
+    nvs_entry_t entry;
+    nvs_entry_t **tail = &entries;
+    while (fread(entry.namespace_name, sizeof(entry.namespace_name), 1, file) == 1
+            && fread(entry.key, sizeof(entry.key), 1, file) == 1
+            && fread(&entry.length, sizeof(entry.length), 1, file) == 1) {
+        entry.value = malloc(entry.length + 1);
+        if (fread(entry.value, 1, entry.length, file) != entry.length) {
+            free(entry.value);
+            break;
+        }
+        entry.next = NULL;
+        *tail = malloc(sizeof(entry));
+        **tail = entry;
+        tail = &(*tail)->next;
+    }
+    fclose(file);
+}
+
+void sim_nvs_start(void)
+{
+    entries = NULL;
+    is_initialized = false;
+    memset(handles, 0, sizeof(handles));
+}
+
+esp_err_t nvs_flash_init(void)
+{
+    pthread_mutex_lock(&nvs_lock);
+    if (!is_initialized) {
+        load();
+        is_initialized = true;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    pthread_mutex_lock(&nvs_lock);
+    while (entries != NULL) {
+        nvs_entry_t *next = entries->next;
+        free(entries->value);
+        free(entries);
+        entries = next;
+    }
+    save();
+    is_initialized = false;
+    pthread_mutex_unlock(&nvs_lock);
+    return ESP_OK;
+}
+
+static nvs_entry_t **find(const char *namespace_name, const char *key)
+{
+    for (nvs_entry_t **entry = &entries; *entry != NULL; entry = &(*entry)->next) {
+        if (strcmp((*entry)->namespace_name, namespace_name) == 0
+                && (key == NULL || strcmp((*entry)->key, key) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static nvs_handle_entry_t *get_handle(nvs_handle_t handle)
+{
+    if (handle == 0 || handle > NVS_MAX_HANDLES || !handles[handle - 1].is_open) {
+        return NULL;
+    }
+    return &handles[handle - 1];
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    if (!is_initialized) {
+        return ESP_ERR_NVS_NOT_INITIALIZED;
+    }
+    if (strlen(name) > NVS_NAME_MAX) {
+        return ESP_ERR_NVS_INVALID_NAME;
+    }
+    pthread_mutex_lock(&nvs_lock);
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+    // A namespace exists once it holds a key or was opened for writing
+    if (open_mode == NVS_READWRITE || find(name, NULL) != NULL) {
+        err = ESP_ERR_NO_MEM;
+        for (int i = 0; i < NVS_MAX_HANDLES; i++) {
+            if (!handles[i].is_open) {
+                handles[i].is_open = true;
+                handles[i].mode = open_mode;
+                strcpy(handles[i].namespace_name, name);
+                *out_handle = i + 1;
+                err = ESP_OK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&nvs_lock);
+    nvs_handle_entry_t *entry = get_handle(handle);
+    if (entry != NULL) {
+        entry->is_open = false;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return (get_handle(handle) != NULL) ? ESP_OK : ESP_ERR_NVS_INVALID_HANDLE;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    pthread_mutex_lock(&nvs_lock);
+    nvs_handle_entry_t *h = get_handle(handle);
+    esp_err_t err = ESP_OK;
+    if (h == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (h->mode == NVS_READONLY) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else if (strlen(key) > NVS_NAME_MAX) {
+        err = ESP_ERR_NVS_KEY_TOO_LONG;
+    } else {
+        nvs_entry_t **found = find(h->namespace_name, key);
+        nvs_entry_t *entry;
+        if (found != NULL) {
+            entry = *found;
+            free(entry->value);
+        } else {
+            entry = calloc(1, sizeof(*entry));
+            strcpy(entry->namespace_name, h->namespace_name);
+            strcpy(entry->key, key);
+            entry->next = entries;
+            entries = entry;
+        }
+        entry->length = length;
+        entry->value = malloc(length + 1);
+        memcpy(entry->value, value, length);
+        save();
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    pthread_mutex_lock(&nvs_lock);
+    nvs_handle_entry_t *h = get_handle(handle);
+    esp_err_t err = ESP_OK;
+    nvs_entry_t **found;
+    if (h == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (strlen(key) > NVS_NAME_MAX) {
+        err = ESP_ERR_NVS_KEY_TOO_LONG;
+    } else if ((found = find(h->namespace_name, key)) == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (out_value == NULL) {
+        *length = (*found)->length;
+    } else if (*length < (*found)->length) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        memcpy(out_value, (*found)->value, (*found)->length);
+        *length = (*found)->length;
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    size_t length = sizeof(*out_value);
+    return nvs_get_blob(handle, key, out_value, &length);
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    pthread_mutex_lock(&nvs_lock);
+    nvs_handle_entry_t *h = get_handle(handle);
+    esp_err_t err = ESP_OK;
+    nvs_entry_t **found;
+    if (h == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (h->mode == NVS_READONLY) {
+        err = ESP_ERR_NVS_READ_ONLY;
+    } else if ((found = find(h->namespace_name, key)) == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        nvs_entry_t *entry = *found;
+        *found = entry->next;
+        free(entry->value);
+        free(entry);
+        save();
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&nvs_lock);
+    nvs_handle_entry_t *h = get_handle(handle);
+    esp_err_t err = (h == NULL) ? ESP_ERR_NVS_INVALID_HANDLE : ESP_OK;
+    nvs_entry_t **found;
+    while (h != NULL && (found = find(h->namespace_name, NULL)) != NULL) {
+        nvs_entry_t *entry = *found;
+        *found = entry->next;
+        free(entry->value);
+        free(entry);
+    }
+    if (h != NULL) {
+        save();
+    }
+    pthread_mutex_unlock(&nvs_lock);
+    return err;
+}
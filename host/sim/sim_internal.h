@@ -0,0 +1,39 @@
+// Shared between the stand-ins of the simulation
+#pragma once
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "sim.h"
+
+// Charges device time to the calling thread. Short delays add up and are
+// slept once they are worth a real sleep
+void sim_delay_us(int64_t us);
+
+// Deadline on the monotonic clock for a wait of us device time
+void sim_deadline(int64_t us, struct timespec *deadline);
+void sim_cond_init(pthread_cond_t *cond);
+
+// Boot state
+void sim_time_start(void);
+void sim_heap_start(void);
+void sim_flash_start(void);
+void sim_nvs_start(void);
+void sim_card_start(void);
+void sim_gpio_start(void);
+void sim_freertos_start(void);
+void sim_run_app_main(void);
+void sim_exit(int code) __attribute__((noreturn));
+void sim_run_restart_hook(void);
+void sim_log_stacks(void);
+
+// Device heap
+void *sim_heap_alloc(size_t size);
+void sim_heap_free(void *ptr);
+
+// Flash. Code from flash stalls while the flash is erased or written
+void sim_cache_wait(void);
+
+// Card
+bool sim_card_is_present(void);
+void sim_card_account_read(uint64_t bytes);
@@ -0,0 +1,490 @@
+// Clock, heap, logging and the other small system services
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp32/rom/crc.h"
+#include "esp32/rom/miniz.h"
+#include "sim_internal.h"
+
+// Clock. Device time is real time divided by the time scale
+
+static struct timespec boot_time;
+static __thread int64_t sleep_debt_ns;
+
+static int64_t real_ns_since_boot(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - boot_time.tv_sec) * 1000000000 + (now.tv_nsec - boot_time.tv_nsec);
+}
+
+void sim_time_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &boot_time);
+}
+
+int64_t sim_time_us(void)
+{
+    return (int64_t)(real_ns_since_boot() / 1000 / sim_config.time_scale);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    return sim_time_us();
+}
+
+void sim_deadline(int64_t us, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    int64_t ns = deadline->tv_nsec + (int64_t)(us * 1000 * sim_config.time_scale);
+    deadline->tv_sec += ns / 1000000000;
+    deadline->tv_nsec = ns % 1000000000;
+}
+
+void sim_delay_us(int64_t us)
+{
+    sleep_debt_ns += (int64_t)(us * 1000 * sim_config.time_scale);
+    if (sleep_debt_ns < 100000) {
+        return;
+    }
+    // Oversleeping is paid back by the next delays
+    int64_t start = real_ns_since_boot();
+    struct timespec delay = { sleep_debt_ns / 1000000000, sleep_debt_ns % 1000000000 };
+    nanosleep(&delay, NULL);
+    sleep_debt_ns -= real_ns_since_boot() - start;
+    if (sleep_debt_ns < -2000000) {
+        sleep_debt_ns = -2000000;
+    }
+}
+
+void sim_delay_ms(uint32_t ms)
+{
+    sim_delay_us((int64_t)ms * 1000);
+}
+
+// Heap. One first fit region of sim_config.heap_size bytes, so peak use
+// and fragmentation are those of the allocation pattern of the app
+
+#define HEAP_ALIGN 8
+
+typedef struct {
+    uint32_t size;
+    uint32_t is_free;
+} heap_block_t;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *heap_base;
+static size_t heap_free;
+static size_t heap_min_free;
+
+void sim_heap_start(void)
+{
+    heap_base = malloc(sim_config.heap_size);
+    heap_block_t *first = (heap_block_t *)heap_base;
+    first->size = sim_config.heap_size - sizeof(heap_block_t);
+    first->is_free = 1;
+    heap_free = first->size;
+    heap_min_free = heap_free;
+}
+
+static heap_block_t *next_block(heap_block_t *block)
+{
+    uint8_t *next = (uint8_t *)(block + 1) + block->size;
+    return (next < heap_base + sim_config.heap_size) ? (heap_block_t *)next : NULL;
+}
+
+void *sim_heap_alloc(size_t size)
+{
+    if (size == 0) {
+        return NULL;
+    }
+    size = (size + HEAP_ALIGN - 1) & ~(size_t)(HEAP_ALIGN - 1);
+    pthread_mutex_lock(&heap_lock);
+    for (heap_block_t *block = (heap_block_t *)heap_base; block != NULL; block = next_block(block)) {
+        if (!block->is_free || block->size < size) {
+            continue;
+        }
+        if (block->size >= size + sizeof(heap_block_t) + HEAP_ALIGN) {
+            heap_block_t *rest = (heap_block_t *)((uint8_t *)(block + 1) + size);
+            rest->size = block->size - size - sizeof(heap_block_t);
+            rest->is_free = 1;
+            block->size = size;
+            heap_free -= sizeof(heap_block_t);
+        }
+        block->is_free = 0;
+        heap_free -= block->size;
+        if (heap_free < heap_min_free) {
+            heap_min_free = heap_free;
+        }
+        pthread_mutex_unlock(&heap_lock);
+        return block + 1;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return NULL;
+}
+
+void sim_heap_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    heap_block_t *freed = (heap_block_t *)ptr - 1;
+    if (freed->is_free) {
+        fprintf(stderr, "Double free of heap block %p\n", ptr);
+        abort();
+    }
+    freed->is_free = 1;
+    heap_free += freed->size;
+    // Merge runs of free blocks
+    for (heap_block_t *block = (heap_block_t *)heap_base; block != NULL; block = next_block(block)) {
+        heap_block_t *next;
+        while (block->is_free && (next = next_block(block)) != NULL && next->is_free) {
+            block->size += sizeof(heap_block_t) + next->size;
+            heap_free += sizeof(heap_block_t);
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return sim_heap_alloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    void *ptr = sim_heap_alloc(n * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, n * size);
+    }
+    return ptr;
+}
+
+void heap_caps_free(void *ptr)
+{
+    sim_heap_free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    pthread_mutex_lock(&heap_lock);
+    size_t result = heap_free;
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+    pthread_mutex_lock(&heap_lock);
+    size_t result = heap_min_free;
+    pthread_mutex_unlock(&heap_lock);
+    return result;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    size_t largest = 0;
+    pthread_mutex_lock(&heap_lock);
+    for (heap_block_t *block = (heap_block_t *)heap_base; block != NULL; block = next_block(block)) {
+        if (block->is_free && block->size > largest) {
+            largest = block->size;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return largest;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+}
+
+size_t sim_heap_peak(void)
+{
+    return sim_config.heap_size - sizeof(heap_block_t) - heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+}
+
+// Logging
+
+static vprintf_like_t log_vprintf = vprintf;
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func)
+{
+    vprintf_like_t previous = log_vprintf;
+    log_vprintf = func;
+    return previous;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    sim_config.log_level = level;
+}
+
+uint32_t esp_log_timestamp(void)
+{
+    return (uint32_t)(sim_time_us() / 1000);
+}
+
+// Lines written straight to the console hold the calling task for their
+// time on the UART, also the ones log_level keeps off the host terminal,
+// as long as the device logs them at its default level. Lines handed to
+// a vprintf set by the app are written out by its own task
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    va_list args;
+    if (log_vprintf != vprintf) {
+        if ((int)level <= sim_config.log_level) {
+            va_start(args, format);
+            log_vprintf(format, args);
+            va_end(args);
+        }
+        return;
+    }
+    if ((int)level > CONFIG_LOG_DEFAULT_LEVEL) {
+        return;
+    }
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if ((int)level <= sim_config.log_level) {
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+    // 10 bits per byte on the wire
+    sim_delay_us((int64_t)len * 10 * 1000000 / sim_config.console_baud);
+}
+
+// Errors
+
+typedef struct {
+    esp_err_t code;
+    const char *name;
+} esp_err_name_t;
+
+#define ERR_NAME(code) { code, #code }
+
+static const esp_err_name_t err_names[] = {
+    ERR_NAME(ESP_OK),
+    ERR_NAME(ESP_FAIL),
+    ERR_NAME(ESP_ERR_NO_MEM),
+    ERR_NAME(ESP_ERR_INVALID_ARG),
+    ERR_NAME(ESP_ERR_INVALID_STATE),
+    ERR_NAME(ESP_ERR_INVALID_SIZE),
+    ERR_NAME(ESP_ERR_NOT_FOUND),
+    ERR_NAME(ESP_ERR_NOT_SUPPORTED),
+    ERR_NAME(ESP_ERR_TIMEOUT),
+    ERR_NAME(ESP_ERR_INVALID_RESPONSE),
+    ERR_NAME(ESP_ERR_INVALID_CRC),
+    ERR_NAME(ESP_ERR_INVALID_VERSION),
+    ERR_NAME(ESP_ERR_NVS_NOT_INITIALIZED),
+    ERR_NAME(ESP_ERR_NVS_NOT_FOUND),
+    ERR_NAME(ESP_ERR_NVS_READ_ONLY),
+    ERR_NAME(ESP_ERR_NVS_INVALID_NAME),
+    ERR_NAME(ESP_ERR_NVS_INVALID_HANDLE),
+    ERR_NAME(ESP_ERR_NVS_KEY_TOO_LONG),
+    ERR_NAME(ESP_ERR_NVS_INVALID_LENGTH),
+    ERR_NAME(ESP_ERR_NVS_NO_FREE_PAGES),
+    ERR_NAME(ESP_ERR_NVS_NEW_VERSION_FOUND),
+    ERR_NAME(ESP_ERR_IMAGE_FLASH_FAIL),
+    ERR_NAME(ESP_ERR_IMAGE_INVALID),
+    ERR_NAME(ESP_ERR_OTA_PARTITION_CONFLICT),
+    ERR_NAME(ESP_ERR_OTA_SELECT_INFO_INVALID),
+    ERR_NAME(ESP_ERR_OTA_VALIDATE_FAILED),
+    ERR_NAME(ESP_ERR_OTA_ROLLBACK_FAILED),
+    ERR_NAME(ESP_ERR_OTA_ROLLBACK_INVALID_STATE),
+};
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    for (size_t i = 0; i < sizeof(err_names) / sizeof(err_names[0]); i++) {
+        if (err_names[i].code == code) {
+            return err_names[i].name;
+        }
+    }
+    return "UNKNOWN ERROR";
+}
+
+void _esp_error_check_failed(esp_err_t rc, const char *file, int line, const char *function, const char *expression)
+{
+    fprintf(stderr, "ESP_ERROR_CHECK failed: esp_err_t 0x%x (%s) at %s:%d\nfunction: %s\nexpression: %s\n",
+            rc, esp_err_to_name(rc), file, line, function, expression);
+    abort();
+}
+
+// System
+
+static void (*restart_hook)(void);
+
+void sim_set_restart_hook(void (*hook)(void))
+{
+    restart_hook = hook;
+}
+
+void sim_run_restart_hook(void)
+{
+    if (restart_hook != NULL) {
+        restart_hook();
+    }
+}
+
+void sim_exit(int code)
+{
+    sim_log_stacks();
+    fflush(stdout);
+    fflush(stderr);
+    _exit(code);
+}
+
+void esp_restart(void)
+{
+    sim_run_restart_hook();
+    sim_exit(SIM_EXIT_RESTART);
+}
+
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac)
+{
+    static const uint8_t board_mac[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 };
+    memcpy(mac, board_mac, sizeof(board_mac));
+    return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    esp_err_t err = esp_efuse_mac_get_default(mac);
+    mac[5] += type;
+    return err;
+}
+
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t length = strlen(src);
+    if (size > 0) {
+        size_t copy = (length < size - 1) ? length : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+    return length;
+}
+
+// Power management. Locks only count, the host never sleeps
+
+struct esp_pm_lock {
+    esp_pm_lock_type_t type;
+    const char *name;
+    int count;
+};
+
+esp_err_t esp_pm_configure(const void *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg, const char *name, esp_pm_lock_handle_t *out_handle)
+{
+    struct esp_pm_lock *lock = calloc(1, sizeof(*lock));
+    lock->type = lock_type;
+    lock->name = name;
+    *out_handle = lock;
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle)
+{
+    __atomic_add_fetch(&handle->count, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&sim_stats.pm_lock_acquires, 1, __ATOMIC_SEQ_CST);
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle)
+{
+    if (__atomic_sub_fetch(&handle->count, 1, __ATOMIC_SEQ_CST) < 0) {
+        fprintf(stderr, "PM lock %s released more often than acquired\n", handle->name);
+        abort();
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_pm_dump_locks(FILE *stream)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup(void)
+{
+    return ESP_OK;
+}
+
+// ROM functions
+
+uint32_t crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    return (uint32_t)crc32(crc, buf, len);
+}
+
+// tinfl on zlib's raw inflate. The stream is set up on the first call
+// after tinfl_init, owner tells a live stream from uninitialized memory
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *in_buf_next, size_t *in_buf_size,
+                              uint8_t *out_buf_start, uint8_t *out_buf_next, size_t *out_buf_size,
+                              const uint32_t decomp_flags)
+{
+    if (r->m_state == 0) {
+        if (r->owner == r && r->stream != NULL) {
+            inflateEnd(r->stream);
+            free(r->stream);
+        }
+        r->stream = calloc(1, sizeof(z_stream));
+        r->owner = r;
+        int window_bits = (decomp_flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? 15 : -15;
+        if (inflateInit2((z_stream *)r->stream, window_bits) != Z_OK) {
+            return TINFL_STATUS_FAILED;
+        }
+        r->m_state = 1;
+    } else if (r->m_state == 2) {
+        *in_buf_size = 0;
+        *out_buf_size = 0;
+        return TINFL_STATUS_DONE;
+    }
+    z_stream *z = r->stream;
+    z->next_in = (Bytef *)in_buf_next;
+    z->avail_in = *in_buf_size;
+    z->next_out = out_buf_next;
+    z->avail_out = *out_buf_size;
+    int ret = inflate(z, Z_NO_FLUSH);
+    *in_buf_size -= z->avail_in;
+    *out_buf_size -= z->avail_out;
+    if (ret == Z_STREAM_END) {
+        inflateEnd(z);
+        free(z);
+        r->stream = NULL;
+        r->m_state = 2;
+        return TINFL_STATUS_DONE;
+    }
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return TINFL_STATUS_FAILED;
+    }
+    if (z->avail_out == 0) {
+        return TINFL_STATUS_HAS_MORE_OUTPUT;
+    }
+    if (!(decomp_flags & TINFL_FLAG_HAS_MORE_INPUT)) {
+        return TINFL_STATUS_FAILED;
+    }
+    return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
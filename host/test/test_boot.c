@@ -0,0 +1,131 @@
+// Install, self-test and rollback of builds/update.bin over the factory
+// image, booting the app of this executable on the simulated board
+#include APP_MAIN_C
+#include "sim.h"
+#include <time.h>
+#include <utime.h>
+
+#define CARD "boot"
+
+static bool is_update_removed(void)
+{
+    return !sim_card_exists(CARD, "update.bin") && sim_card_exists(CARD, "receipts.bin");
+}
+
+static void check_confirmed(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_update_removed, 30000));
+}
+
+static void check_write_protected(void *arg)
+{
+    sim_delay_ms(CONFIG_OTA_HEALTH_TIMEOUT_MS + 5000);
+    SIM_CHECK(sim_card_exists(CARD, "update.bin"));
+    SIM_CHECK(!sim_card_exists(CARD, "receipts.bin"));
+    SIM_CHECK(sim_stats.card_bytes_written == 0);
+}
+
+static void check_idle(void *arg)
+{
+    sim_delay_ms(10000);
+    SIM_CHECK(sim_stats.flash_bytes_written == 0);
+}
+
+static bool is_absent(void)
+{
+    return sd_state == SD_STATE_ABSENT;
+}
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE;
+}
+
+// The phases of a rejected attempt are closed, so the receipt and the
+// trace report carry their times
+static void check_rejected(void *arg)
+{
+    int64_t total_us[TRACE_PHASES];
+    int count[TRACE_PHASES];
+    SIM_CHECK(sim_wait_for(is_attempt_over, 30000));
+    trace_totals(total_us, count);
+    SIM_CHECK(count[TRACE_HEADER] == 1);
+    SIM_CHECK(count[TRACE_TRANSFER] == 1);
+    SIM_CHECK(sim_stats.ota_set_boot_calls == 0);
+}
+
+// After a rejected card is pulled, a card with another image is scanned
+// and installed without a reboot
+static void swap_rejected_card(void *arg)
+{
+    char path[512];
+    struct utimbuf times;
+    SIM_CHECK(sim_wait_for(is_attempt_over, 30000));
+    sim_card_remove();
+    SIM_CHECK(sim_wait_for(is_absent, 10000));
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    // A file written later, even if it has the size of the rejected one
+    times.actime = times.modtime = time(NULL) + 60;
+    SIM_CHECK(utime(sim_card_path(CARD, "update.bin", path, sizeof(path)), &times) == 0);
+    sim_card_insert(CARD);
+    sim_delay_ms(60000);
+}
+
+static void install(const char *work_dir, bool is_write_protected)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    sim_card_set_write_protect(is_write_protected);
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(sim_run_until_restart, NULL) == SIM_EXIT_RESTART);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    sim_config.time_scale = 0.2;
+
+    printf("Install and confirm\n");
+    install(work_dir, false);
+    SIM_CHECK(sim_boot(check_confirmed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+
+    printf("Rollback with the diagnostics button held\n");
+    install(work_dir, false);
+    sim_gpio_set(DIAGNOSTICS_BUTTON_GPIO, 0);
+    SIM_CHECK(sim_boot(sim_run_until_restart, NULL) == SIM_EXIT_RESTART);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+    sim_gpio_set(DIAGNOSTICS_BUTTON_GPIO, 1);
+    // The rolled back version is not installed again
+    SIM_CHECK(sim_boot(check_idle, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(sim_card_exists(CARD, "update.bin"));
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    printf("Image of the running version\n");
+    size_t image_size, factory_size;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    uint8_t *factory = sim_read_file(SIM_BUILDS_DIR "/current.bin", &factory_size);
+    SIM_CHECK(image != NULL && factory != NULL);
+    SIM_CHECK(sim_image_set_version(image, image_size, sim_image_version(factory, factory_size)));
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.bin", image, image_size));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(check_rejected, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    printf("Rejected card swapped for one with an update\n");
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.bin", image, image_size));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(swap_rejected_card, NULL) == SIM_EXIT_RESTART);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+    free(image);
+    free(factory);
+
+    printf("Write protected card\n");
+    install(work_dir, true);
+    SIM_CHECK(sim_boot(check_write_protected, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+    return 0;
+}
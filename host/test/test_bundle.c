@@ -0,0 +1,77 @@
+// update.bundle built by tools/mkbundle.py from builds/update.bin and a
+// data image for the storage partition. Both reach their partition byte
+// for byte, and an entry that does not match its SHA-256, the app image
+// or the data image, leaves the boot partition alone
+//
+// Usage: test_bundle <bundle> <storage data image>
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD            "bundle"
+#define STORAGE_OFFSET  0x1000
+// Layout written by mkbundle.py: a 16 byte header, then 56 byte entries
+// ending with their SHA-256
+#define BUNDLE_HEADER   16
+#define BUNDLE_ENTRY    56
+#define ENTRY_SHA256    24
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE;
+}
+
+static void check_not_installed(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_attempt_over, 60000));
+    SIM_CHECK(sim_stats.ota_set_boot_calls == 0);
+}
+
+static void boot_with_bundle(const char *work_dir, const void *bundle_data, size_t bundle_size)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.bundle", bundle_data, bundle_size));
+    sim_card_insert(CARD);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t bundle_size, storage_size, image_size;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <bundle> <storage data image>\n", argv[0]);
+        return 2;
+    }
+    uint8_t *bundle_data = sim_read_file(argv[1], &bundle_size);
+    uint8_t *storage = sim_read_file(argv[2], &storage_size);
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(bundle_data != NULL && storage != NULL && image != NULL);
+    sim_config.time_scale = 0.1;
+
+    printf("Bundle of an app image and %u bytes for storage\n", (uint32_t)storage_size);
+    boot_with_bundle(work_dir, bundle_data, bundle_size);
+    sim_expect_install(image, image_size);
+    uint8_t *written = malloc(storage_size);
+    SIM_CHECK(written != NULL);
+    SIM_CHECK(sim_flash_read("storage", STORAGE_OFFSET, written, storage_size));
+    SIM_CHECK(memcmp(written, storage, storage_size) == 0);
+    free(written);
+
+    printf("App entry with a wrong SHA-256\n");
+    bundle_data[BUNDLE_HEADER + ENTRY_SHA256] ^= 0xff;
+    boot_with_bundle(work_dir, bundle_data, bundle_size);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+    bundle_data[BUNDLE_HEADER + ENTRY_SHA256] ^= 0xff;
+
+    printf("Data entry with a wrong SHA-256\n");
+    bundle_data[BUNDLE_HEADER + BUNDLE_ENTRY + ENTRY_SHA256] ^= 0xff;
+    boot_with_bundle(work_dir, bundle_data, bundle_size);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    free(bundle_data);
+    free(storage);
+    free(image);
+    return 0;
+}
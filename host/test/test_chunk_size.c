@@ -0,0 +1,43 @@
+// Read buffers of CONFIG_OTA_CHUNK_SIZE bytes from the heap, halved until
+// they fit when the heap is tight, and the image written the same way
+// whatever the chunk size
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "chunk"
+
+static int expected_chunk_size;
+
+static void check_chunk_size(void)
+{
+    printf("%d byte chunks with %u bytes of heap\n", ota_buffer_size, (uint32_t)sim_config.heap_size);
+    SIM_CHECK(ota_buffer_size == expected_chunk_size);
+}
+
+static void install(const char *work_dir, size_t heap_size, int chunk_size)
+{
+    size_t image_size;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(image != NULL);
+
+    sim_config.heap_size = heap_size;
+    expected_chunk_size = chunk_size;
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.bin", image, image_size));
+    sim_card_insert(CARD);
+    sim_expect_install(image, image_size);
+    free(image);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    sim_config.time_scale = 0.1;
+    sim_set_restart_hook(check_chunk_size);
+    install(work_dir, 280 * 1024, BUFFSIZE);
+    // Four 32 KB buffers do not fit, four 16 KB ones do
+    install(work_dir, 120 * 1024, BUFFSIZE / 2);
+    install(work_dir, 90 * 1024, BUFFSIZE / 4);
+    return 0;
+}
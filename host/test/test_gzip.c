@@ -0,0 +1,110 @@
+// update.bin.gz is inflated on the fly into the same image as update.bin,
+// reading only the compressed bytes from the card. A corrupted or
+// truncated file is not installed, and once the new image is confirmed
+// only the installed file leaves the card
+#include APP_MAIN_C
+#include <zlib.h>
+#include "sim.h"
+
+#define CARD "gzip"
+
+static size_t gzip_size;
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE;
+}
+
+static void run_until_attempt_over(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_attempt_over, 60000));
+}
+
+static bool is_update_removed(void)
+{
+    return !sim_card_exists(CARD, "update.bin.gz");
+}
+
+static void check_cleanup(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_update_removed, 30000));
+    SIM_CHECK(sim_card_exists(CARD, "update.patch"));
+}
+
+// Bytes read from the card against bytes written to flash
+static void check_bytes_read(void)
+{
+    printf("Read %llu bytes from the card, %d of them compressed image, for %u bytes written (%d%%)\n",
+           (unsigned long long)sim_stats.card_bytes_read, update_input.total, trace_write_bytes,
+           (int)(100LL * update_input.total / trace_write_bytes));
+    SIM_CHECK((size_t)update_input.total == gzip_size);
+    SIM_CHECK(update_input.total < trace_write_bytes);
+    // Besides the image only directory and FAT sectors
+    SIM_CHECK(sim_stats.card_bytes_read < gzip_size + 64 * 1024);
+}
+
+static uint8_t *compress_image(const char *work_dir, size_t *size)
+{
+    char path[512];
+    size_t image_size;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    snprintf(path, sizeof(path), "%s.gz", work_dir);
+    gzFile gz = gzopen(path, "wb9");
+    SIM_CHECK(image != NULL && gz != NULL);
+    SIM_CHECK(gzwrite(gz, image, image_size) == (int)image_size);
+    SIM_CHECK(gzclose(gz) == Z_OK);
+    free(image);
+    uint8_t *data = sim_read_file(path, size);
+    unlink(path);
+    return data;
+}
+
+static void boot_with_gzip(const char *work_dir, const void *data, size_t size)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.bin.gz", data, size));
+    // Lower in the order of preference than update.bin.gz
+    SIM_CHECK(sim_card_put(CARD, "update.patch", "ESPPATCH", 8));
+    sim_card_insert(CARD);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t image_size;
+
+    sim_config.time_scale = 0.1;
+    uint8_t *data = compress_image(work_dir, &gzip_size);
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(data != NULL && image != NULL);
+
+    printf("Round trip\n");
+    boot_with_gzip(work_dir, data, gzip_size);
+    sim_set_restart_hook(check_bytes_read);
+    sim_expect_install(image, image_size);
+    sim_set_restart_hook(NULL);
+    SIM_CHECK(sim_boot(check_cleanup, NULL) == SIM_EXIT_DONE);
+
+    printf("Corrupted compressed data\n");
+    data[gzip_size / 2] ^= 0x10;
+    boot_with_gzip(work_dir, data, gzip_size);
+    SIM_CHECK(sim_boot(run_until_attempt_over, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+    data[gzip_size / 2] ^= 0x10;
+
+    printf("Corrupted trailer\n");
+    data[gzip_size - 6] ^= 0x01;
+    boot_with_gzip(work_dir, data, gzip_size);
+    SIM_CHECK(sim_boot(run_until_attempt_over, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+    data[gzip_size - 6] ^= 0x01;
+
+    printf("Truncated file\n");
+    boot_with_gzip(work_dir, data, gzip_size - 1000);
+    SIM_CHECK(sim_boot(run_until_attempt_over, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    free(data);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,81 @@
+// 100 insertions and removals of a card without an update. Reports the
+// heap peak and fragmentation they caused: whatever a mount allocates is
+// freed again at unmount, so the free heap and its largest block end
+// where they started, and the cycles never go past the peak of the boot
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD   "cycles"
+#define CYCLES 100
+
+static bool is_done(void)
+{
+    return sd_state == SD_STATE_DONE;
+}
+
+static bool is_unmounted(void)
+{
+    return sd_state == SD_STATE_ABSENT && !is_sd_card_mounted;
+}
+
+static bool is_settled(void)
+{
+    return is_done() && (xEventGroupGetBits(boot_events) & BOOT_CARD_SETTLED);
+}
+
+static void cycle_card(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_settled, 30000));
+    // Let the boot finish its housekeeping
+    sim_delay_ms(5000);
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_before = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    size_t min_free_before = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    size_t min_largest = largest_before;
+    size_t free_unmounted = 0;
+    uint32_t mounts = sim_stats.card_mounts;
+
+    for (int i = 0; i < CYCLES; i++) {
+        sim_card_remove();
+        SIM_CHECK(sim_wait_for(is_unmounted, 10000));
+        free_unmounted = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        sim_card_insert(CARD);
+        SIM_CHECK(sim_wait_for(is_done, 10000));
+        size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        if (largest < min_largest) {
+            min_largest = largest;
+        }
+    }
+    sim_delay_ms(5000);
+    size_t free_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_after = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    size_t min_free_after = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+
+    printf("%u cycles, %u mounts\n", CYCLES, sim_stats.card_mounts - mounts);
+    printf("mounted card  %7u bytes of heap\n", (uint32_t)(free_unmounted - free_after));
+    printf("free heap     %7u -> %7u bytes (%+d)\n", (uint32_t)free_before, (uint32_t)free_after,
+           (int)(free_after - free_before));
+    printf("largest block %7u -> %7u bytes (%+d), %u at worst between cycles\n", (uint32_t)largest_before,
+           (uint32_t)largest_after, (int)(largest_after - largest_before), (uint32_t)min_largest);
+    printf("heap peak     %7u bytes, %+d during the cycles\n", (uint32_t)sim_heap_peak(),
+           (int)(min_free_before - min_free_after));
+    printf("fragmentation %7.2f%% -> %.2f%%\n", 100.0 * (free_before - largest_before) / free_before,
+           100.0 * (free_after - largest_after) / free_after);
+    SIM_CHECK(sim_stats.card_mounts - mounts == CYCLES);
+    SIM_CHECK(free_after == free_before);
+    SIM_CHECK(largest_after == largest_before);
+    SIM_CHECK(min_free_after == min_free_before);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    sim_config.time_scale = 0.05;
+    sim_config.log_level = ESP_LOG_WARN;
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "notes.txt", "no update", 9));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(cycle_card, NULL) == SIM_EXIT_DONE);
+    return 0;
+}
@@ -0,0 +1,62 @@
+// update.patch built by tools/mkpatch.py from builds/current.bin to
+// builds/update.bin rebuilds update.bin byte for byte over the running
+// factory image. A patch for another source or a truncated one is not
+// installed
+//
+// Usage: test_patch <current to update patch> <update to current patch>
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "patch"
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE;
+}
+
+static void run_until_attempt_over(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_attempt_over, 60000));
+}
+
+static void boot_with_patch(const char *work_dir, const void *patch_data, size_t patch_size)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "update.patch", patch_data, patch_size));
+    sim_card_insert(CARD);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t patch_size, reverse_size, image_size;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <patch> <reverse patch>\n", argv[0]);
+        return 2;
+    }
+    uint8_t *patch_data = sim_read_file(argv[1], &patch_size);
+    uint8_t *reverse_data = sim_read_file(argv[2], &reverse_size);
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(patch_data != NULL && reverse_data != NULL && image != NULL);
+    sim_config.time_scale = 0.1;
+
+    printf("Patch of %u bytes for a %u byte image\n", (uint32_t)patch_size, (uint32_t)image_size);
+    boot_with_patch(work_dir, patch_data, patch_size);
+    sim_expect_install(image, image_size);
+
+    printf("Patch made for another source image\n");
+    boot_with_patch(work_dir, reverse_data, reverse_size);
+    SIM_CHECK(sim_boot(run_until_attempt_over, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    printf("Truncated patch\n");
+    boot_with_patch(work_dir, patch_data, patch_size / 2);
+    SIM_CHECK(sim_boot(run_until_attempt_over, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    free(patch_data);
+    free(reverse_data);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,43 @@
+// Card reads and flash writes of an install overlap: with the card about
+// as slow as the flash, streaming the image takes well under the sum of
+// the time spent reading and writing, and the image lands intact
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "pipeline"
+
+static void check_overlap(void)
+{
+    int64_t total_us[TRACE_PHASES];
+    int count[TRACE_PHASES];
+    trace_totals(total_us, count);
+    int64_t stream_us = total_us[TRACE_TRANSFER] - total_us[TRACE_ERASE];
+    // Reads also stall while the partition is erased, time the card
+    // itself was busy is what a serial loop would spend on it
+    int64_t serial_us = sim_stats.card_busy_us + trace_write_us;
+    double speedup = (double)serial_us / stream_us;
+
+    printf("card busy %" PRId64 " ms, write %" PRId64 " ms, streamed in %" PRId64 " ms, %.2fx over serial\n",
+           sim_stats.card_busy_us / 1000, trace_write_us / 1000, stream_us / 1000, speedup);
+    SIM_CHECK(sim_stats.card_busy_us > trace_write_us / 2);
+    SIM_CHECK(speedup > 1.5);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t image_size;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(image != NULL);
+
+    // Card transfers at the speed flash is programmed at
+    sim_config.time_scale = 0.25;
+    sim_config.card_max_kbps = sim_config.flash_write_kbps;
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    sim_card_insert(CARD);
+    sim_set_restart_hook(check_overlap);
+    sim_expect_install(image, image_size);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// The raw sector fast path returns the same bytes as stdio, on FAT16 and
+// FAT32 volumes with contiguous and fragmented files, and after a seek
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "raw"
+
+static const sim_card_layout_t layouts[] = {
+    { .fat_type = 32, .cluster_sectors = 32 },
+    { .fat_type = 32, .cluster_sectors = 8, .fragment_run = 3, .fragment_gap = 2 },
+    { .fat_type = 32, .cluster_sectors = 1, .fragment_run = 1, .fragment_gap = 1 },
+    { .fat_type = 16, .cluster_sectors = 64 },
+    { .fat_type = 16, .cluster_sectors = 4, .fragment_run = 5, .fragment_gap = 7 },
+};
+
+static const char *files[] = { "image.bin", "odd.bin", "one.bin", "empty.bin" };
+
+static bool is_card_settled(void)
+{
+    return is_sd_card_mounted && sd_state == SD_STATE_DONE;
+}
+
+// Reads a whole file in BUFFSIZE chunks from offset, through the raw path
+// or stdio
+static uint8_t *read_through(const char *name, bool is_raw, int offset, size_t *size)
+{
+    static char chunk[BUFFSIZE];
+
+    SIM_CHECK(open_update_file(name, is_raw));
+    SIM_CHECK(update_file.is_raw == is_raw);
+    SIM_CHECK(offset == 0 || seek_update_file(offset));
+    uint8_t *data = malloc(update_file.size + 1);
+    size_t done = 0;
+    int data_read;
+    while ((data_read = read_update_file(chunk, sizeof(chunk))) > 0) {
+        SIM_CHECK(done + data_read <= (size_t)update_file.size);
+        memcpy(data + done, chunk, data_read);
+        done += data_read;
+    }
+    SIM_CHECK(data_read == 0);
+    close_update_file();
+    *size = done;
+    return data;
+}
+
+static void compare_paths(void *arg)
+{
+    char path[512];
+
+    SIM_CHECK(sim_wait_for(is_card_settled, 10000));
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        sim_card_layout = layouts[l];
+        for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+            size_t expected_size;
+            uint8_t *expected = sim_read_file(sim_card_path(CARD, files[f], path, sizeof(path)), &expected_size);
+            SIM_CHECK(expected != NULL);
+            // Seeks are sector aligned, as for a resumed update
+            int offsets[] = { 0, 512, 3 * 4096 };
+            for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+                if ((size_t)offsets[o] > expected_size) {
+                    continue;
+                }
+                size_t raw_size, stdio_size;
+                uint8_t *raw = read_through(files[f], true, offsets[o], &raw_size);
+                uint8_t *stdio = read_through(files[f], false, offsets[o], &stdio_size);
+                SIM_CHECK(raw_size == expected_size - offsets[o]);
+                SIM_CHECK(stdio_size == raw_size);
+                SIM_CHECK(memcmp(raw, expected + offsets[o], raw_size) == 0);
+                SIM_CHECK(memcmp(stdio, raw, raw_size) == 0);
+                free(raw);
+                free(stdio);
+            }
+            free(expected);
+        }
+        printf("FAT%d, %d sector clusters, %d/%d fragments: raw and stdio reads match\n",
+               layouts[l].fat_type, layouts[l].cluster_sectors, layouts[l].fragment_run, layouts[l].fragment_gap);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    uint8_t odd[5000];
+
+    sim_config.time_scale = 0.05;
+    sim_board_init(work_dir);
+    // Not named as an update, so the app leaves the card alone
+    SIM_CHECK(sim_card_copy(CARD, "image.bin", SIM_BUILDS_DIR "/update.bin"));
+    for (size_t i = 0; i < sizeof(odd); i++) {
+        odd[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    SIM_CHECK(sim_card_put(CARD, "odd.bin", odd, sizeof(odd)));
+    SIM_CHECK(sim_card_put(CARD, "one.bin", odd, 1));
+    SIM_CHECK(sim_card_put(CARD, "empty.bin", odd, 0));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(compare_paths, NULL) == SIM_EXIT_DONE);
+    return 0;
+}
@@ -0,0 +1,112 @@
+// An install cut short by pulling the card or by a power loss resumes
+// at its last checkpoint: the next attempt reads only the rest of the
+// image from the card, and the image it boots is the one on the card.
+// Faults are injected at random offsets from a fixed seed. The receipt of
+// a resumed install names the version of the image
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD   "resume"
+#define ROUNDS 6
+#define SEED   20201017
+
+static size_t image_size;
+static const char *image_version;
+static uint64_t power_loss_bytes;
+static uint64_t first_bytes_read;
+static uint32_t first_bytes_written;
+
+static bool is_attempt_cut(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_ABSENT && !is_reader_running;
+}
+
+static void reinsert_card(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_attempt_cut, 60000));
+    first_bytes_read = sim_stats.card_bytes_read;
+    first_bytes_written = trace_write_bytes;
+    sim_delay_ms(500);
+    sim_card_insert(CARD);
+    sim_delay_ms(60000);
+}
+
+// Bytes left to read when resuming at the last full checkpoint interval
+// written before the fault
+static uint64_t resume_bound(uint64_t written)
+{
+    return image_size - written / CHECKPOINT_INTERVAL * CHECKPOINT_INTERVAL;
+}
+
+static void check_receipt(void)
+{
+    SIM_CHECK(pending_receipt.record.status == RECEIPT_INSTALLED);
+    SIM_CHECK(strncmp(pending_receipt.record.new_version, image_version, RECEIPT_VERSION_LEN) == 0);
+}
+
+static void check_resumed_after_removal(void)
+{
+    uint64_t second_bytes_read = sim_stats.card_bytes_read - first_bytes_read;
+    printf("  pulled after %u bytes written, %llu bytes read again\n",
+           first_bytes_written, (unsigned long long)second_bytes_read);
+    SIM_CHECK(ota_attempts == 2);
+    SIM_CHECK(second_bytes_read == resume_bound(first_bytes_written));
+    check_receipt();
+}
+
+static void check_resumed_after_power_loss(void)
+{
+    printf("  power lost after %llu bytes written, %llu bytes read after it\n",
+           (unsigned long long)power_loss_bytes, (unsigned long long)sim_stats.card_bytes_read);
+    // Sectors already holding their content are not written again, so the
+    // checkpoint can be past the bytes that reached the flash
+    SIM_CHECK(sim_stats.card_bytes_read <= resume_bound(power_loss_bytes));
+    // A sector cut while being programmed is erased again before the
+    // resumed attempt writes it
+    SIM_CHECK(sim_stats.flash_dirty_writes == 0);
+    check_receipt();
+}
+
+static void set_up_board(const char *work_dir)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    sim_card_insert(CARD);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    sim_config.time_scale = 0.1;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(image != NULL);
+    image_version = sim_image_version(image, image_size);
+    SIM_CHECK(image_version != NULL);
+    srand(SEED);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        uint64_t offset = rand() % image_size;
+        printf("Card pulled after %llu bytes read\n", (unsigned long long)offset);
+        set_up_board(work_dir);
+        sim_card_remove_after(offset);
+        sim_set_restart_hook(check_resumed_after_removal);
+        SIM_CHECK(sim_boot(reinsert_card, NULL) == SIM_EXIT_RESTART);
+        sim_check_installed(image, image_size);
+    }
+
+    for (int i = 0; i < ROUNDS; i++) {
+        power_loss_bytes = rand() % image_size;
+        printf("Power lost after %llu bytes written\n", (unsigned long long)power_loss_bytes);
+        set_up_board(work_dir);
+        sim_power_loss_after(power_loss_bytes);
+        sim_set_restart_hook(NULL);
+        SIM_CHECK(sim_boot(sim_run_until_restart, NULL) == SIM_EXIT_POWER_LOSS);
+        SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+        sim_set_restart_hook(check_resumed_after_power_loss);
+        sim_expect_install(image, image_size);
+    }
+
+    free(image);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Bus settings cached for a card that fails reads during an update step
+// down one setting per failed attempt, and are tuned again past the
+// slowest one. Pulling the card is not a read error and keeps them
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "tuning"
+
+static sd_tuning_t before;
+
+static bool is_transferring(void)
+{
+    return is_reader_running;
+}
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE && !is_reader_running;
+}
+
+static bool is_attempt_cut(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_ABSENT && !is_reader_running;
+}
+
+static bool has_tuning(sd_tuning_t *tuning)
+{
+    char key[16];
+    snprintf(key, sizeof(key), "c%08x", before.cid_crc);
+    return load_sd_tuning(key, tuning);
+}
+
+// The card mounts at setting f, and a failed read moves the cached
+// settings on to the next one, or drops them after the slowest
+static void fail_reads(void *arg)
+{
+    int f = *(int *)arg;
+    sd_tuning_t after;
+    SIM_CHECK(sim_wait_for(is_transferring, 30000));
+    SIM_CHECK(load_sd_tuning(SD_TUNING_LAST, &before));
+    SIM_CHECK(before.freq_khz == sd_tuning_freqs[f]);
+    sim_card_fail_reads_after(ota_buffer_size);
+    SIM_CHECK(sim_wait_for(is_attempt_over, 30000));
+    SIM_CHECK(sim_stats.ota_set_boot_calls == 0);
+    if (f + 1 < SD_TUNING_FREQS) {
+        SIM_CHECK(has_tuning(&after));
+        SIM_CHECK(after.freq_khz == sd_tuning_freqs[f + 1] && after.width == before.width);
+    } else {
+        SIM_CHECK(!has_tuning(&after));
+    }
+}
+
+static void pull_card(void *arg)
+{
+    sd_tuning_t after;
+    SIM_CHECK(sim_wait_for(is_transferring, 30000));
+    SIM_CHECK(load_sd_tuning(SD_TUNING_LAST, &before));
+    sim_card_remove();
+    SIM_CHECK(sim_wait_for(is_attempt_cut, 30000));
+    SIM_CHECK(has_tuning(&after));
+    SIM_CHECK(after.freq_khz == before.freq_khz && after.width == before.width);
+}
+
+// A card tuned again mounts at the fastest setting
+static void check_tuned_again(void)
+{
+    sd_tuning_t tuning;
+    SIM_CHECK(load_sd_tuning(SD_TUNING_LAST, &tuning));
+    SIM_CHECK(tuning.freq_khz == sd_tuning_freqs[0]);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t image_size;
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(image != NULL);
+    sim_config.time_scale = 0.1;
+
+    printf("Card pulled during the transfer\n");
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(pull_card, NULL) == SIM_EXIT_DONE);
+
+    for (int f = 0; f < SD_TUNING_FREQS; f++) {
+        printf("Read errors at %d kHz\n", sd_tuning_freqs[f]);
+        sim_card_insert(CARD);
+        SIM_CHECK(sim_boot(fail_reads, &f) == SIM_EXIT_DONE);
+    }
+
+    printf("Update after the read errors\n");
+    sim_card_insert(CARD);
+    sim_set_restart_hook(check_tuned_again);
+    sim_expect_install(image, image_size);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Images are checked against their manifest while they stream, and a
+// mismatch ends the install before esp_ota_set_boot_partition. Images in
+// the updates directory are checked against their own manifest
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "sha256"
+
+static uint8_t *image;
+static size_t image_size;
+
+static bool is_attempt_over(void)
+{
+    return ota_attempts > 0 && sd_state == SD_STATE_DONE;
+}
+
+static void check_not_installed(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_attempt_over, 60000));
+    SIM_CHECK(sim_stats.ota_set_boot_calls == 0);
+}
+
+// Manifest as written by sha256sum
+static void put_manifest(const char *file, const char *image_name, const uint8_t *data, size_t size)
+{
+    uint8_t sha256[32];
+    char text[128];
+    mbedtls_sha256_ret(data, size, sha256, 0);
+    for (int i = 0; i < 32; i++) {
+        sprintf(&text[i * 2], "%02x", sha256[i]);
+    }
+    snprintf(&text[64], sizeof(text) - 64, "  %s\n", image_name);
+    SIM_CHECK(sim_card_put(CARD, file, text, strlen(text)));
+}
+
+static void boot_with(const char *work_dir, const char *name, const uint8_t *data)
+{
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, name, data, image_size));
+    sim_card_insert(CARD);
+}
+
+// A copy of the image with one byte of code changed, valid for
+// esp_ota_end but not matching the manifest of the original
+static uint8_t *tampered_image(void)
+{
+    uint8_t *tampered = malloc(image_size);
+    memcpy(tampered, image, image_size);
+    tampered[image_size / 2] ^= 0x01;
+    SIM_CHECK(sim_image_seal(tampered, image_size));
+    return tampered;
+}
+
+// A copy of the image with another version, to be picked from the
+// updates directory over the running 0.1.0
+static uint8_t *versioned_image(const char *version)
+{
+    uint8_t *versioned = malloc(image_size);
+    memcpy(versioned, image, image_size);
+    SIM_CHECK(sim_image_set_version(versioned, image_size, version));
+    return versioned;
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    sim_config.time_scale = 0.1;
+    image = sim_read_file(SIM_BUILDS_DIR "/update.bin", &image_size);
+    SIM_CHECK(image != NULL);
+    uint8_t *tampered = tampered_image();
+    uint8_t *corrupted = malloc(image_size);
+    memcpy(corrupted, image, image_size);
+    corrupted[image_size / 2] ^= 0x01;
+
+    printf("Matching manifest\n");
+    boot_with(work_dir, "update.bin", image);
+    put_manifest("update.sha256", "update.bin", image, image_size);
+    sim_expect_install(image, image_size);
+
+    printf("Manifest of another image\n");
+    boot_with(work_dir, "update.bin", image);
+    put_manifest("update.sha256", "update.bin", tampered, image_size);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    printf("Tampered image, valid for esp_ota_end\n");
+    boot_with(work_dir, "update.bin", tampered);
+    put_manifest("update.sha256", "update.bin", image, image_size);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+    // Only the manifest stops it
+    boot_with(work_dir, "update.bin", tampered);
+    sim_expect_install(tampered, image_size);
+
+    printf("Corrupted image without a manifest\n");
+    boot_with(work_dir, "update.bin", corrupted);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    printf("Image in the updates directory with its own manifest\n");
+    uint8_t *versioned = versioned_image("0.1.1");
+    boot_with(work_dir, "updates/v0.1.1.bin", versioned);
+    put_manifest("updates/v0.1.1.sha256", "v0.1.1.bin", versioned, image_size);
+    sim_expect_install(versioned, image_size);
+
+    printf("Image in the updates directory with a wrong manifest\n");
+    boot_with(work_dir, "updates/v0.1.1.bin", versioned);
+    put_manifest("updates/v0.1.1.sha256", "v0.1.1.bin", image, image_size);
+    // update.sha256 is only for files at the root
+    put_manifest("update.sha256", "updates/v0.1.1.bin", versioned, image_size);
+    SIM_CHECK(sim_boot(check_not_installed, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(strcmp(sim_boot_label(), "factory") == 0);
+
+    free(versioned);
+    free(corrupted);
+    free(tampered);
+    free(image);
+    return 0;
+}
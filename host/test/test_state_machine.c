@@ -0,0 +1,121 @@
+// The card handling state machine: its transition table for every state
+// and event, then the app driven by simulated card detect edges. A
+// bouncing contact is one insertion or removal, a blip shorter than the
+// debounce is none, and nothing wakes while the card is left alone
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD        "state"
+#define PIN_CD      25
+#define SD_STATES   (SD_STATE_DONE + 1)
+#define SD_EVENTS   (SD_EVENT_RESCAN + 1)
+
+#define A SD_STATE_ABSENT
+#define M SD_STATE_MOUNTING
+#define S SD_STATE_SCANNING
+#define U SD_STATE_UPDATING
+#define D SD_STATE_DONE
+
+static const sd_state_t expected_next[SD_STATES][SD_EVENTS] = {
+    //         NONE INSERTED REMOVED MOUNTED MOUNT_FAILED UPDATE_FOUND NO_UPDATE UPDATE_ENDED RESCAN
+    [A] = {    A,   M,       A,      A,      A,           A,           A,        A,           A },
+    [M] = {    M,   M,       A,      S,      D,           M,           M,        M,           M },
+    [S] = {    S,   S,       A,      S,      S,           U,           D,        S,           S },
+    [U] = {    U,   U,       A,      U,      U,           U,           U,        D,           U },
+    [D] = {    D,   D,       A,      D,      D,           D,           D,        D,           S },
+};
+
+static void check_transition_table(void)
+{
+    for (int state = 0; state < SD_STATES; state++) {
+        for (int event = 0; event < SD_EVENTS; event++) {
+            if (sd_next_state(state, event) != expected_next[state][event]) {
+                printf("%s on event %d goes to %s\n", sd_state_names[state], event,
+                       sd_state_names[sd_next_state(state, event)]);
+                SIM_CHECK(sd_next_state(state, event) == expected_next[state][event]);
+            }
+        }
+    }
+}
+
+static bool is_settled(void)
+{
+    return xEventGroupGetBits(boot_events) & BOOT_CARD_SETTLED;
+}
+
+static bool is_done(void)
+{
+    return sd_state == SD_STATE_DONE;
+}
+
+static bool is_absent(void)
+{
+    return sd_state == SD_STATE_ABSENT;
+}
+
+// Edges every 2 ms, well within the debounce time, ending on level
+static void bounce(int level)
+{
+    for (int i = 0; i < 8; i++) {
+        sim_gpio_set(PIN_CD, (i % 2 == 0) ? level : !level);
+        sim_delay_ms(2);
+    }
+}
+
+static void drive_card_detect(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_settled, 10000));
+    SIM_CHECK(sd_state == SD_STATE_ABSENT);
+
+    printf("Nothing wakes while no card is present\n");
+    uint32_t wakeups = sim_stats.task_wakeups;
+    sim_delay_ms(30000);
+    printf("  %u wakeups in 30 s\n", sim_stats.task_wakeups - wakeups);
+    SIM_CHECK(sim_stats.task_wakeups == wakeups);
+
+    printf("Bouncing insertion\n");
+    bounce(0);
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_wait_for(is_done, 10000));
+    SIM_CHECK(sim_stats.card_mounts == 1);
+    SIM_CHECK(is_sd_card_mounted);
+
+    printf("Blip shorter than the debounce time\n");
+    sim_gpio_set(PIN_CD, 1);
+    sim_delay_ms(SD_DEBOUNCE_MS / 5);
+    sim_gpio_set(PIN_CD, 0);
+    sim_delay_ms(SD_DEBOUNCE_MS * 4);
+    SIM_CHECK(sd_state == SD_STATE_DONE);
+    SIM_CHECK(sim_stats.card_mounts == 1);
+
+    printf("Bouncing removal\n");
+    bounce(1);
+    sim_card_remove();
+    SIM_CHECK(sim_wait_for(is_absent, 10000));
+    sim_delay_ms(SD_DEBOUNCE_MS * 4);
+    SIM_CHECK(sd_state == SD_STATE_ABSENT);
+    SIM_CHECK(!is_sd_card_mounted);
+    SIM_CHECK(sim_stats.card_mounts == 1);
+
+    printf("Card with an update inserted\n");
+    SIM_CHECK(sim_card_copy(CARD, "update.bin", SIM_BUILDS_DIR "/update.bin"));
+    bounce(0);
+    sim_card_insert(CARD);
+    sim_delay_ms(60000);
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+
+    printf("Transition table\n");
+    check_transition_table();
+
+    sim_config.time_scale = 0.1;
+    sim_board_init(work_dir);
+    SIM_CHECK(sim_card_put(CARD, "notes.txt", "no update", 9));
+    sim_card_remove();
+    SIM_CHECK(sim_boot(drive_card_detect, NULL) == SIM_EXIT_RESTART);
+    SIM_CHECK(strcmp(sim_boot_label(), "ota_0") == 0);
+    return 0;
+}
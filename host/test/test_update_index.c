@@ -0,0 +1,63 @@
+// The index of the updates directory cached on the card. It is kept
+// while the images listed in the directory are the ones it was built
+// from, and an image added by a host that leaves the directory mtime
+// unchanged is still found
+#include APP_MAIN_C
+#include "sim.h"
+
+#define CARD "index"
+// An mtime no boot writes, to tell whether the cache was written again
+#define OLD_MTIME 1000000000
+
+static bool is_settled(void)
+{
+    return sd_state == SD_STATE_DONE && (xEventGroupGetBits(boot_events) & BOOT_CARD_SETTLED);
+}
+
+static void check_idle(void *arg)
+{
+    SIM_CHECK(sim_wait_for(is_settled, 30000));
+    sim_delay_ms(5000);
+    SIM_CHECK(sim_stats.flash_bytes_written == 0);
+}
+
+static uint8_t *versioned_image(const char *version, size_t *size)
+{
+    uint8_t *image = sim_read_file(SIM_BUILDS_DIR "/update.bin", size);
+    SIM_CHECK(image != NULL);
+    SIM_CHECK(sim_image_set_version(image, *size, version));
+    return image;
+}
+
+int main(int argc, char **argv)
+{
+    const char *work_dir = sim_test_work_dir(argv[0]);
+    size_t old_size, new_size;
+    uint8_t *old_image = versioned_image("0.0.9", &old_size);
+    uint8_t *new_image = versioned_image("0.2.0", &new_size);
+
+    sim_config.time_scale = 0.2;
+    sim_board_init(work_dir);
+
+    printf("Index built from an image older than the running one\n");
+    SIM_CHECK(sim_card_put(CARD, "updates/v0.0.9.bin", old_image, old_size));
+    sim_card_insert(CARD);
+    SIM_CHECK(sim_boot(check_idle, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(sim_card_exists(CARD, "updates/index.dat"));
+
+    printf("Unchanged images keep the cached index\n");
+    SIM_CHECK(sim_card_set_mtime(CARD, "updates/index.dat", OLD_MTIME));
+    SIM_CHECK(sim_boot(check_idle, NULL) == SIM_EXIT_DONE);
+    SIM_CHECK(sim_card_mtime(CARD, "updates/index.dat") == OLD_MTIME);
+
+    printf("Image added without changing the directory mtime\n");
+    time_t dir_mtime = sim_card_mtime(CARD, "updates");
+    SIM_CHECK(sim_card_put(CARD, "updates/v0.2.0.bin", new_image, new_size));
+    SIM_CHECK(sim_card_set_mtime(CARD, "updates", dir_mtime));
+    sim_expect_install(new_image, new_size);
+    SIM_CHECK(sim_card_mtime(CARD, "updates/index.dat") != OLD_MTIME);
+
+    free(old_image);
+    free(new_image);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Builds an update.bundle holding an app image and data partition images.
+
+The app image is written to the next OTA slot, each data image to the
+partition with the given label, at an optional sector aligned offset:
+
+    python3 tools/mkbundle.py update.bundle builds/update.bin \\
+        storage=spiffs.bin nvs_def=nvs_defaults.bin@0x1000
+
+Format (little endian):
+
+    header  "ESPBUNDL", u32 version, u32 entry count
+    entry   16 byte label, u32 offset, u32 size, 32 byte SHA-256
+            (one per entry, the app image first with label "app")
+    data    the entry images back to back, in index order
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"ESPBUNDL"
+VERSION = 1
+HEADER = struct.Struct("<8sII")
+ENTRY = struct.Struct("<16sII32s")
+APP_LABEL = "app"
+MAX_ENTRIES = 8
+SECTOR_SIZE = 4096
+# Partitions the device refuses to overwrite from a bundle
+RESERVED_LABELS = ("nvs", "otadata")
+
+
+def parse_entry(spec):
+    """Splits label=file[@offset] into (label, file, offset)."""
+    label, sep, rest = spec.partition("=")
+    if not sep or not label or not rest:
+        raise ValueError("expected label=file[@offset]: %s" % spec)
+    path, _, offset = rest.partition("@")
+    offset = int(offset, 0) if offset else 0
+    if len(label.encode()) > 15:
+        raise ValueError("label too long: %s" % label)
+    if label == APP_LABEL or label in RESERVED_LABELS:
+        raise ValueError("label not allowed for a data image: %s" % label)
+    if offset % SECTOR_SIZE:
+        raise ValueError("offset of %s is not sector aligned" % label)
+    return label, path, offset
+
+
+def build(entries):
+    """Returns the bundle for a list of (label, offset, data)."""
+    out = bytearray(HEADER.pack(MAGIC, VERSION, len(entries)))
+    for label, offset, data in entries:
+        out += ENTRY.pack(label.encode(), offset, len(data),
+                          hashlib.sha256(data).digest())
+    for _, _, data in entries:
+        out += data
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("bundle", help="bundle file to write")
+    parser.add_argument("app", help="app image for the OTA slot")
+    parser.add_argument("data", nargs="*", help="data image as label=file[@offset]")
+    args = parser.parse_args()
+
+    if len(args.data) + 1 > MAX_ENTRIES:
+        sys.exit("at most %d entries fit a bundle" % MAX_ENTRIES)
+    try:
+        specs = [parse_entry(spec) for spec in args.data]
+    except ValueError as e:
+        sys.exit(str(e))
+
+    with open(args.app, "rb") as f:
+        entries = [(APP_LABEL, 0, f.read())]
+    for label, path, offset in specs:
+        with open(path, "rb") as f:
+            entries.append((label, offset, f.read()))
+
+    bundle = build(entries)
+    with open(args.bundle, "wb") as f:
+        f.write(bundle)
+    for label, offset, data in entries:
+        print("%-15s %8d bytes at 0x%x" % (label, len(data), offset))
+    print("%s: %d bytes" % (args.bundle, len(bundle)))
+
+
+if __name__ == "__main__":
+    main()
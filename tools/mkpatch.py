@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""Builds an update.patch that turns one firmware image into another.
+
+The patch is applied by otaTask against the running partition, so the
+source must be the image currently flashed on the device:
+
+    python3 tools/mkpatch.py builds/current.bin builds/update.bin update.patch
+
+Format (little endian):
+
+    header  "ESPPATCH", u32 version, u32 source size, u32 target size,
+            32 byte SHA-256 of the source image
+    'C'     u32 source offset, u32 length  -> copy bytes from the source
+    'I'     u32 length, <length bytes>     -> insert literal bytes
+    'E'                                    -> end of patch
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"ESPPATCH"
+VERSION = 1
+HEADER = struct.Struct("<8sIII32s")
+
+# Shortest copy worth emitting: an 'I' op costs 5 bytes, a 'C' op 9 bytes
+MIN_MATCH = 16
+# Source positions are indexed every STEP bytes, so any match of at least
+# KEY + STEP - 1 bytes is found
+KEY = 16
+STEP = 4
+
+
+def index_source(source):
+    index = {}
+    for pos in range(0, len(source) - KEY + 1, STEP):
+        index.setdefault(source[pos:pos + KEY], pos)
+    return index
+
+
+def match_length(source, src, target, tgt):
+    length = 0
+    limit = min(len(source) - src, len(target) - tgt)
+    while length < limit and source[src + length] == target[tgt + length]:
+        length += 1
+    return length
+
+
+def diff(source, target):
+    """Returns a list of ('C', offset, length) and ('I', bytes) ops."""
+    index = index_source(source)
+    ops = []
+    literal_start = 0
+    tgt = 0
+    # Where the source would continue if the last copy went on; images
+    # that differ in place keep matching at this offset
+    expected = 0
+
+    while tgt < len(target):
+        best_src, best_len = -1, 0
+        if expected < len(source):
+            best_len = match_length(source, expected, target, tgt)
+            best_src = expected
+        if best_len < MIN_MATCH:
+            pos = index.get(target[tgt:tgt + KEY])
+            if pos is not None:
+                length = match_length(source, pos, target, tgt)
+                if length > best_len:
+                    best_src, best_len = pos, length
+        if best_len < MIN_MATCH:
+            tgt += 1
+            expected += 1
+            continue
+
+        # Grow the match backwards into the pending literal bytes
+        while (tgt > literal_start and best_src > 0
+               and source[best_src - 1] == target[tgt - 1]):
+            tgt -= 1
+            best_src -= 1
+            best_len += 1
+
+        if tgt > literal_start:
+            ops.append(("I", target[literal_start:tgt]))
+        ops.append(("C", best_src, best_len))
+        tgt += best_len
+        literal_start = tgt
+        expected = best_src + best_len
+
+    if literal_start < len(target):
+        ops.append(("I", target[literal_start:]))
+    return ops
+
+
+def encode(source, target, ops):
+    out = bytearray(HEADER.pack(MAGIC, VERSION, len(source), len(target),
+                                hashlib.sha256(source).digest()))
+    for op in ops:
+        if op[0] == "C":
+            out += b"C" + struct.pack("<II", op[1], op[2])
+        else:
+            out += b"I" + struct.pack("<I", len(op[1])) + op[1]
+    out += b"E"
+    return bytes(out)
+
+
+def apply(source, patch):
+    """Reference decoder, mirrors the one in otaTask."""
+    magic, version, source_size, target_size, digest = HEADER.unpack_from(patch)
+    if magic != MAGIC or version != VERSION:
+        raise ValueError("not a patch file")
+    if source_size != len(source) or hashlib.sha256(source).digest() != digest:
+        raise ValueError("patch does not apply to this source")
+    pos = HEADER.size
+    out = bytearray()
+    while True:
+        op = patch[pos:pos + 1]
+        pos += 1
+        if op == b"C":
+            offset, length = struct.unpack_from("<II", patch, pos)
+            pos += 8
+            out += source[offset:offset + length]
+        elif op == b"I":
+            (length,) = struct.unpack_from("<I", patch, pos)
+            pos += 4
+            out += patch[pos:pos + length]
+            pos += length
+        elif op == b"E":
+            break
+        else:
+            raise ValueError("bad op at offset %d" % (pos - 1))
+    if len(out) != target_size:
+        raise ValueError("target size mismatch")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="image running on the device")
+    parser.add_argument("target", help="image to install")
+    parser.add_argument("patch", help="patch file to write")
+    args = parser.parse_args()
+
+    with open(args.source, "rb") as f:
+        source = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+
+    patch = encode(source, target, diff(source, target))
+    if apply(source, patch) != target:
+        sys.exit("internal error: patch does not rebuild the target")
+
+    with open(args.patch, "wb") as f:
+        f.write(patch)
+    print("%s: %d bytes (%.1f%% of %d byte target)"
+          % (args.patch, len(patch), 100.0 * len(patch) / len(target), len(target)))
+
+
+if __name__ == "__main__":
+    main()
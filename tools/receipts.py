@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Exports the install receipts on an update card as CSV.
+
+Devices append one record per update attempt to receipts.bin and move
+it to receipts.old when it fills up. Pass the card folder, or the log
+files themselves, oldest first:
+
+    python3 tools/receipts.py /media/sdcard > receipts.csv
+
+Record (little endian, 96 bytes):
+
+    u32 magic "RCPT", 6 byte MAC, u8 status, u8 attempts since boot,
+    16 byte old version, 16 byte new version, u32 ms per trace phase,
+    u32 bytes written, u16 read KB/s, u16 write KB/s, u32 CRC-32
+"""
+
+import argparse
+import csv
+import os
+import struct
+import sys
+import zlib
+
+MAGIC = 0x54504352
+PHASES = ("mount", "scan", "open", "header", "erase", "transfer",
+          "validate", "set_boot", "diagnostic", "cleanup")
+RECORD = struct.Struct("<I6sBB16s16s%dIIHHI" % len(PHASES))
+STATUS = ("installed", "rolled_back", "failed", "removed", "refused", "rejected")
+LOG_FILES = ("receipts.old", "receipts.bin")
+
+
+def decode(data):
+    """Yields a dict per valid record, skipping damaged ones."""
+    for pos in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        chunk = data[pos:pos + RECORD.size]
+        fields = RECORD.unpack(chunk)
+        if fields[0] != MAGIC or zlib.crc32(chunk[:-4]) != fields[-1]:
+            print("skipping damaged record at offset %d" % pos, file=sys.stderr)
+            continue
+        _, mac, status, attempts, old, new = fields[:6]
+        phase_ms = fields[6:6 + len(PHASES)]
+        written, read_kbps, write_kbps = fields[6 + len(PHASES):-1]
+        row = {
+            "mac": ":".join("%02x" % b for b in mac),
+            "status": STATUS[status] if status < len(STATUS) else str(status),
+            "attempts": attempts,
+            "old_version": old.rstrip(b"\0").decode(errors="replace"),
+            "new_version": new.rstrip(b"\0").decode(errors="replace"),
+        }
+        row.update(("%s_ms" % name, ms) for name, ms in zip(PHASES, phase_ms))
+        row.update(bytes_written=written, read_kbps=read_kbps, write_kbps=write_kbps)
+        yield row
+
+
+def log_paths(paths):
+    for path in paths:
+        if os.path.isdir(path):
+            for name in LOG_FILES:
+                if os.path.exists(os.path.join(path, name)):
+                    yield os.path.join(path, name)
+        else:
+            yield path
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("paths", nargs="+", help="card folders or receipt logs, oldest first")
+    args = parser.parse_args()
+
+    columns = (["mac", "status", "attempts", "old_version", "new_version"]
+               + ["%s_ms" % name for name in PHASES]
+               + ["bytes_written", "read_kbps", "write_kbps"])
+    writer = csv.DictWriter(sys.stdout, fieldnames=columns)
+    writer.writeheader()
+    for path in log_paths(args.paths):
+        with open(path, "rb") as f:
+            writer.writerows(decode(f.read()))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,31 +1,164 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/unistd.h>
+#include <dirent.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include "nvs.h"
 #include "esp_ota_ops.h"
 #include "esp_vfs_fat.h"
 #include "esp_flash_partitions.h"
 #include "esp_partition.h"
+#include "esp_image_format.h"
+#include "mbedtls/sha256.h"
+#include "esp32/rom/miniz.h"
+#include "esp32/rom/crc.h"
 #include "driver/sdspi_host.h"
 #include "driver/spi_common.h"
 #include "sdmmc_cmd.h"
 #include "driver/gpio.h"
 #include "sdkconfig.h"
 #include "driver/sdmmc_host.h"
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+#include "ff.h"
+#include "diskio_sdmmc.h"
+#endif
+#ifdef CONFIG_OTA_POWER_SAVE
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#endif
 
 // Task handles
 TaskHandle_t sdTaskHandle = NULL;
-TaskHandle_t otaTaskHandle = NULL;
 
 static const char *TAG = "example";
 
-// Buffer for reading SD card files
-#define BUFFSIZE 1024
-static char ota_write_data[BUFFSIZE + 1] = { 0 };
+// With CONFIG_OTA_STATIC_MEMORY tasks run from stacks and control blocks
+// reserved at build time, so card insertions and updates allocate no
+// task memory. Stack sizes are in bytes, trace_report logs how much of
+// each one was never used. No size is cut before that report was read on
+// a device: the host build (SIM_STACK_LOG, see host/) measures x86-64
+// frames, smaller than those of the windowed ABI, so it only shows where
+// a stack needs more room, as readerTask does inflating gzip images
+#define SD_TASK_STACK      8192
+#define OTA_TASK_STACK     8192
+#define READER_TASK_STACK  5632
+#define HEALTH_TASK_STACK  4096
+#define ERASER_TASK_STACK  3072
+#define LOG_TASK_STACK     3072
+#define HOUSE_TASK_STACK   5120
+
+typedef struct {
+    const char *name;
+    TaskHandle_t handle;
+    uint32_t stack_size;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    StackType_t *stack;
+    StaticTask_t tcb;
+#endif
+} task_slot_t;
+
+#ifdef CONFIG_OTA_STATIC_MEMORY
+#define TASK_SLOT(slot, task_name, size) \
+    static StackType_t slot##_stack[size]; \
+    static task_slot_t slot = { .name = task_name, .stack_size = size, .stack = slot##_stack }
+#else
+#define TASK_SLOT(slot, task_name, size) \
+    static task_slot_t slot = { .name = task_name, .stack_size = size }
+#endif
+
+TASK_SLOT(sd_task, "sdHandleTask", SD_TASK_STACK);
+TASK_SLOT(ota_task, "otaTask", OTA_TASK_STACK);
+TASK_SLOT(reader_task, "readerTask", READER_TASK_STACK);
+TASK_SLOT(health_task, "healthTask", HEALTH_TASK_STACK);
+#ifdef CONFIG_OTA_BACKGROUND_ERASE
+TASK_SLOT(eraser_task, "eraserTask", ERASER_TASK_STACK);
+#endif
+#ifdef CONFIG_OTA_DEFERRED_LOG
+TASK_SLOT(log_task, "logTask", LOG_TASK_STACK);
+#endif
+TASK_SLOT(house_task, "houseTask", HOUSE_TASK_STACK);
+
+// Starts a task in slot. Tasks leave through end_task, and a static slot
+// is only reused once the task it ran last got there
+static bool start_task(task_slot_t *slot, TaskFunction_t function, UBaseType_t priority, BaseType_t core){
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    if (slot->handle != NULL) {
+        while (eTaskGetState(slot->handle) != eSuspended) {
+            vTaskDelay(1);
+        }
+        // The task is not running, so it is deleted right away instead of
+        // waiting in the idle task for cleanup that would free nothing
+        vTaskDelete(slot->handle);
+    }
+    slot->handle = xTaskCreateStaticPinnedToCore(function, slot->name, slot->stack_size, NULL,
+                                                 priority, slot->stack, &slot->tcb, core);
+    return slot->handle != NULL;
+#else
+    return xTaskCreatePinnedToCore(function, slot->name, slot->stack_size, NULL,
+                                   priority, &slot->handle, core) == pdPASS;
+#endif
+}
+
+// Ends the calling task. A static task only suspends, start_task deletes
+// it before running the slot again
+static void end_task(void){
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    vTaskSuspend(NULL);
+#else
+    vTaskDelete(NULL);
+#endif
+}
+
+// Ring of buffers for reading SD card files. The reader task fills them
+// from the card while otaTask drains them into the OTA partition.
+// Buffers are DMA capable so the card driver can fill them directly
+#define BUFFSIZE CONFIG_OTA_CHUNK_SIZE
+#define BUFFCOUNT 4
+// Smallest chunk size accepted when the heap is tight (one flash sector)
+#define BUFFSIZE_MIN 4096
+static char *ota_write_data[BUFFCOUNT] = { NULL };
+static int ota_buffer_size = 0;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+DMA_ATTR static char ota_buffer_arena[BUFFCOUNT][BUFFSIZE];
+#endif
+
+// Chunk handed over from the reader task to otaTask. A length of zero or
+// less ends the stream with one of the OTA_CHUNK_* reasons
+typedef struct {
+    int index;
+    int length;
+} ota_chunk_t;
+
+#define OTA_CHUNK_EOF       0
+#define OTA_CHUNK_ERROR    -1
+#define OTA_CHUNK_REMOVED  -2
+#define OTA_CHUNK_ABORTED  -3
+
+// Queues of free buffer indexes and of filled chunks
+static QueueHandle_t ota_free_queue = NULL;
+static QueueHandle_t ota_filled_queue = NULL;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+static StaticQueue_t ota_free_queue_buffer;
+static StaticQueue_t ota_filled_queue_buffer;
+static uint8_t ota_free_queue_storage[BUFFCOUNT * sizeof(int)];
+static uint8_t ota_filled_queue_storage[BUFFCOUNT * sizeof(ota_chunk_t)];
+#endif
+// Flag to stop the reader task when otaTask gives up on the update
+volatile bool is_ota_aborted = false;
 
 // Controll flags
 volatile int is_sd_present = false;
@@ -35,6 +168,24 @@ int is_sd_card_mounted = false;
 bool is_spi_started = false;
 // Flag to prevent repeated application of update on Write Protected cards
 int is_ota_already_done = false;
+// Startup runs the card mount and the self-test of a freshly installed
+// image in parallel, these bits order the steps that need both
+static EventGroupHandle_t boot_events = NULL;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+static StaticEventGroup_t boot_events_buffer;
+#endif
+// The card present at boot was mounted, or found absent or unusable
+#define BOOT_CARD_SETTLED   BIT0
+// The running image is confirmed, so new updates may be installed
+#define BOOT_IMAGE_CHECKED  BIT1
+// Set while the card present at boot was not removed. Only that card
+// holds the update a freshly installed image came from
+volatile bool is_boot_card_present = false;
+// Flag asking sdHandleTask to scan the mounted card again
+volatile bool is_rescan_requested = false;
+// Heartbeat of the application tasks, checked by diagnostic() when set
+volatile uint32_t health_heartbeat = 0;
+bool is_heartbeat_expected = false;
 
 // Firmware tested using SPI mode, but using 1-Line SDMMC for final version
 // To use SPI mode, uncomment line bellow
@@ -72,15 +223,416 @@ sdmmc_host_t host = SDSPI_HOST_DEFAULT();
 
 // Define for installing GPIO ISR service
 #define ESP_INTR_FLAG_DEFAULT 0
+// Time the CD pin must stay stable before a change is handled
+#define SD_DEBOUNCE_MS 50
 
 // Pin definitions
 #define BLINK_GPIO   2
 #define DIAGNOSTICS_BUTTON_GPIO  4
 
-// ISR for detecting SD card insertion/removal
+// The card driver ignores the WP pin, so every write to the card checks
+// it here first
+static bool is_card_writable(void){
+    return is_sd_present && is_sd_card_mounted && gpio_get_level(PIN_NUM_WP) == 0;
+}
+
+// Per-phase timing of the update flow. Marks go to a fixed ring buffer,
+// so tracing never allocates, and are summed up by trace_report
+typedef enum {
+    TRACE_MOUNT,
+    TRACE_SCAN,
+    TRACE_OPEN,
+    TRACE_HEADER,
+    TRACE_ERASE,
+    TRACE_TRANSFER,
+    TRACE_VALIDATE,
+    TRACE_SET_BOOT,
+    TRACE_DIAGNOSTIC,
+    TRACE_CLEANUP,
+    TRACE_PHASES,
+} trace_phase_t;
+
+#ifdef CONFIG_OTA_TRACE
+#define TRACE_RING_SIZE 64
+
+static const char *trace_phase_names[TRACE_PHASES] = {
+    "mount", "scan", "open", "header", "erase", "transfer",
+    "validate", "set_boot", "diagnostic", "cleanup",
+};
+
+typedef struct {
+    int64_t time_us;
+    uint8_t phase;
+    bool is_end;
+} trace_entry_t;
+
+static trace_entry_t trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_count = 0;
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+// Time from reset to app_main, covering the bootloader and reboot
+static int64_t trace_boot_us = 0;
+// Free heap when app_main started, the low watermark gives the peak use
+static uint32_t trace_boot_heap = 0;
+// Time spent in card reads and flash writes and the bytes they moved
+static int64_t trace_read_us = 0;
+static int64_t trace_write_us = 0;
+static uint32_t trace_read_bytes = 0;
+static uint32_t trace_write_bytes = 0;
+#endif //CONFIG_OTA_TRACE
+
+// esp_timer is used instead of the cycle counter: tasks are not pinned
+// and each core has its own CCOUNT, which also wraps every few seconds
+static inline int64_t trace_time(void){
+#ifdef CONFIG_OTA_TRACE
+    return esp_timer_get_time();
+#else
+    return 0;
+#endif
+}
+
+static void trace_mark(trace_phase_t phase, bool is_end){
+#ifdef CONFIG_OTA_TRACE
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&trace_lock);
+    trace_entry_t *entry = &trace_ring[trace_count++ % TRACE_RING_SIZE];
+    entry->time_us = now;
+    entry->phase = phase;
+    entry->is_end = is_end;
+    portEXIT_CRITICAL(&trace_lock);
+#endif
+}
+
+static inline void trace_begin(trace_phase_t phase){
+    trace_mark(phase, false);
+}
+
+static inline void trace_end(trace_phase_t phase){
+    trace_mark(phase, true);
+}
+
+// Accounts a card read started at start_us (reader task only)
+static inline void trace_read(int64_t start_us, int bytes){
+#ifdef CONFIG_OTA_TRACE
+    trace_read_us += esp_timer_get_time() - start_us;
+    trace_read_bytes += (bytes > 0) ? bytes : 0;
+#endif
+}
+
+// Accounts a flash write started at start_us (otaTask only)
+static inline void trace_write(int64_t start_us, int bytes){
+#ifdef CONFIG_OTA_TRACE
+    trace_write_us += esp_timer_get_time() - start_us;
+    trace_write_bytes += bytes;
+#endif
+}
+
+static inline void trace_boot(void){
+#ifdef CONFIG_OTA_TRACE
+    trace_boot_us = esp_timer_get_time();
+    trace_boot_heap = esp_get_free_heap_size();
+#endif
+}
+
+// Logs the time from reset to the end of app_main
+static void trace_ready(void){
+#ifdef CONFIG_OTA_TRACE
+    ESP_LOGI(TAG, "Ready %" PRId64 " ms after reset", esp_timer_get_time() / 1000);
+#endif
+}
+
+#ifdef CONFIG_OTA_TRACE
+static int trace_kbps(uint32_t bytes, int64_t us){
+    return (us > 0) ? (int)(bytes * 1000000LL / 1024 / us) : 0;
+}
+#endif
+
+// Logs the time spent in each phase and the read/write throughput, and
+// appends them to trace.csv on the card with CONFIG_OTA_TRACE_CSV
+#ifdef CONFIG_OTA_TRACE
+// Sums up the time and count of each phase over the marks in the ring
+static void trace_totals(int64_t total_us[TRACE_PHASES], int count[TRACE_PHASES]){
+    int64_t started[TRACE_PHASES] = { 0 };
+    uint32_t first = (trace_count > TRACE_RING_SIZE) ? trace_count - TRACE_RING_SIZE : 0;
+
+    for (int i = 0; i < TRACE_PHASES; i++) {
+        total_us[i] = 0;
+        count[i] = 0;
+    }
+    for (uint32_t i = first; i < trace_count; i++) {
+        const trace_entry_t *entry = &trace_ring[i % TRACE_RING_SIZE];
+        if (!entry->is_end) {
+            started[entry->phase] = entry->time_us;
+        } else if (started[entry->phase] != 0) {
+            total_us[entry->phase] += entry->time_us - started[entry->phase];
+            count[entry->phase]++;
+            started[entry->phase] = 0;
+        }
+    }
+}
+#endif
+
+// Phase times in ms, bytes written and transfer speeds for an install
+// receipt. All zero without CONFIG_OTA_TRACE
+static void trace_summary(uint32_t phase_ms[TRACE_PHASES], uint32_t *bytes,
+                          uint16_t *read_kbps, uint16_t *write_kbps){
+#ifdef CONFIG_OTA_TRACE
+    int64_t total_us[TRACE_PHASES];
+    int count[TRACE_PHASES];
+    trace_totals(total_us, count);
+    for (int i = 0; i < TRACE_PHASES; i++) {
+        phase_ms[i] = total_us[i] / 1000;
+    }
+    *bytes = trace_write_bytes;
+    *read_kbps = trace_kbps(trace_read_bytes, trace_read_us);
+    *write_kbps = trace_kbps(trace_write_bytes, trace_write_us);
+#else
+    memset(phase_ms, 0, TRACE_PHASES * sizeof(phase_ms[0]));
+    *bytes = 0;
+    *read_kbps = 0;
+    *write_kbps = 0;
+#endif
+}
+
+static void trace_report(void){
+#ifdef CONFIG_OTA_TRACE
+    int64_t total_us[TRACE_PHASES];
+    int count[TRACE_PHASES];
+    trace_totals(total_us, count);
+
+    ESP_LOGI(TAG, "Trace: boot %" PRId64 " ms", trace_boot_us / 1000);
+    for (int i = 0; i < TRACE_PHASES; i++) {
+        if (count[i] > 0) {
+            ESP_LOGI(TAG, "Trace: %-10s %6" PRId64 " ms (%d)", trace_phase_names[i], total_us[i] / 1000, count[i]);
+        }
+    }
+    ESP_LOGI(TAG, "Trace: read  %u bytes in %" PRId64 " ms, %d KB/s",
+             trace_read_bytes, trace_read_us / 1000, trace_kbps(trace_read_bytes, trace_read_us));
+    ESP_LOGI(TAG, "Trace: write %u bytes in %" PRId64 " ms, %d KB/s",
+             trace_write_bytes, trace_write_us / 1000, trace_kbps(trace_write_bytes, trace_write_us));
+    uint32_t heap_peak = trace_boot_heap - esp_get_minimum_free_heap_size();
+    ESP_LOGI(TAG, "Trace: heap  %u bytes peak since app_main, %u bytes DMA capable left at worst",
+             heap_peak, (uint32_t)heap_caps_get_minimum_free_size(MALLOC_CAP_DMA));
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    const task_slot_t *slots[] = {
+        &sd_task, &ota_task, &reader_task, &health_task,
+#ifdef CONFIG_OTA_BACKGROUND_ERASE
+        &eraser_task,
+#endif
+#ifdef CONFIG_OTA_DEFERRED_LOG
+        &log_task,
+#endif
+        &house_task,
+    };
+    for (int i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+        if (slots[i]->handle != NULL) {
+            ESP_LOGI(TAG, "Trace: stack %-12s %5u of %u bytes never used", slots[i]->name,
+                     uxTaskGetStackHighWaterMark(slots[i]->handle), slots[i]->stack_size);
+        }
+    }
+#endif
+
+#ifdef CONFIG_OTA_TRACE_CSV
+    if (!is_card_writable()) {
+        return;
+    }
+    FILE* csv = fopen(MOUNT_POINT"/trace.csv", "a");
+    if (csv == NULL) {
+        return;
+    }
+    const char *version = esp_ota_get_app_description()->version;
+    fprintf(csv, "%s,boot,1,%" PRId64 ",,\n", version, trace_boot_us);
+    for (int i = 0; i < TRACE_PHASES; i++) {
+        if (count[i] > 0) {
+            fprintf(csv, "%s,%s,%d,%" PRId64 ",,\n", version, trace_phase_names[i], count[i], total_us[i]);
+        }
+    }
+    fprintf(csv, "%s,read,1,%" PRId64 ",%u,%d\n", version, trace_read_us, trace_read_bytes,
+            trace_kbps(trace_read_bytes, trace_read_us));
+    fprintf(csv, "%s,write,1,%" PRId64 ",%u,%d\n", version, trace_write_us, trace_write_bytes,
+            trace_kbps(trace_write_bytes, trace_write_us));
+    fprintf(csv, "%s,heap,1,,%u,\n", version, heap_peak);
+    fclose(csv);
+#endif
+#endif //CONFIG_OTA_TRACE
+}
+
+#ifdef CONFIG_OTA_DEFERRED_LOG
+// Deferred logging: ESP_LOG calls format into a ring buffer and return,
+// logTask writes the ring to the console at low priority so UART speed
+// never holds back the tasks doing the update
+#define LOG_LINE_SIZE 160
+
+static RingbufHandle_t log_ring = NULL;
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t log_queued = 0;
+static uint32_t log_written = 0;
+static uint32_t log_dropped = 0;
+
+static int deferred_vprintf(const char *format, va_list args){
+    char line[LOG_LINE_SIZE];
+    int len = vsnprintf(line, sizeof(line), format, args);
+    if (len <= 0) {
+        return len;
+    }
+    if (len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    // Never wait for room, a full ring drops the line instead
+    bool is_sent = xRingbufferSend(log_ring, line, len, 0) == pdTRUE;
+    portENTER_CRITICAL(&log_lock);
+    if (is_sent) {
+        log_queued += len;
+    } else {
+        log_dropped++;
+    }
+    portEXIT_CRITICAL(&log_lock);
+    return len;
+}
+
+static void logTask(void * parameter){
+    while (1) {
+        size_t len;
+        char *data = xRingbufferReceive(log_ring, &len, portMAX_DELAY);
+        if (data == NULL) {
+            continue;
+        }
+        fwrite(data, 1, len, stdout);
+        vRingbufferReturnItem(log_ring, data);
+
+        portENTER_CRITICAL(&log_lock);
+        log_written += len;
+        uint32_t dropped = log_dropped;
+        log_dropped = 0;
+        portEXIT_CRITICAL(&log_lock);
+        if (dropped > 0) {
+            printf("(%u log lines dropped)\n", dropped);
+        }
+        fflush(stdout);
+    }
+}
+#endif //CONFIG_OTA_DEFERRED_LOG
+
+// Routes log output through the deferred ring with CONFIG_OTA_DEFERRED_LOG
+static void start_deferred_log(void){
+#ifdef CONFIG_OTA_DEFERRED_LOG
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static uint8_t log_ring_storage[CONFIG_OTA_DEFERRED_LOG_SIZE];
+    static StaticRingbuffer_t log_ring_buffer;
+    log_ring = xRingbufferCreateStatic(sizeof(log_ring_storage), RINGBUF_TYPE_BYTEBUF,
+                                       log_ring_storage, &log_ring_buffer);
+#else
+    log_ring = xRingbufferCreate(CONFIG_OTA_DEFERRED_LOG_SIZE, RINGBUF_TYPE_BYTEBUF);
+#endif
+    if (log_ring == NULL) {
+        ESP_LOGW(TAG, "No memory for the log buffer, logging directly");
+        return;
+    }
+    start_task(&log_task, logTask, tskIDLE_PRIORITY + 1, tskNO_AFFINITY);
+    esp_log_set_vprintf(deferred_vprintf);
+#endif
+}
+
+// Waits until pending log lines are on the console, before a restart
+// would throw them away
+static void flush_deferred_log(void){
+#ifdef CONFIG_OTA_DEFERRED_LOG
+    if (log_ring == NULL) {
+        return;
+    }
+    for (int i = 0; i < 500 / portTICK_PERIOD_MS; i++) {
+        portENTER_CRITICAL(&log_lock);
+        bool is_flushed = log_written == log_queued;
+        portEXIT_CRITICAL(&log_lock);
+        if (is_flushed) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+#endif
+}
+
+// Power management. With CONFIG_OTA_POWER_SAVE the CPU runs at the
+// crystal frequency and the chip light sleeps whenever every task is
+// blocked, which is nearly all the time while waiting for a card.
+// Talking to the card keeps the chip awake, since the bus clock stops in
+// light sleep, and transfers also run the CPU at full speed
+#ifdef CONFIG_OTA_POWER_SAVE
+#define POWER_MAX_FREQ_MHZ 240
+#define POWER_MIN_FREQ_MHZ CONFIG_ESP32_XTAL_FREQ
+static esp_pm_lock_handle_t card_pm_lock = NULL;
+static esp_pm_lock_handle_t transfer_pm_lock = NULL;
+#endif
+
+static void start_power_save(void){
+#ifdef CONFIG_OTA_POWER_SAVE
+    esp_pm_config_esp32_t pm_config = {
+        .max_freq_mhz = POWER_MAX_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "sd_card", &card_pm_lock);
+    esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "ota_transfer", &transfer_pm_lock);
+    // The card detect pin wakes the chip, see arm_card_detect
+    esp_sleep_enable_gpio_wakeup();
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Power management not enabled (%s)", esp_err_to_name(err));
+    }
+#endif
+}
+
+// Locks are counted, so tasks using the card at the same time nest
+static void set_card_busy(bool is_busy){
+#ifdef CONFIG_OTA_POWER_SAVE
+    if (is_busy) {
+        esp_pm_lock_acquire(card_pm_lock);
+    } else {
+        esp_pm_lock_release(card_pm_lock);
+    }
+#endif
+}
+
+static void set_transfer_active(bool is_active){
+#ifdef CONFIG_OTA_POWER_SAVE
+    if (is_active) {
+        esp_pm_lock_acquire(transfer_pm_lock);
+    } else {
+        esp_pm_lock_release(transfer_pm_lock);
+    }
+#endif
+}
+
+// Edge interrupts do not wake the chip from light sleep, level ones do.
+// The CD interrupt is armed for the level the pin changes to next, so
+// every change both wakes the chip and raises the interrupt once
+static void arm_card_detect(int level){
+#ifdef CONFIG_OTA_POWER_SAVE
+    gpio_wakeup_enable(PIN_NUM_CD, level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+#endif
+}
+
+// Logs the time spent in each power mode since boot. Needs
+// CONFIG_PM_PROFILING, light sleep shows as the idle share
+static void power_report(void){
+#if defined(CONFIG_OTA_POWER_SAVE) && defined(CONFIG_PM_PROFILING)
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+// ISR for detecting SD card insertion/removal. The flag lets otaTask
+// stop at once, sdHandleTask is woken to debounce and handle the change
 static void IRAM_ATTR gpio_isr_handler(void* arg){
     uint32_t gpio_num = (uint32_t) arg;
-    is_sd_present = !gpio_get_level(gpio_num);
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    int level = gpio_get_level(gpio_num);
+    is_sd_present = !level;
+    arm_card_detect(level);
+    if (sdTaskHandle != NULL) {
+        vTaskNotifyGiveFromISR(sdTaskHandle, &higher_priority_task_woken);
+    }
+    if (higher_priority_task_woken) {
+        portYIELD_FROM_ISR();
+    }
 }
 
 #ifdef USE_SPI_MODE
@@ -107,7 +659,9 @@ void start_spi_bus(){
 }
 #endif
 
-int start_sd_card(){
+// Mounts the card with the host clock capped at freq_khz and, in SDMMC
+// mode, the given bus width
+static int mount_sd_card(int freq_khz, int width){
     esp_err_t ret;
     // Options for mounting the filesystem.
     // If format_if_mount_failed is set to true, SD card will be partitioned and
@@ -118,11 +672,13 @@ int start_sd_card(){
 #else
         .format_if_mount_failed = false,
 #endif // EXAMPLE_FORMAT_IF_MOUNT_FAILED
-        .max_files = 5,
+        // The update file and at most one manifest, index or trace file
+        .max_files = 2,
         .allocation_unit_size = 16 * 1024
     };
 
-    ESP_LOGI(TAG, "Initializing SD card");
+    ESP_LOGI(TAG, "Initializing SD card (%d kHz, %d-bit)", freq_khz, width);
+    host.max_freq_khz = freq_khz;
 
 #ifndef USE_SPI_MODE
     ESP_LOGI(TAG, "Using SDMMC peripheral");
@@ -131,8 +687,8 @@ int start_sd_card(){
     // Signals treated separately in order to avoid GPIO initialization overwriting
     sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
 
-    // Using 1-line SD mode, setting width:
-    slot_config.width = 1;
+    // 1-line SD mode unless 4-line mode was enabled and is being tried
+    slot_config.width = width;
 
     // GPIOs 15, 2, 4, 12, 13 should have external 10k pull-ups.
     // Internal pull-ups are not sufficient. However, enabling internal pull-ups
@@ -142,8 +698,10 @@ int start_sd_card(){
     gpio_set_pull_mode(15, GPIO_PULLUP_ONLY);     // CMD, needed in 4- and 1-line modes
     gpio_set_pull_mode(2, GPIO_PULLUP_ONLY);      // D0, needed in 4- and 1-line modes
     // Pins not needed in 1-line mode
-    // gpio_set_pull_mode(4, GPIO_PULLUP_ONLY);   // D1, needed in 4-line mode only
-    // gpio_set_pull_mode(12, GPIO_PULLUP_ONLY);  // D2, needed in 4-line mode only
+    if (width == 4) {
+        gpio_set_pull_mode(4, GPIO_PULLUP_ONLY);  // D1, needed in 4-line mode only
+        gpio_set_pull_mode(12, GPIO_PULLUP_ONLY); // D2, needed in 4-line mode only
+    }
     gpio_set_pull_mode(13, GPIO_PULLUP_ONLY);     // D3, needed in 4- and 1-line modes
 
     ret = esp_vfs_fat_sdmmc_mount(mount_point, &host, &slot_config, &mount_config, &card);
@@ -175,9 +733,211 @@ int start_sd_card(){
     return 1;
 }
 
+
+// Bus settings found to work for a card, kept in NVS per card CID and
+// for the card mounted last
+#define SD_TUNING_NAMESPACE "sdtune"
+#define SD_TUNING_LAST      "last"
+// Benchmark: reads of SD_BENCH_SECTORS sectors from the start of the card
+#define SD_BENCH_SECTORS    8
+#define SD_BENCH_READS      32
+
+typedef struct {
+    uint32_t cid_crc;
+    uint32_t freq_khz;
+    uint8_t width;
+} sd_tuning_t;
+
+#ifdef CONFIG_OTA_SD_AUTOTUNE
+// Host clock caps tried, fastest first. The driver only switches the card
+// to high speed if the card reports it can
+#ifndef USE_SPI_MODE
+static const int sd_tuning_freqs[] = { SDMMC_FREQ_HIGHSPEED, SDMMC_FREQ_DEFAULT, 10000, 5000 };
+#else
+static const int sd_tuning_freqs[] = { SDMMC_FREQ_DEFAULT, 10000, 4000 };
+#endif
+#define SD_TUNING_FREQS (sizeof(sd_tuning_freqs) / sizeof(sd_tuning_freqs[0]))
+
+static bool load_sd_tuning(const char *key, sd_tuning_t *tuning){
+    nvs_handle_t handle;
+    size_t size = sizeof(*tuning);
+    if (nvs_open(SD_TUNING_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+    esp_err_t err = nvs_get_blob(handle, key, tuning, &size);
+    nvs_close(handle);
+    return err == ESP_OK && size == sizeof(*tuning);
+}
+
+static void save_sd_tuning(const char *key, const sd_tuning_t *tuning){
+    nvs_handle_t handle;
+    if (nvs_open(SD_TUNING_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_set_blob(handle, key, tuning, sizeof(*tuning));
+    nvs_set_blob(handle, SD_TUNING_LAST, tuning, sizeof(*tuning));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static uint32_t sd_card_cid_crc(void){
+    return crc32_le(0, (const uint8_t *)&card->cid, sizeof(card->cid));
+}
+
+// Reads the first sectors of the card a few times. Returns the read speed
+// in KB/s, or 0 if any read failed, such as on CRC errors
+static int benchmark_sd_card(void){
+    size_t size = SD_BENCH_SECTORS * 512;
+    esp_err_t err = ESP_OK;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    // Cards are never mounted during an update, so a read buffer is free
+    char *buf = ota_buffer_arena[0];
+#else
+    void *buf = heap_caps_malloc(size, MALLOC_CAP_DMA);
+    if (buf == NULL) {
+        return 0;
+    }
+#endif
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < SD_BENCH_READS && err == ESP_OK; i++) {
+        err = sdmmc_read_sectors(card, buf, i * SD_BENCH_SECTORS, SD_BENCH_SECTORS);
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+#ifndef CONFIG_OTA_STATIC_MEMORY
+    heap_caps_free(buf);
+#endif
+    if (err != ESP_OK || elapsed_us <= 0) {
+        return 0;
+    }
+    return (int)((int64_t)size * SD_BENCH_READS * 1000000 / 1024 / elapsed_us);
+}
+
+// Mounts the card at each bus setting from the fastest down and keeps the
+// first one the benchmark reads without errors
+static bool tune_sd_card(sd_tuning_t *tuning){
+#if defined(CONFIG_OTA_SD_4BIT) && !defined(USE_SPI_MODE)
+    static const int widths[] = { 4, 1 };
+#else
+    static const int widths[] = { 1 };
+#endif
+    for (int w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        for (int f = 0; f < SD_TUNING_FREQS; f++) {
+            if (!mount_sd_card(sd_tuning_freqs[f], widths[w])) {
+                continue;
+            }
+            int speed = benchmark_sd_card();
+            if (speed > 0) {
+                ESP_LOGI(TAG, "Card tuned to %d-bit at %d kHz (card max %d kHz), %d KB/s",
+                         widths[w], sd_tuning_freqs[f], card->max_freq_khz, speed);
+                tuning->freq_khz = sd_tuning_freqs[f];
+                tuning->width = widths[w];
+                return true;
+            }
+            ESP_LOGW(TAG, "Read errors at %d kHz, %d-bit, stepping down", sd_tuning_freqs[f], widths[w]);
+            esp_vfs_fat_sdcard_unmount(mount_point, card);
+        }
+    }
+    return false;
+}
+#endif //CONFIG_OTA_SD_AUTOTUNE
+
+// Called on read errors from a card still in the slot, which the
+// benchmark of tune_sd_card can miss. The settings cached for the card
+// move on to the next ones tune_sd_card would try, so its next mount
+// is slower instead of failing again. Past the slowest, they are
+// dropped and the card is tuned again
+static void step_down_sd_tuning(void){
+#ifdef CONFIG_OTA_SD_AUTOTUNE
+    sd_tuning_t tuning;
+    nvs_handle_t handle;
+    char key[16];
+    int f = 0;
+
+    snprintf(key, sizeof(key), "c%08x", sd_card_cid_crc());
+    if (!load_sd_tuning(key, &tuning)) {
+        return;
+    }
+    while (f < SD_TUNING_FREQS && sd_tuning_freqs[f] != tuning.freq_khz) {
+        f++;
+    }
+    if (f + 1 < SD_TUNING_FREQS) {
+        tuning.freq_khz = sd_tuning_freqs[f + 1];
+    } else if (tuning.width > 1) {
+        tuning.freq_khz = sd_tuning_freqs[0];
+        tuning.width = 1;
+    } else {
+        ESP_LOGW(TAG, "Read errors at the slowest settings, tuning the card again");
+        if (nvs_open(SD_TUNING_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            nvs_erase_key(handle, key);
+            nvs_erase_key(handle, SD_TUNING_LAST);
+            nvs_commit(handle);
+            nvs_close(handle);
+        }
+        return;
+    }
+    ESP_LOGW(TAG, "Read errors, card stepped down to %d-bit at %u kHz", tuning.width, tuning.freq_khz);
+    save_sd_tuning(key, &tuning);
+#endif
+}
+
+// Mounts the card. With CONFIG_OTA_SD_AUTOTUNE the settings of the card
+// seen last are tried first, then the ones cached for the card's CID,
+// and only an unknown card goes through tune_sd_card
+int start_sd_card(){
+#ifndef CONFIG_OTA_SD_AUTOTUNE
+    return mount_sd_card(SDMMC_FREQ_DEFAULT, 1);
+#else
+    sd_tuning_t last;
+    sd_tuning_t cached;
+    char key[16];
+
+    bool is_mounted = load_sd_tuning(SD_TUNING_LAST, &last) && mount_sd_card(last.freq_khz, last.width);
+    if (!is_mounted) {
+        // Safe settings, only used to read the CID
+        last.cid_crc = 0;
+        last.freq_khz = SDMMC_FREQ_DEFAULT;
+        last.width = 1;
+        is_mounted = mount_sd_card(last.freq_khz, last.width);
+    }
+    if (!is_mounted) {
+        return 0;
+    }
+    uint32_t cid_crc = sd_card_cid_crc();
+    if (cid_crc == last.cid_crc) {
+        return 1;
+    }
+
+    snprintf(key, sizeof(key), "c%08x", cid_crc);
+    if (load_sd_tuning(key, &cached)) {
+        if (cached.freq_khz == last.freq_khz && cached.width == last.width) {
+            save_sd_tuning(key, &cached);
+            return 1;
+        }
+        esp_vfs_fat_sdcard_unmount(mount_point, card);
+        if (mount_sd_card(cached.freq_khz, cached.width)) {
+            save_sd_tuning(key, &cached);
+            return 1;
+        }
+        ESP_LOGW(TAG, "Cached settings failed, tuning the card again");
+    } else {
+        esp_vfs_fat_sdcard_unmount(mount_point, card);
+    }
+
+    cached.cid_crc = cid_crc;
+    if (tune_sd_card(&cached)) {
+        save_sd_tuning(key, &cached);
+        return 1;
+    }
+    return mount_sd_card(SDMMC_FREQ_DEFAULT, 1);
+#endif //CONFIG_OTA_SD_AUTOTUNE
+}
+
 // Example diagnostics to test new firmware
 // enables testing of rollback feature based on 
 // esp-idf\examples\system\ota\native_ota_example
+// Passes as soon as the heap watermark, the task heartbeat and the
+// diagnostics button all look healthy, fails if they do not within
+// CONFIG_OTA_HEALTH_TIMEOUT_MS. Holding the button simulates a failure
 static bool diagnostic(void){
     gpio_config_t io_conf;
     io_conf.intr_type    = GPIO_PIN_INTR_DISABLE;
@@ -187,174 +947,2425 @@ static bool diagnostic(void){
     io_conf.pull_up_en   = GPIO_PULLUP_ENABLE;
     gpio_config(&io_conf);
 
-    ESP_LOGI(TAG, "Diagnostics (5 sec)...");
-    vTaskDelay(5000 / portTICK_PERIOD_MS);
+    ESP_LOGI(TAG, "Diagnostics (up to %d ms)...", CONFIG_OTA_HEALTH_TIMEOUT_MS);
+    int64_t deadline = esp_timer_get_time() + CONFIG_OTA_HEALTH_TIMEOUT_MS * 1000LL;
+    uint32_t heartbeat = health_heartbeat;
+    bool is_heap_ok, is_alive, is_probe_ok;
 
-    bool diagnostic_is_ok = gpio_get_level(DIAGNOSTICS_BUTTON_GPIO);
+    while (1) {
+        is_heap_ok = esp_get_minimum_free_heap_size() >= CONFIG_OTA_HEALTH_MIN_FREE_HEAP;
+        is_alive = !is_heartbeat_expected || health_heartbeat != heartbeat;
+        is_probe_ok = gpio_get_level(DIAGNOSTICS_BUTTON_GPIO);
+        if ((is_heap_ok && is_alive && is_probe_ok) || esp_timer_get_time() >= deadline) {
+            break;
+        }
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
 
     gpio_reset_pin(DIAGNOSTICS_BUTTON_GPIO);
-    return diagnostic_is_ok;
+    if (!is_heap_ok) {
+        ESP_LOGE(TAG, "Diagnostics: free heap went down to %u bytes", esp_get_minimum_free_heap_size());
+    }
+    if (!is_alive) {
+        ESP_LOGE(TAG, "Diagnostics: application tasks stopped");
+    }
+    if (!is_probe_ok) {
+        ESP_LOGE(TAG, "Diagnostics: button pressed");
+    }
+    return is_heap_ok && is_alive && is_probe_ok;
 }
 
-// Toggle LED task for new firmware
-void toggleLED(void * parameter){
-    while (1) {
-        printf("Turning off the LED\n");
-        gpio_set_level(BLINK_GPIO, 0);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        // Blink on (output high)
-	    printf("Turning on the LED\n");
-        gpio_set_level(BLINK_GPIO, 1);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+// Files of the update installed last, relative to the card root, kept
+// in NVS from the install until the new image is confirmed. Only these
+// are removed or archived, other update files on the card were never
+// installed
+#define INSTALLED_NAMESPACE "installed"
+#define INSTALLED_KEY       "files"
+#define ARCHIVE_DIR         "installed"
+
+typedef struct {
+    char file[48];
+    // Empty if the update was not checked against a manifest
+    char manifest[48];
+} installed_update_t;
+
+// Removes a file of the installed update. With CONFIG_OTA_ARCHIVE_UPDATES
+// it is moved to ARCHIVE_DIR instead
+static void remove_update_file(const char *name){
+    char path[64];
+    struct stat st;
+
+    snprintf(path, sizeof(path), MOUNT_POINT"/%s", name);
+    if (name[0] == '\0' || stat(path, &st) != 0) {
+        return;
+    }
+#ifdef CONFIG_OTA_ARCHIVE_UPDATES
+    char archived[64];
+    snprintf(archived, sizeof(archived), MOUNT_POINT"/"ARCHIVE_DIR"/%s", name);
+    // FatFs does not rename over an existing file
+    unlink(archived);
+    if (rename(path, archived) == 0) {
+        return;
     }
+    ESP_LOGW(TAG, "Could not archive %s, removing it", name);
+#endif
+    unlink(path);
 }
 
-static void otaTask(void * parameter){
-    esp_err_t err;
-    esp_ota_handle_t update_handle = 0 ;
-    const esp_partition_t *update_partition = NULL;
+// Removes the update just applied so it is not installed again. Images
+// in the updates directory serve other devices and stay on the card
+static void remove_update_files(void){
+    installed_update_t installed;
+    nvs_handle_t handle;
+    size_t size = sizeof(installed);
 
-    ESP_LOGI(TAG, "Starting OTA example");
+    if (nvs_open(INSTALLED_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    esp_err_t err = nvs_get_blob(handle, INSTALLED_KEY, &installed, &size);
+    nvs_close(handle);
+    if (err != ESP_OK || size != sizeof(installed)) {
+        return;
+    }
+    installed.file[sizeof(installed.file) - 1] = '\0';
+    installed.manifest[sizeof(installed.manifest) - 1] = '\0';
+    if (strchr(installed.file, '/') != NULL) {
+        return;
+    }
 
-    const esp_partition_t *configured = esp_ota_get_boot_partition();
-    const esp_partition_t *running = esp_ota_get_running_partition();
+    trace_begin(TRACE_CLEANUP);
+#ifdef CONFIG_OTA_ARCHIVE_UPDATES
+    mkdir(MOUNT_POINT"/"ARCHIVE_DIR, 0777);
+#endif
+    remove_update_file(installed.file);
+    remove_update_file(installed.manifest);
+    ESP_LOGI(TAG, "Removed %s", installed.file);
+    trace_end(TRACE_CLEANUP);
+}
 
-    if (configured != running) {
-        ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08x, but running from offset 0x%08x",
-                 configured->address, running->address);
-        ESP_LOGW(TAG, "(This can happen if either the OTA boot data or preferred boot image become corrupted somehow.)");
+// Drops the record of the installed update once the new image handled
+// it, so no later boot removes a file of the same name from another card
+static void forget_installed_update(void){
+    nvs_handle_t handle;
+    if (nvs_open(INSTALLED_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
     }
-    ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)",
-             running->type, running->subtype, running->address);
+    nvs_erase_key(handle, INSTALLED_KEY);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
 
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x",
-             update_partition->subtype, update_partition->address);
-    assert(update_partition != NULL);
+// Install receipts: a fixed size record per update attempt, appended to
+// RECEIPT_LOG on the card and turned into CSV on a host by
+// tools/receipts.py. Each record is kept in NVS until it is on a
+// writable card, so an install is logged after the reboot into the new
+// image, or into the old one after a rollback, and a failed attempt once
+// a card is back. The log moves to RECEIPT_LOG_OLD when full, so the
+// card never holds more than twice CONFIG_OTA_RECEIPT_LOG_SIZE
+#define RECEIPT_LOG         MOUNT_POINT"/receipts.bin"
+#define RECEIPT_LOG_OLD     MOUNT_POINT"/receipts.old"
+#define RECEIPT_MAGIC       0x54504352 // "RCPT"
+#define RECEIPT_NAMESPACE   "receipt"
+#define RECEIPT_KEY         "pending"
+#define RECEIPT_VERSION_LEN 16
 
-    FILE* update = fopen(MOUNT_POINT"/update.bin", "rb");
-    assert(update != NULL);
-    ESP_LOGI(TAG, "Opened update file!");
+typedef enum {
+    RECEIPT_INSTALLED,
+    RECEIPT_ROLLED_BACK,
+    RECEIPT_FAILED,
+    RECEIPT_REMOVED,
+    RECEIPT_REFUSED,
+    RECEIPT_REJECTED,
+} receipt_status_t;
 
-    err = esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle);
+// Every field is at its natural alignment, so the record has no padding
+// and tools/receipts.py reads it as is (96 bytes)
+typedef struct {
+    uint32_t magic;
+    uint8_t mac[6];
+    uint8_t status;
+    // Install attempts since boot, this one included
+    uint8_t attempts;
+    char old_version[RECEIPT_VERSION_LEN];
+    char new_version[RECEIPT_VERSION_LEN];
+    uint32_t phase_ms[TRACE_PHASES];
+    uint32_t bytes_written;
+    uint16_t read_kbps;
+    uint16_t write_kbps;
+    // crc32_le of the bytes above
+    uint32_t crc;
+} install_record_t;
+
+typedef struct {
+    install_record_t record;
+    // Slot an installed image went to, tells an install from a rollback
+    uint32_t target_address;
+} pending_receipt_t;
+
+static pending_receipt_t pending_receipt;
+static bool has_pending_receipt = false;
+// Guards pending_receipt, its NVS copy and the log file
+static SemaphoreHandle_t receipt_lock = NULL;
+
+// Loads a receipt left by the previous boot, once from app_main
+static void start_receipts(void){
+    nvs_handle_t handle;
+    size_t size = sizeof(pending_receipt);
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static StaticSemaphore_t receipt_lock_buffer;
+    receipt_lock = xSemaphoreCreateMutexStatic(&receipt_lock_buffer);
+#else
+    receipt_lock = xSemaphoreCreateMutex();
+#endif
+    if (nvs_open(RECEIPT_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    has_pending_receipt = nvs_get_blob(handle, RECEIPT_KEY, &pending_receipt, &size) == ESP_OK
+                          && size == sizeof(pending_receipt)
+                          && pending_receipt.record.magic == RECEIPT_MAGIC;
+    nvs_close(handle);
+}
+
+static void set_pending_receipt(bool is_pending){
+    nvs_handle_t handle;
+    if (nvs_open(RECEIPT_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (is_pending) {
+        nvs_set_blob(handle, RECEIPT_KEY, &pending_receipt, sizeof(pending_receipt));
+    } else {
+        nvs_erase_key(handle, RECEIPT_KEY);
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    has_pending_receipt = is_pending;
+}
+
+// Appends the pending record to the log if a writable card is mounted.
+// Called with receipt_lock held
+static void append_pending_receipt(void){
+    install_record_t *record = &pending_receipt.record;
+    struct stat st;
+
+    if (!has_pending_receipt || !is_card_writable()) {
+        return;
+    }
+    if (record->status == RECEIPT_INSTALLED
+            && pending_receipt.target_address != esp_ota_get_running_partition()->address) {
+        record->status = RECEIPT_ROLLED_BACK;
+    }
+    record->crc = crc32_le(0, (const uint8_t *)record, offsetof(install_record_t, crc));
+
+    if (stat(RECEIPT_LOG, &st) == 0 && st.st_size + sizeof(*record) > CONFIG_OTA_RECEIPT_LOG_SIZE) {
+        unlink(RECEIPT_LOG_OLD);
+        rename(RECEIPT_LOG, RECEIPT_LOG_OLD);
+    }
+    FILE* log = fopen(RECEIPT_LOG, "ab");
+    if (log == NULL) {
+        ESP_LOGW(TAG, "Could not open %s", RECEIPT_LOG);
+        return;
+    }
+    bool is_written = fwrite(record, sizeof(*record), 1, log) == 1;
+    is_written = (fclose(log) == 0) && is_written;
+    if (is_written) {
+        set_pending_receipt(false);
+    }
+}
+
+// Records an update attempt. A receipt still pending goes to the card
+// first if it can, otherwise the newer attempt replaces it
+static void record_attempt(receipt_status_t status, const char *new_version,
+                           uint32_t target_address, uint8_t attempts){
+    install_record_t *record = &pending_receipt.record;
+
+    xSemaphoreTake(receipt_lock, portMAX_DELAY);
+    append_pending_receipt();
+    memset(&pending_receipt, 0, sizeof(pending_receipt));
+    record->magic = RECEIPT_MAGIC;
+    esp_efuse_mac_get_default(record->mac);
+    record->status = status;
+    record->attempts = attempts;
+    strncpy(record->old_version, esp_ota_get_app_description()->version, RECEIPT_VERSION_LEN);
+    strncpy(record->new_version, new_version, RECEIPT_VERSION_LEN);
+    trace_summary(record->phase_ms, &record->bytes_written, &record->read_kbps, &record->write_kbps);
+    pending_receipt.target_address = target_address;
+    set_pending_receipt(true);
+    // An install is only logged once the new image ran its self-test
+    if (status != RECEIPT_INSTALLED) {
+        append_pending_receipt();
+    }
+    xSemaphoreGive(receipt_lock);
+}
+
+static void write_receipt(void){
+    xSemaphoreTake(receipt_lock, portMAX_DELAY);
+    append_pending_receipt();
+    xSemaphoreGive(receipt_lock);
+}
+
+// Housekeeping after a new image is confirmed, run by houseTask at low
+// priority so it never holds up the application. Jobs queued together
+// run back to back, so the card sees one burst of FAT updates
+typedef enum {
+    // Remove or archive the installed update, or note a protected card
+    HOUSE_JOB_REMOVE_UPDATE,
+    // Append a pending install receipt to the card
+    HOUSE_JOB_WRITE_RECEIPT,
+    HOUSE_JOB_TRACE_REPORT,
+    // The card is settled, let sdHandleTask install new updates
+    HOUSE_JOB_RELEASE_CARD,
+    HOUSE_JOB_FLUSH_LOG,
+} house_job_t;
+
+#define HOUSE_QUEUE_LENGTH 8
+
+static QueueHandle_t house_queue = NULL;
+
+static void run_house_job(house_job_t job){
+    switch (job) {
+    case HOUSE_JOB_REMOVE_UPDATE:
+        if (!is_boot_card_present) {
+            // A card inserted since boot may hold an update not installed yet
+            ESP_LOGW(TAG, "Card changed since boot, keeping its update files");
+        } else if (gpio_get_level(PIN_NUM_WP) == 1) {
+            ESP_LOGE(TAG, "SD card is write protected! Cannot erase file ...");
+            // Set flag to prevent redetection of previously applied update
+            is_ota_already_done = true;
+        } else if (is_sd_card_mounted) {
+            remove_update_files();
+        }
+        forget_installed_update();
+        break;
+    case HOUSE_JOB_WRITE_RECEIPT:
+        write_receipt();
+        break;
+    case HOUSE_JOB_TRACE_REPORT:
+        trace_report();
+        break;
+    case HOUSE_JOB_RELEASE_CARD:
+        xEventGroupSetBits(boot_events, BOOT_IMAGE_CHECKED);
+        // Cards inserted meanwhile were not scanned, look at them now
+        is_rescan_requested = true;
+        xTaskNotifyGive(sdTaskHandle);
+        break;
+    case HOUSE_JOB_FLUSH_LOG:
+        flush_deferred_log();
+        break;
+    }
+}
+
+static void houseTask(void * parameter){
+    house_job_t job;
+
+    // Every job needs the card present at boot mounted or given up on
+    xEventGroupWaitBits(boot_events, BOOT_CARD_SETTLED, pdFALSE, pdTRUE, portMAX_DELAY);
+    while (1) {
+        xQueueReceive(house_queue, &job, portMAX_DELAY);
+        set_card_busy(true);
+        do {
+            run_house_job(job);
+        } while (xQueueReceive(house_queue, &job, 0) == pdTRUE);
+        set_card_busy(false);
+    }
+}
+
+static void start_housekeeping(void){
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static StaticQueue_t house_queue_buffer;
+    static uint8_t house_queue_storage[HOUSE_QUEUE_LENGTH * sizeof(house_job_t)];
+    house_queue = xQueueCreateStatic(HOUSE_QUEUE_LENGTH, sizeof(house_job_t),
+                                     house_queue_storage, &house_queue_buffer);
+#else
+    house_queue = xQueueCreate(HOUSE_QUEUE_LENGTH, sizeof(house_job_t));
+#endif
+    start_task(&house_task, houseTask, tskIDLE_PRIORITY + 1, APP_CPU_NUM);
+}
+
+static void post_house_job(house_job_t job){
+    xQueueSend(house_queue, &job, portMAX_DELAY);
+}
+
+// Confirms or rolls back a freshly installed image off the boot path,
+// on the other core than the card mount so both run at once
+static void healthTask(void * parameter){
+    ESP_LOGI(TAG, "WP: %u", gpio_get_level(PIN_NUM_WP));
+    // Test image to check if working properly
+    trace_begin(TRACE_DIAGNOSTIC);
+    bool diagnostic_is_ok = diagnostic();
+    trace_end(TRACE_DIAGNOSTIC);
+    if (!diagnostic_is_ok) {
+        // OTA Validity test failed, perform rollback to previous valid version
+        ESP_LOGE(TAG, "Diagnostics failed! Start rollback to the previous version ...");
+        flush_deferred_log();
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+
+    ESP_LOGI(TAG, "Diagnostics completed successfully! Continuing execution ...");
+    esp_ota_mark_app_valid_cancel_rollback();
+
+    post_house_job(HOUSE_JOB_REMOVE_UPDATE);
+    post_house_job(HOUSE_JOB_WRITE_RECEIPT);
+    post_house_job(HOUSE_JOB_TRACE_REPORT);
+    post_house_job(HOUSE_JOB_RELEASE_CARD);
+    post_house_job(HOUSE_JOB_FLUSH_LOG);
+    end_task();
+}
+
+// Toggle LED task for new firmware
+void toggleLED(void * parameter){
+    while (1) {
+        printf("Turning off the LED\n");
+        gpio_set_level(BLINK_GPIO, 0);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        // Blink on (output high)
+	    printf("Turning on the LED\n");
+        gpio_set_level(BLINK_GPIO, 1);
+        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        health_heartbeat++;
+    }
+}
+
+// Allocates the read buffers once, halving the chunk size down to
+// BUFFSIZE_MIN if the heap cannot fit the configured size
+static bool alloc_ota_buffers(void){
+    if (ota_buffer_size != 0) {
+        return true;
+    }
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    for (int i = 0; i < BUFFCOUNT; i++) {
+        ota_write_data[i] = ota_buffer_arena[i];
+    }
+    ota_buffer_size = BUFFSIZE;
+    return true;
+#else
+    for (int size = BUFFSIZE; size >= BUFFSIZE_MIN; size /= 2) {
+        int i;
+        for (i = 0; i < BUFFCOUNT; i++) {
+            ota_write_data[i] = heap_caps_malloc(size, MALLOC_CAP_DMA);
+            if (ota_write_data[i] == NULL) {
+                break;
+            }
+        }
+        if (i == BUFFCOUNT) {
+            ota_buffer_size = size;
+            ESP_LOGI(TAG, "Using %d buffers of %d bytes", BUFFCOUNT, size);
+            return true;
+        }
+        // Release the partial allocation and retry with smaller chunks
+        while (i-- > 0) {
+            heap_caps_free(ota_write_data[i]);
+            ota_write_data[i] = NULL;
+        }
+        ESP_LOGW(TAG, "Not enough DMA capable memory for %d byte buffers", size);
+    }
+    return false;
+#endif
+}
+
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+#if FF_MAX_SS == FF_MIN_SS
+#define RAW_SECTOR_SIZE(fs) FF_MAX_SS
+#else
+#define RAW_SECTOR_SIZE(fs) ((fs)->ssize)
+#endif
+
+// Update file read as runs of contiguous sectors straight from the card,
+// bypassing stdio and the VFS. Only FAT16 and FAT32 volumes are handled
+typedef struct {
+    FATFS *fs;
+    DWORD next_cluster;  // First cluster of the next run
+    DWORD run_sector;    // Next sector to read in the current run
+    DWORD run_left;      // Sectors left in the current run
+    FSIZE_t left;        // Bytes of the file not read yet
+    DWORD fat_sector;    // FAT sector held in fat_buf
+    BYTE *fat_buf;
+} raw_file_t;
+
+// Returns the FAT entry of a cluster, or 0 if the FAT cannot be read
+static DWORD raw_get_fat(raw_file_t *f, DWORD cluster){
+    UINT ss = RAW_SECTOR_SIZE(f->fs);
+    DWORD offset = (f->fs->fs_type == FS_FAT32) ? cluster * 4 : cluster * 2;
+    DWORD sector = f->fs->fatbase + offset / ss;
+
+    if (sector != f->fat_sector) {
+        if (sdmmc_read_sectors(card, f->fat_buf, sector, 1) != ESP_OK) {
+            return 0;
+        }
+        f->fat_sector = sector;
+    }
+    const BYTE *entry = &f->fat_buf[offset % ss];
+    if (f->fs->fs_type == FS_FAT32) {
+        return (entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((DWORD)entry[3] << 24)) & 0x0FFFFFFF;
+    }
+    return entry[0] | (entry[1] << 8);
+}
+
+// Follows the cluster chain to the end of the next contiguous run
+static bool raw_load_run(raw_file_t *f){
+    DWORD first = f->next_cluster;
+    DWORD last = first;
+    DWORD next;
+
+    if (first < 2 || first >= f->fs->n_fatent) {
+        return false;
+    }
+    while ((next = raw_get_fat(f, last)) == last + 1) {
+        last = next;
+    }
+    f->next_cluster = next;
+    f->run_sector = f->fs->database + (first - 2) * f->fs->csize;
+    f->run_left = (last - first + 1) * f->fs->csize;
+    return true;
+}
+
+static bool raw_file_open(raw_file_t *f, const char *name){
+    char path[64];
+    // A FIL carries a sector buffer, too large for the otaTask stack
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static FIL fil_arena;
+    FIL *fil = &fil_arena;
+#else
+    FIL *fil = heap_caps_malloc(sizeof(FIL), MALLOC_CAP_8BIT);
+    if (fil == NULL) {
+        return false;
+    }
+#endif
+
+    // Same file as seen through FatFs on the drive backing the card
+    snprintf(path, sizeof(path), "%d:/%s", ff_diskio_get_pdrv_card(card), name);
+    FRESULT res = f_open(fil, path, FA_READ);
+    if (res == FR_OK) {
+        f->fs = fil->obj.fs;
+        f->next_cluster = fil->obj.sclust;
+        f->left = fil->obj.objsize;
+        f_close(fil);
+    }
+#ifndef CONFIG_OTA_STATIC_MEMORY
+    heap_caps_free(fil);
+#endif
+    if (res != FR_OK) {
+        return false;
+    }
+
+    if (f->fs->fs_type != FS_FAT16 && f->fs->fs_type != FS_FAT32) {
+        ESP_LOGW(TAG, "Raw sector read needs FAT16 or FAT32");
+        return false;
+    }
+    f->run_left = 0;
+    f->fat_sector = 0;
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    DMA_ATTR static BYTE fat_arena[FF_MAX_SS];
+    f->fat_buf = fat_arena;
+#else
+    f->fat_buf = heap_caps_malloc(RAW_SECTOR_SIZE(f->fs), MALLOC_CAP_DMA);
+#endif
+    return f->fat_buf != NULL;
+}
+
+// Fills buf with whole sectors using as few multi-block reads as the
+// cluster chain allows. len must be a multiple of the sector size
+static int raw_file_read(raw_file_t *f, char *buf, int len){
+    UINT ss = RAW_SECTOR_SIZE(f->fs);
+    FSIZE_t wanted = (f->left < (FSIZE_t)len) ? f->left : (FSIZE_t)len;
+    DWORD sectors = (wanted + ss - 1) / ss;
+    DWORD done = 0;
+
+    while (done < sectors) {
+        if (f->run_left == 0 && !raw_load_run(f)) {
+            return -1;
+        }
+        DWORD count = sectors - done;
+        if (count > f->run_left) {
+            count = f->run_left;
+        }
+        if (sdmmc_read_sectors(card, buf + done * ss, f->run_sector, count) != ESP_OK) {
+            return -1;
+        }
+        f->run_sector += count;
+        f->run_left -= count;
+        done += count;
+    }
+    f->left -= wanted;
+    return wanted;
+}
+
+#ifdef CONFIG_OTA_RESUMABLE
+// Skips offset bytes from the start of the file. offset must be a
+// multiple of the sector size
+static bool raw_file_seek(raw_file_t *f, FSIZE_t offset){
+    DWORD sectors = offset / RAW_SECTOR_SIZE(f->fs);
+
+    if (offset > f->left) {
+        return false;
+    }
+    while (sectors > 0) {
+        if (f->run_left == 0 && !raw_load_run(f)) {
+            return false;
+        }
+        DWORD count = (sectors < f->run_left) ? sectors : f->run_left;
+        f->run_sector += count;
+        f->run_left -= count;
+        sectors -= count;
+    }
+    f->left -= offset;
+    return true;
+}
+#endif
+
+static void raw_file_close(raw_file_t *f){
+#ifndef CONFIG_OTA_STATIC_MEMORY
+    heap_caps_free(f->fat_buf);
+#endif
+    f->fat_buf = NULL;
+}
+#endif //CONFIG_OTA_RAW_SECTOR_READ
+
+// Update file being read, through stdio or the raw sector fast path
+typedef struct {
+    FILE *file;
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+    raw_file_t raw;
+    bool is_raw;
+#endif
+    int size;
+    // Set when the card failed a read, as opposed to a decoding error
+    bool has_read_error;
+} update_file_t;
+
+static update_file_t update_file;
+
+// Opens an update file. is_raw_allowed is cleared for files read in
+// pieces that are not whole sectors, which only stdio can serve
+static bool open_update_file(const char *name, bool is_raw_allowed){
+    update_file.has_read_error = false;
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+    update_file.is_raw = is_raw_allowed && raw_file_open(&update_file.raw, name);
+    if (update_file.is_raw) {
+        update_file.size = update_file.raw.left;
+        ESP_LOGI(TAG, "Reading update file from raw sectors");
+        return true;
+    }
+    if (is_raw_allowed) {
+        raw_file_close(&update_file.raw);
+        ESP_LOGW(TAG, "Raw sector read unavailable, using stdio");
+    }
+#else
+    (void)is_raw_allowed;
+#endif
+    char path[64];
+    struct stat st_func;
+    snprintf(path, sizeof(path), MOUNT_POINT"/%s", name);
+    update_file.file = fopen(path, "rb");
+    if (update_file.file == NULL) {
+        return false;
+    }
+    // Check original filesize to match read size later
+    fstat(fileno(update_file.file), &st_func);
+    update_file.size = st_func.st_size;
+    // Chunks are large and sector aligned, so read them straight into
+    // the buffers instead of going through the stdio buffer
+    setvbuf(update_file.file, NULL, _IONBF, 0);
+    return true;
+}
+
+// Returns the number of bytes read, 0 at the end of the file or
+// OTA_CHUNK_ERROR on failure
+static int read_update_file(char *buf, int len){
+    int data_read;
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+    if (update_file.is_raw) {
+        data_read = raw_file_read(&update_file.raw, buf, len);
+        update_file.has_read_error = data_read < 0;
+        return (data_read < 0) ? OTA_CHUNK_ERROR : data_read;
+    }
+#endif
+    data_read = fread(buf, 1, len, update_file.file);
+    if (data_read == 0 && ferror(update_file.file)) {
+        update_file.has_read_error = true;
+        return OTA_CHUNK_ERROR;
+    }
+    return data_read;
+}
+
+#ifdef CONFIG_OTA_RESUMABLE
+static bool seek_update_file(int offset){
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+    if (update_file.is_raw) {
+        return raw_file_seek(&update_file.raw, offset);
+    }
+#endif
+    return fseek(update_file.file, offset, SEEK_SET) == 0;
+}
+#endif
+
+static void close_update_file(void){
+#ifdef CONFIG_OTA_RAW_SECTOR_READ
+    if (update_file.is_raw) {
+        raw_file_close(&update_file.raw);
+        return;
+    }
+#endif
+    fclose(update_file.file);
+}
+
+// Buffered input for update files that are decoded on the fly (patches
+// and compressed images) instead of being read chunk by chunk
+#define INPUT_BUFFSIZE    4096
+// Size of the gzip trailer kept from the end of the file
+#define INPUT_TAILSIZE    8
+
+typedef struct {
+    char *buf;
+    int len;
+    int pos;
+    // Total bytes read from the card and the last INPUT_TAILSIZE of them
+    int total;
+    uint8_t tail[INPUT_TAILSIZE];
+} update_input_t;
+
+static update_input_t update_input;
+
+static bool input_begin(void){
+    memset(&update_input, 0, sizeof(update_input));
+    // Input buffer size is a multiple of the card sector size, for the
+    // raw sector fast path
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    DMA_ATTR static char input_arena[INPUT_BUFFSIZE];
+    update_input.buf = input_arena;
+#else
+    update_input.buf = heap_caps_malloc(INPUT_BUFFSIZE, MALLOC_CAP_DMA);
+#endif
+    return update_input.buf != NULL;
+}
+
+// Reads the next block of the file once the buffered data is used up
+static bool input_fill(void){
+    update_input.len = read_update_file(update_input.buf, INPUT_BUFFSIZE);
+    update_input.pos = 0;
+    if (update_input.len <= 0) {
+        return false;
+    }
+    update_input.total += update_input.len;
+    if (update_input.len >= INPUT_TAILSIZE) {
+        memcpy(update_input.tail, &update_input.buf[update_input.len - INPUT_TAILSIZE], INPUT_TAILSIZE);
+    } else {
+        memmove(update_input.tail, &update_input.tail[update_input.len], INPUT_TAILSIZE - update_input.len);
+        memcpy(&update_input.tail[INPUT_TAILSIZE - update_input.len], update_input.buf, update_input.len);
+    }
+    return true;
+}
+
+// Copies len bytes of input, refilling the buffer as needed
+static bool input_get(void *dst, int len){
+    while (len > 0) {
+        if (update_input.pos == update_input.len && !input_fill()) {
+            return false;
+        }
+        int count = update_input.len - update_input.pos;
+        if (count > len) {
+            count = len;
+        }
+        memcpy(dst, &update_input.buf[update_input.pos], count);
+        update_input.pos += count;
+        dst = (char *)dst + count;
+        len -= count;
+    }
+    return true;
+}
+
+static void input_end(void){
+#ifndef CONFIG_OTA_STATIC_MEMORY
+    heap_caps_free(update_input.buf);
+#endif
+    update_input.buf = NULL;
+}
+
+// Patch files (update.patch) rebuild the new image from the running
+// partition. They are made on the host by tools/mkpatch.py:
+//   header  "ESPPATCH", version, source size, target size, source SHA-256
+//   'C'     u32 source offset, u32 length  -> copy bytes from the source
+//   'I'     u32 length, <length bytes>     -> insert literal bytes
+//   'E'                                    -> end of patch
+#define PATCH_MAGIC       "ESPPATCH"
+#define PATCH_VERSION     1
+#define PATCH_OP_COPY     'C'
+#define PATCH_OP_INSERT   'I'
+#define PATCH_OP_END      'E'
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t source_size;
+    uint32_t target_size;
+    uint8_t source_sha256[32];
+} patch_header_t;
+
+typedef struct {
+    const uint8_t *source;
+    uint32_t source_size;
+    spi_flash_mmap_handle_t map_handle;
+    uint8_t op;
+    uint32_t op_offset;
+    uint32_t op_left;
+    bool is_done;
+} patch_t;
+
+static patch_t patch;
+
+// Reads the patch header and checks it applies to the running partition.
+// Returns the size of the image the patch rebuilds, or 0 on failure
+static int patch_begin(void){
+    patch_header_t header;
+    uint8_t sha256[32];
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    memset(&patch, 0, sizeof(patch));
+    if (!input_get(&header, sizeof(header))
+            || memcmp(header.magic, PATCH_MAGIC, sizeof(header.magic)) != 0
+            || header.version != PATCH_VERSION
+            || header.source_size > running->size) {
+        ESP_LOGE(TAG, "Invalid patch header");
+        return 0;
+    }
+    // The source image is read through the flash cache, as the patch asks
+    // for it, so it never has to fit in RAM
+    if (esp_partition_mmap(running, 0, running->size, SPI_FLASH_MMAP_DATA,
+                           (const void **)&patch.source, &patch.map_handle) != ESP_OK) {
+        return 0;
+    }
+    patch.source_size = header.source_size;
+    mbedtls_sha256_ret(patch.source, patch.source_size, sha256, 0);
+    if (memcmp(sha256, header.source_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGE(TAG, "Patch was not made for the running firmware");
+        return 0;
+    }
+    return header.target_size;
+}
+
+// Rebuilds up to len bytes of the new image. Returns the number of bytes
+// produced, 0 once the patch ends or OTA_CHUNK_ERROR on a malformed patch
+static int patch_read(char *buf, int len){
+    int done = 0;
+
+    while (done < len && !patch.is_done) {
+        if (patch.op_left == 0) {
+            if (!input_get(&patch.op, 1)) {
+                return OTA_CHUNK_ERROR;
+            }
+            if (patch.op == PATCH_OP_COPY) {
+                if (!input_get(&patch.op_offset, 4) || !input_get(&patch.op_left, 4)
+                        || patch.op_offset > patch.source_size
+                        || patch.op_left > patch.source_size - patch.op_offset) {
+                    return OTA_CHUNK_ERROR;
+                }
+            } else if (patch.op == PATCH_OP_INSERT) {
+                if (!input_get(&patch.op_left, 4)) {
+                    return OTA_CHUNK_ERROR;
+                }
+            } else if (patch.op == PATCH_OP_END) {
+                patch.is_done = true;
+            } else {
+                return OTA_CHUNK_ERROR;
+            }
+            continue;
+        }
+        int count = len - done;
+        if (count > patch.op_left) {
+            count = patch.op_left;
+        }
+        if (patch.op == PATCH_OP_COPY) {
+            memcpy(&buf[done], &patch.source[patch.op_offset], count);
+            patch.op_offset += count;
+        } else if (!input_get(&buf[done], count)) {
+            return OTA_CHUNK_ERROR;
+        }
+        patch.op_left -= count;
+        done += count;
+    }
+    return done;
+}
+
+static void patch_end(void){
+    if (patch.source != NULL) {
+        spi_flash_munmap(patch.map_handle);
+        patch.source = NULL;
+    }
+}
+
+// Compressed images (update.bin.gz) are inflated on the fly into the
+// OTA buffers through a fixed window, so only the compressed bytes are
+// read from the card. The window is the largest distance deflate uses
+#define GZIP_WINDOW       TINFL_LZ_DICT_SIZE
+#define GZIP_FLAG_HCRC    0x02
+#define GZIP_FLAG_EXTRA   0x04
+#define GZIP_FLAG_NAME    0x08
+#define GZIP_FLAG_COMMENT 0x10
+
+typedef struct {
+    tinfl_decompressor inflator;
+    uint8_t window[GZIP_WINDOW];
+    // Next byte written by the inflator and bytes not handed out yet
+    size_t window_pos;
+    size_t window_avail;
+    uint32_t crc;
+    uint32_t size;
+    bool is_done;
+} gzip_t;
+
+static gzip_t *gzip = NULL;
+
+// Skips a zero terminated field of the gzip header
+static bool gzip_skip_string(void){
+    char c;
+    do {
+        if (!input_get(&c, 1)) {
+            return false;
+        }
+    } while (c != '\0');
+    return true;
+}
+
+// Parses the gzip header and prepares the inflator
+static bool gzip_begin(void){
+    uint8_t header[10];
+    uint8_t extra[2];
+
+    if (!input_get(header, sizeof(header))
+            || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8) {
+        ESP_LOGE(TAG, "Invalid gzip header");
+        return false;
+    }
+    if (header[3] & GZIP_FLAG_EXTRA) {
+        char skip;
+        if (!input_get(extra, sizeof(extra))) {
+            return false;
+        }
+        for (int i = extra[0] | (extra[1] << 8); i > 0; i--) {
+            if (!input_get(&skip, 1)) {
+                return false;
+            }
+        }
+    }
+    if (((header[3] & GZIP_FLAG_NAME) && !gzip_skip_string())
+            || ((header[3] & GZIP_FLAG_COMMENT) && !gzip_skip_string())
+            || ((header[3] & GZIP_FLAG_HCRC) && !input_get(extra, sizeof(extra)))) {
+        return false;
+    }
+
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static gzip_t gzip_arena;
+    gzip = &gzip_arena;
+#else
+    gzip = heap_caps_malloc(sizeof(gzip_t), MALLOC_CAP_8BIT);
+    if (gzip == NULL) {
+        return false;
+    }
+#endif
+    tinfl_init(&gzip->inflator);
+    gzip->window_pos = 0;
+    gzip->window_avail = 0;
+    gzip->crc = 0;
+    gzip->size = 0;
+    gzip->is_done = false;
+    return true;
+}
+
+// Checks the CRC-32 and size in the trailer, the last 8 bytes of the file
+static bool gzip_check_trailer(void){
+    // Read whatever the inflator left after the end of the stream
+    while (input_fill()) {
+    }
+    const uint8_t *t = update_input.tail;
+    uint32_t crc = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32_t)t[3] << 24);
+    uint32_t size = t[4] | (t[5] << 8) | (t[6] << 16) | ((uint32_t)t[7] << 24);
+    if (crc != gzip->crc || size != gzip->size) {
+        ESP_LOGE(TAG, "Compressed image is corrupted");
+        return false;
+    }
+    ESP_LOGI(TAG, "Read %d compressed bytes for %u byte image (%d%%)",
+             update_input.total, size, (int)(100LL * update_input.total / size));
+    return true;
+}
+
+// Inflates up to len bytes of the image. Returns the number of bytes
+// produced, 0 at the end of the image or OTA_CHUNK_ERROR on failure
+static int gzip_read(char *buf, int len){
+    int done = 0;
+
+    while (done < len) {
+        if (gzip->window_avail > 0) {
+            // Hand out inflated bytes, stopping at the end of the window
+            size_t start = (gzip->window_pos - gzip->window_avail) & (GZIP_WINDOW - 1);
+            size_t count = len - done;
+            if (count > gzip->window_avail) {
+                count = gzip->window_avail;
+            }
+            if (count > GZIP_WINDOW - start) {
+                count = GZIP_WINDOW - start;
+            }
+            memcpy(&buf[done], &gzip->window[start], count);
+            gzip->crc = crc32_le(gzip->crc, &gzip->window[start], count);
+            gzip->size += count;
+            gzip->window_avail -= count;
+            done += count;
+            continue;
+        }
+        if (gzip->is_done) {
+            break;
+        }
+        if (update_input.pos == update_input.len && !input_fill()) {
+            return OTA_CHUNK_ERROR;
+        }
+        size_t in_size = update_input.len - update_input.pos;
+        size_t out_size = GZIP_WINDOW - gzip->window_pos;
+        tinfl_status status = tinfl_decompress(&gzip->inflator,
+                (const uint8_t *)&update_input.buf[update_input.pos], &in_size,
+                gzip->window, &gzip->window[gzip->window_pos], &out_size,
+                TINFL_FLAG_HAS_MORE_INPUT);
+        update_input.pos += in_size;
+        gzip->window_pos = (gzip->window_pos + out_size) & (GZIP_WINDOW - 1);
+        gzip->window_avail = out_size;
+        if (status == TINFL_STATUS_DONE) {
+            gzip->is_done = true;
+        } else if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Failed to inflate image (%d)", status);
+            return OTA_CHUNK_ERROR;
+        }
+    }
+    if (done == 0 && !gzip_check_trailer()) {
+        return OTA_CHUNK_ERROR;
+    }
+    return done;
+}
+
+static void gzip_end(void){
+#ifndef CONFIG_OTA_STATIC_MEMORY
+    heap_caps_free(gzip);
+#endif
+    gzip = NULL;
+}
+
+// Bundles (update.bundle) carry the app image and images for data
+// partitions in one file, read in a single pass. They are made on the
+// host by tools/mkbundle.py:
+//   header  "ESPBUNDL", u32 version, u32 entry count
+//   entry   char label[16], u32 offset, u32 size, SHA-256   (per entry)
+//   data    the entry images back to back, in index order
+// The first entry is the app image, written to the next OTA slot. The
+// others are written at their offset in the data partition with that label
+#define BUNDLE_MAGIC        "ESPBUNDL"
+#define BUNDLE_VERSION      1
+#define BUNDLE_MAX_ENTRIES  8
+#define BUNDLE_APP_LABEL    "app"
+
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} bundle_header_t;
+
+typedef struct __attribute__((packed)) {
+    char label[16];
+    uint32_t offset;
+    uint32_t size;
+    uint8_t sha256[32];
+} bundle_entry_t;
+
+typedef struct {
+    bundle_entry_t entries[BUNDLE_MAX_ENTRIES];
+    const esp_partition_t *partitions[BUNDLE_MAX_ENTRIES];
+    int count;
+    // Entry being written, bytes of it written so far and their hash
+    int current;
+    uint32_t written;
+    mbedtls_sha256_context sha256_ctx;
+} bundle_t;
+
+static bundle_t bundle;
+
+// Reads the bundle index and checks every entry fits its partition.
+// Returns the size of all entry images together, or 0 on failure
+static int bundle_begin(void){
+    bundle_header_t header;
+    int total = 0;
+
+    if (read_update_file((char *)&header, sizeof(header)) != sizeof(header)
+            || memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != BUNDLE_VERSION
+            || header.count == 0 || header.count > BUNDLE_MAX_ENTRIES) {
+        ESP_LOGE(TAG, "Invalid bundle header");
+        return 0;
+    }
+    int index_size = header.count * sizeof(bundle_entry_t);
+    if (read_update_file((char *)bundle.entries, index_size) != index_size) {
+        ESP_LOGE(TAG, "Invalid bundle index");
+        return 0;
+    }
+    bundle.count = header.count;
+
+    for (int i = 0; i < bundle.count; i++) {
+        bundle_entry_t *entry = &bundle.entries[i];
+        const esp_partition_t *partition = NULL;
+        entry->label[sizeof(entry->label) - 1] = '\0';
+        if (i == 0) {
+            // Only the app image goes to the OTA slot
+            if (strcmp(entry->label, BUNDLE_APP_LABEL) == 0 && entry->offset == 0 && entry->size > 0) {
+                partition = esp_ota_get_next_update_partition(NULL);
+            }
+        } else {
+            partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, entry->label);
+            // otadata and the NVS partition in use are never overwritten
+            if (partition != NULL && (partition->subtype == ESP_PARTITION_SUBTYPE_DATA_OTA
+                    || strcmp(partition->label, NVS_DEFAULT_PART_NAME) == 0)) {
+                partition = NULL;
+            }
+        }
+        if (partition == NULL || entry->offset % SPI_FLASH_SEC_SIZE != 0
+                || entry->offset > partition->size || entry->size > partition->size - entry->offset) {
+            ESP_LOGE(TAG, "Bundle entry %d (%s) does not fit a partition", i, entry->label);
+            return 0;
+        }
+        bundle.partitions[i] = partition;
+        ESP_LOGI(TAG, "Bundle entry %d: %u bytes to %s at 0x%x", i, entry->size, partition->label, entry->offset);
+        total += entry->size;
+    }
+
+    bundle.current = 0;
+    bundle.written = 0;
+    mbedtls_sha256_init(&bundle.sha256_ctx);
+    mbedtls_sha256_starts_ret(&bundle.sha256_ctx, 0);
+    return total;
+}
+
+static void bundle_end(void){
+    mbedtls_sha256_free(&bundle.sha256_ctx);
+}
+
+// Image fed to otaTask: a full update.bin, the image inflated from
+// update.bin.gz, the image rebuilt from update.patch or the entry images
+// of update.bundle
+typedef enum {
+    OTA_FORMAT_BINARY,
+    OTA_FORMAT_GZIP,
+    OTA_FORMAT_PATCH,
+    OTA_FORMAT_BUNDLE,
+} ota_format_t;
+
+typedef struct {
+    const char *name;
+    ota_format_t format;
+} ota_format_file_t;
+
+// Files looked for on the card, in order of preference
+static const ota_format_file_t ota_format_files[] = {
+    { "update.bin", OTA_FORMAT_BINARY },
+    { "update.bin.gz", OTA_FORMAT_GZIP },
+    { "update.patch", OTA_FORMAT_PATCH },
+    { "update.bundle", OTA_FORMAT_BUNDLE },
+};
+#define OTA_FORMAT_FILES (sizeof(ota_format_files) / sizeof(ota_format_files[0]))
+
+typedef struct {
+    // Cleared once closed, so closing twice is harmless
+    bool is_open;
+    // Update file, relative to the card root
+    const char *name;
+    ota_format_t format;
+    // Image size, or -1 until the end of a compressed image is reached
+    int size;
+    // Modification time of the update file, part of its identity
+    time_t mtime;
+    // Size and name checksum of the update file, the rest of it
+    uint32_t file_size;
+    uint32_t name_crc;
+    // Hash of the image, computed chunk by chunk as otaTask writes it
+    // while the reader task fetches the next chunks, and the one expected
+    // by update.sha256 if present
+    mbedtls_sha256_context sha256_ctx;
+    uint8_t sha256[32];
+    uint8_t expected_sha256[32];
+    bool has_expected_sha256;
+} ota_source_t;
+
+static ota_source_t ota_source;
+
+// Descriptions of the running app and of the last app rolled back, read
+// once at boot. The invalid slot is the one updates overwrite, so its
+// description must be kept from before any update starts
+static esp_app_desc_t running_app_info;
+static esp_app_desc_t invalid_app_info;
+static bool has_invalid_app_info = false;
+
+static void cache_app_descriptions(void){
+    memcpy(&running_app_info, esp_ota_get_app_description(), sizeof(running_app_info));
+    has_invalid_app_info = esp_ota_get_partition_description(esp_ota_get_last_invalid_partition(),
+                                                             &invalid_app_info) == ESP_OK;
+}
+
+// Checks the start of an image where it was read, without copying it:
+// the buffer must be word aligned and hold the image header, the first
+// segment header and the app description, and these must carry the
+// right magic numbers, a sane segment count and this chip's id. Returns
+// the app description inside the buffer, or NULL
+static const esp_app_desc_t *check_image_header(const char *data, int len){
+    const esp_image_header_t *header = (const esp_image_header_t *)data;
+    const esp_app_desc_t *app = (const esp_app_desc_t *)(data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t));
+
+    if (len < sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)
+            || ((uintptr_t)data & 3) != 0) {
+        ESP_LOGE(TAG, "Received package length does not fit");
+        return NULL;
+    }
+    if (header->magic != ESP_IMAGE_HEADER_MAGIC
+            || header->segment_count == 0 || header->segment_count > ESP_IMAGE_MAX_SEGMENTS
+            || app->magic_word != ESP_APP_DESC_MAGIC_WORD) {
+        ESP_LOGE(TAG, "Update file is not an app image");
+        return NULL;
+    }
+    if (header->chip_id != CONFIG_IDF_FIRMWARE_CHIP_ID) {
+        ESP_LOGE(TAG, "Image is built for chip id %d, not this chip", header->chip_id);
+        return NULL;
+    }
+    return app;
+}
+
+// Cards serving devices on different versions hold app images in the
+// updates directory. Only the header of each image is read to learn its
+// version, and the index built from them is cached on the card. The
+// cache is trusted while the names, sizes and mtimes of the images
+// listed in the directory match it, which takes no file reads, so it is
+// not rebuilt at every mount. The directory mtime is not enough, many
+// hosts leave it unchanged when files are added
+#define UPDATES_DIR         "updates"
+#define UPDATE_INDEX_FILE   MOUNT_POINT"/"UPDATES_DIR"/index.dat"
+#define UPDATE_INDEX_MAGIC  0x32444955
+#define UPDATE_INDEX_MAX    16
+#define UPDATE_NAME_MAX     32
+
+typedef struct {
+    char name[UPDATE_NAME_MAX];
+    uint32_t size;
+    time_t mtime;
+    // Parsed app version, 0 if the file is not a valid app image
+    uint32_t version;
+    char version_text[32];
+} update_index_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    update_index_entry_t entries[UPDATE_INDEX_MAX];
+} update_index_t;
+
+static update_index_t update_index;
+// Cleared when the card is unmounted
+static bool is_update_index_loaded = false;
+
+// Parses "[v]major.minor.patch[-suffix]" into a number that sorts like
+// the version. Suffixes are ignored. Returns 0 if it is not a version
+static uint32_t parse_version(const char *text){
+    unsigned int major, minor, patch;
+    if (*text == 'v' || *text == 'V') {
+        text++;
+    }
+    if (sscanf(text, "%u.%u.%u", &major, &minor, &patch) != 3
+            || major > 255 || minor > 255 || patch > 65535) {
+        return 0;
+    }
+    return (major << 24) | (minor << 16) | patch;
+}
+
+// Reads the app description from the header of an image on the card
+static bool read_image_version(const char *path, update_index_entry_t *entry){
+    struct {
+        esp_image_header_t image;
+        esp_image_segment_header_t segment;
+        esp_app_desc_t app;
+    } __attribute__((packed)) header;
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    setvbuf(file, NULL, _IONBF, 0);
+    bool is_valid = fread(&header, 1, sizeof(header), file) == sizeof(header)
+                    && header.image.magic == ESP_IMAGE_HEADER_MAGIC
+                    && header.app.magic_word == ESP_APP_DESC_MAGIC_WORD;
+    fclose(file);
+    if (!is_valid) {
+        return false;
+    }
+    strlcpy(entry->version_text, header.app.version, sizeof(entry->version_text));
+    entry->version = parse_version(entry->version_text);
+    return entry->version != 0;
+}
+
+static bool is_update_image_name(const char *name){
+    const char *ext = strrchr(name, '.');
+    return ext != NULL && strcasecmp(ext, ".bin") == 0 && strlen(name) < UPDATE_NAME_MAX;
+}
+
+static void build_update_index(void){
+    char path[64];
+    struct stat st;
+    struct dirent *dirent;
+    DIR *dir = opendir(MOUNT_POINT"/"UPDATES_DIR);
+
+    update_index.magic = UPDATE_INDEX_MAGIC;
+    update_index.count = 0;
+    if (dir == NULL) {
+        return;
+    }
+    while ((dirent = readdir(dir)) != NULL && update_index.count < UPDATE_INDEX_MAX) {
+        if (!is_update_image_name(dirent->d_name)) {
+            continue;
+        }
+        update_index_entry_t *entry = &update_index.entries[update_index.count];
+        memset(entry, 0, sizeof(*entry));
+        strlcpy(entry->name, dirent->d_name, sizeof(entry->name));
+        snprintf(path, sizeof(path), MOUNT_POINT"/"UPDATES_DIR"/%s", entry->name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        entry->size = st.st_size;
+        entry->mtime = st.st_mtime;
+        if (!read_image_version(path, entry)) {
+            ESP_LOGW(TAG, "Ignoring %s, not an app image", entry->name);
+        }
+        update_index.count++;
+    }
+    closedir(dir);
+    ESP_LOGI(TAG, "Indexed %u images in "UPDATES_DIR, update_index.count);
+
+    // The card driver does not check the WP pin, so write protected cards
+    // are left alone and just rebuild the index at the next mount
+    if (!is_card_writable()) {
+        return;
+    }
+    FILE* cache = fopen(UPDATE_INDEX_FILE, "wb");
+    if (cache != NULL) {
+        fwrite(&update_index, 1, sizeof(update_index), cache);
+        fclose(cache);
+    }
+}
+
+// Lists the directory in the order build_update_index does and checks
+// that each image has the entry it would get
+static bool is_update_index_current(void){
+    char path[64];
+    struct stat st;
+    struct dirent *dirent;
+    uint32_t count = 0;
+    bool is_current = true;
+    DIR *dir = opendir(MOUNT_POINT"/"UPDATES_DIR);
+
+    if (dir == NULL) {
+        return false;
+    }
+    while (is_current && (dirent = readdir(dir)) != NULL && count < UPDATE_INDEX_MAX) {
+        if (!is_update_image_name(dirent->d_name)) {
+            continue;
+        }
+        const update_index_entry_t *entry = &update_index.entries[count];
+        if (count >= update_index.count || strcmp(entry->name, dirent->d_name) != 0) {
+            is_current = false;
+            break;
+        }
+        snprintf(path, sizeof(path), MOUNT_POINT"/"UPDATES_DIR"/%s", entry->name);
+        is_current = stat(path, &st) == 0 && entry->size == st.st_size && entry->mtime == st.st_mtime;
+        count++;
+    }
+    closedir(dir);
+    return is_current && count == update_index.count;
+}
+
+// Loads the cached index if the images in the directory did not change
+// since it was written, or builds it again
+static void load_update_index(bool is_rebuild){
+    struct stat st;
+    if (stat(MOUNT_POINT"/"UPDATES_DIR, &st) != 0) {
+        update_index.count = 0;
+        is_update_index_loaded = true;
+        return;
+    }
+    if (!is_rebuild) {
+        FILE* cache = fopen(UPDATE_INDEX_FILE, "rb");
+        if (cache != NULL) {
+            bool is_valid = fread(&update_index, 1, sizeof(update_index), cache) == sizeof(update_index)
+                            && update_index.magic == UPDATE_INDEX_MAGIC
+                            && update_index.count <= UPDATE_INDEX_MAX;
+            fclose(cache);
+            if (is_valid && is_update_index_current()) {
+                is_update_index_loaded = true;
+                return;
+            }
+        }
+    }
+    build_update_index();
+    is_update_index_loaded = true;
+}
+
+// Picks the newest image in the updates directory that is newer than
+// the running firmware and is not the version that was rolled back
+static const update_index_entry_t *select_update_image(void){
+    uint32_t best_version = parse_version(running_app_info.version);
+    const update_index_entry_t *best = NULL;
+
+    for (int i = 0; i < update_index.count; i++) {
+        const update_index_entry_t *entry = &update_index.entries[i];
+        if (entry->version <= best_version) {
+            continue;
+        }
+        if (has_invalid_app_info && strncmp(entry->version_text, invalid_app_info.version, sizeof(entry->version_text)) == 0) {
+            continue;
+        }
+        best = entry;
+        best_version = entry->version;
+    }
+    return best;
+}
+
+// Returns the first update file found on the card, or NULL. Without one
+// at the root, the newest suitable image in the updates directory is used
+static const ota_format_file_t *find_update_file(struct stat *st){
+    static char selected_name[sizeof(UPDATES_DIR) + UPDATE_NAME_MAX];
+    static const ota_format_file_t selected = { selected_name, OTA_FORMAT_BINARY };
+    char path[64];
+
+    for (int i = 0; i < OTA_FORMAT_FILES; i++) {
+        snprintf(path, sizeof(path), MOUNT_POINT"/%s", ota_format_files[i].name);
+        if (stat(path, st) == 0) {
+            return &ota_format_files[i];
+        }
+    }
+
+    bool is_rebuild = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!is_update_index_loaded || is_rebuild) {
+            load_update_index(is_rebuild);
+        }
+        const update_index_entry_t *entry = select_update_image();
+        if (entry == NULL) {
+            return NULL;
+        }
+        snprintf(selected_name, sizeof(selected_name), UPDATES_DIR"/%s", entry->name);
+        snprintf(path, sizeof(path), MOUNT_POINT"/%s", selected_name);
+        // An image changed since the index was loaded rebuilds it once
+        if (stat(path, st) == 0 && st->st_size == entry->size && st->st_mtime == entry->mtime) {
+            ESP_LOGI(TAG, "Selected %s (version %s)", selected_name, entry->version_text);
+            return &selected;
+        }
+        is_rebuild = true;
+    }
+    return NULL;
+}
+
+// Path of the manifest of an update file. Files at the root share
+// update.sha256, an image in the updates directory has its own named
+// after it (updates/v1.0.2.bin is checked against updates/v1.0.2.sha256),
+// so a card can hold a manifest for each version it carries
+static void get_manifest_path(const char *name, char *path, size_t size){
+    const char *ext = strrchr(name, '.');
+    if (strncmp(name, UPDATES_DIR"/", sizeof(UPDATES_DIR)) == 0 && ext != NULL) {
+        snprintf(path, size, MOUNT_POINT"/%.*s.sha256", (int)(ext - name), name);
+    } else {
+        snprintf(path, size, MOUNT_POINT"/update.sha256");
+    }
+}
+
+// Reads the expected image hash from a manifest, written on the host
+// with "sha256sum update.bin > update.sha256"
+static bool read_sha256_manifest(const char *path, uint8_t *sha256){
+    char hex[65];
+    FILE* manifest = fopen(path, "r");
+    if (manifest == NULL) {
+        return false;
+    }
+    bool is_valid = fscanf(manifest, "%64[0-9a-fA-F]", hex) == 1 && strlen(hex) == 64;
+    fclose(manifest);
+    for (int i = 0; is_valid && i < 32; i++) {
+        unsigned int byte;
+        sscanf(&hex[i * 2], "%2x", &byte);
+        sha256[i] = byte;
+    }
+    if (!is_valid) {
+        ESP_LOGE(TAG, "Invalid %s", path);
+    }
+    return is_valid;
+}
+
+// Images this device already installed or rejected for good, kept in
+// NVS. A card left in the slot, typically a write protected one, is then
+// skipped after every reboot from stat() alone, without opening the
+// file. Entries match on the file name, size and mtime, which a host
+// changes when it writes a new image; the image hash is kept alongside
+// once the whole image was read
+#define KNOWN_NAMESPACE "known"
+#define KNOWN_KEY       "images"
+#define KNOWN_IMAGES    8
+
+typedef enum {
+    KNOWN_EMPTY,
+    KNOWN_APPLIED,
+    KNOWN_REJECTED,
+} known_state_t;
+
+typedef struct {
+    uint32_t name_crc;
+    uint32_t size;
+    int64_t mtime;
+    uint8_t sha256[32];
+    uint8_t state;
+} known_image_t;
+
+typedef struct {
+    known_image_t images[KNOWN_IMAGES];
+    // Entry replaced by the next new image, the oldest one
+    uint32_t next;
+} known_index_t;
+
+static known_index_t known_index;
+
+// Loads the index once at boot, scans only look at the RAM copy
+static void load_known_images(void){
+    nvs_handle_t handle;
+    size_t size = sizeof(known_index);
+    if (nvs_open(KNOWN_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, KNOWN_KEY, &known_index, &size) != ESP_OK
+            || size != sizeof(known_index) || known_index.next >= KNOWN_IMAGES) {
+        memset(&known_index, 0, sizeof(known_index));
+    }
+    nvs_close(handle);
+}
+
+static known_image_t *find_known_image(uint32_t name_crc, uint32_t size, int64_t mtime){
+    for (int i = 0; i < KNOWN_IMAGES; i++) {
+        known_image_t *image = &known_index.images[i];
+        if (image->state != KNOWN_EMPTY && image->name_crc == name_crc
+                && image->size == size && image->mtime == mtime) {
+            return image;
+        }
+    }
+    return NULL;
+}
+
+// Tells whether the update file found by a scan was handled before
+static bool is_known_image(const char *name, const struct stat *st){
+    uint32_t name_crc = crc32_le(0, (const uint8_t *)name, strlen(name));
+    return find_known_image(name_crc, st->st_size, st->st_mtime) != NULL;
+}
+
+// Adds the image of the current ota_source to the index
+static void remember_image(known_state_t state){
+    nvs_handle_t handle;
+    known_image_t *image = find_known_image(ota_source.name_crc, ota_source.file_size, ota_source.mtime);
+
+    if (image == NULL) {
+        image = &known_index.images[known_index.next];
+        known_index.next = (known_index.next + 1) % KNOWN_IMAGES;
+    }
+    memset(image, 0, sizeof(*image));
+    image->name_crc = ota_source.name_crc;
+    image->size = ota_source.file_size;
+    image->mtime = ota_source.mtime;
+    image->state = state;
+    if (state == KNOWN_APPLIED) {
+        memcpy(image->sha256, ota_source.sha256, sizeof(image->sha256));
+    }
+    if (nvs_open(KNOWN_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_set_blob(handle, KNOWN_KEY, &known_index, sizeof(known_index));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+// Records the files of the update just installed for
+// remove_update_files, before the restart into the new image
+static void save_installed_update(void){
+    installed_update_t installed;
+    nvs_handle_t handle;
+    char manifest[64];
+
+    memset(&installed, 0, sizeof(installed));
+    strlcpy(installed.file, ota_source.name, sizeof(installed.file));
+    if (ota_source.has_expected_sha256) {
+        get_manifest_path(ota_source.name, manifest, sizeof(manifest));
+        strlcpy(installed.manifest, manifest + sizeof(MOUNT_POINT), sizeof(installed.manifest));
+    }
+    if (nvs_open(INSTALLED_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    nvs_set_blob(handle, INSTALLED_KEY, &installed, sizeof(installed));
+    nvs_commit(handle);
+    nvs_close(handle);
+}
+
+static bool open_update_source(void){
+    struct stat st;
+    const ota_format_file_t *found = find_update_file(&st);
+    bool is_open;
+
+    if (found == NULL) {
+        return false;
+    }
+    // Bundles carry a hash for each entry instead of a manifest
+    bool is_bundle = found->format == OTA_FORMAT_BUNDLE;
+    char manifest[64];
+    get_manifest_path(found->name, manifest, sizeof(manifest));
+    ota_source.has_expected_sha256 = !is_bundle && read_sha256_manifest(manifest, ota_source.expected_sha256);
+#ifdef CONFIG_OTA_REQUIRE_SHA256
+    if (!is_bundle && !ota_source.has_expected_sha256) {
+        ESP_LOGE(TAG, "No valid %s on the card", manifest);
+        return false;
+    }
+#endif
+    // The bundle header and index are not a whole number of sectors, so
+    // bundles are read through stdio
+    if (!open_update_file(found->name, !is_bundle)) {
+        return false;
+    }
+    mbedtls_sha256_init(&ota_source.sha256_ctx);
+    mbedtls_sha256_starts_ret(&ota_source.sha256_ctx, 0);
+    ota_source.name = found->name;
+    ota_source.format = found->format;
+    ota_source.mtime = st.st_mtime;
+    ota_source.file_size = st.st_size;
+    ota_source.name_crc = crc32_le(0, (const uint8_t *)found->name, strlen(found->name));
+    if (found->format == OTA_FORMAT_BINARY) {
+        ota_source.size = update_file.size;
+        return true;
+    }
+    if (is_bundle) {
+        ota_source.size = bundle_begin();
+        if (ota_source.size == 0) {
+            close_update_file();
+            return false;
+        }
+        return true;
+    }
+
+    is_open = input_begin();
+    if (is_open && found->format == OTA_FORMAT_GZIP) {
+        is_open = gzip_begin();
+        ota_source.size = -1;
+    } else if (is_open) {
+        ota_source.size = patch_begin();
+        is_open = ota_source.size > 0;
+        if (is_open) {
+            ESP_LOGI(TAG, "Applying %d byte patch to rebuild %d byte image", update_file.size, ota_source.size);
+        }
+    }
+    if (!is_open) {
+        gzip_end();
+        patch_end();
+        input_end();
+        close_update_file();
+    }
+    return is_open;
+}
+
+// Returns the number of image bytes produced, 0 at the end of the image
+// or OTA_CHUNK_ERROR on failure
+static int read_update_source(char *buf, int len){
+    int data_read;
+    switch (ota_source.format) {
+    case OTA_FORMAT_GZIP:
+        data_read = gzip_read(buf, len);
+        if (data_read == 0) {
+            ota_source.size = gzip->size;
+        }
+        return data_read;
+    case OTA_FORMAT_PATCH:
+        return patch_read(buf, len);
+    default:
+        return read_update_file(buf, len);
+    }
+}
+
+static void close_update_source(void){
+    if (!ota_source.is_open) {
+        return;
+    }
+    ota_source.is_open = false;
+    mbedtls_sha256_free(&ota_source.sha256_ctx);
+    if (ota_source.format == OTA_FORMAT_BUNDLE) {
+        bundle_end();
+    } else if (ota_source.format != OTA_FORMAT_BINARY) {
+        gzip_end();
+        patch_end();
+        input_end();
+    }
+    close_update_file();
+}
+
+// Target of the incoming image. With CONFIG_OTA_SKIP_UNCHANGED_SECTORS the
+// partition is written sector by sector and sectors already holding the
+// same bytes are neither erased nor programmed. With
+// CONFIG_OTA_BACKGROUND_ERASE an eraser task clears the image area ahead
+// of the write cursor. Otherwise esp_ota_* erases the image area up front
+// and writes it
+typedef struct {
+    const esp_partition_t *partition;
+    // Cleared once ended or aborted, so neither runs twice
+    bool is_open;
+#ifdef CONFIG_OTA_SKIP_UNCHANGED_SECTORS
+    const uint8_t *mapped;
+    spi_flash_mmap_handle_t map_handle;
+    size_t offset;
+    int sectors_skipped;
+    int sectors_written;
+#elif defined(CONFIG_OTA_BACKGROUND_ERASE)
+    size_t offset;
+    // Erase progress, only advanced by eraserTask
+    volatile size_t erased;
+    size_t erase_end;
+    volatile bool is_erase_stopped;
+    volatile bool is_erase_done;
+    esp_err_t erase_err;
+    bool is_erasing;
+    // Given by eraserTask after each erased block and when it exits
+    SemaphoreHandle_t erase_progress;
+#else
+    esp_ota_handle_t handle;
+#endif
+} ota_writer_t;
+
+static ota_writer_t ota_writer;
+
+#if defined(CONFIG_OTA_SKIP_UNCHANGED_SECTORS) || defined(CONFIG_OTA_BACKGROUND_ERASE)
+// Checks the image written to the partition, as esp_ota_end would
+static esp_err_t verify_partition_image(const esp_partition_t *partition){
+    esp_image_metadata_t data;
+    const esp_partition_pos_t part_pos = {
+        .offset = partition->address,
+        .size = partition->size,
+    };
+    if (esp_image_verify(ESP_IMAGE_VERIFY, &part_pos, &data) != ESP_OK) {
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_OTA_BACKGROUND_ERASE
+// Erases a 64 KB block at a time where aligned, which the flash does
+// much faster than the 16 sectors it holds
+#define ERASE_BLOCK_SIZE (16 * SPI_FLASH_SEC_SIZE)
+
+static void eraserTask(void * parameter){
+    esp_err_t err = ESP_OK;
+
+    while (ota_writer.erased < ota_writer.erase_end && !ota_writer.is_erase_stopped) {
+        size_t size = SPI_FLASH_SEC_SIZE;
+        if (ota_writer.erased % ERASE_BLOCK_SIZE == 0
+                && ota_writer.erase_end - ota_writer.erased >= ERASE_BLOCK_SIZE) {
+            size = ERASE_BLOCK_SIZE;
+        }
+        err = esp_partition_erase_range(ota_writer.partition, ota_writer.erased, size);
+        if (err != ESP_OK) {
+            break;
+        }
+        ota_writer.erased += size;
+        xSemaphoreGive(ota_writer.erase_progress);
+    }
+
+    ota_writer.erase_err = err;
+    ota_writer.is_erase_done = true;
+    xSemaphoreGive(ota_writer.erase_progress);
+    end_task();
+}
+
+// Waits until the eraser task is past end
+static esp_err_t wait_erased(size_t end){
+    while (ota_writer.erased < end) {
+        if (ota_writer.is_erase_done) {
+            return (ota_writer.erase_err != ESP_OK) ? ota_writer.erase_err : ESP_ERR_INVALID_SIZE;
+        }
+        xSemaphoreTake(ota_writer.erase_progress, portMAX_DELAY);
+    }
+    return ESP_OK;
+}
+
+static void stop_eraser(void){
+    if (!ota_writer.is_erasing) {
+        return;
+    }
+    ota_writer.is_erase_stopped = true;
+    while (!ota_writer.is_erase_done) {
+        xSemaphoreTake(ota_writer.erase_progress, portMAX_DELAY);
+    }
+    ota_writer.is_erasing = false;
+}
+#endif //CONFIG_OTA_BACKGROUND_ERASE
+
+// Prepares the partition for an image of size bytes, -1 if not known yet
+static esp_err_t ota_writer_begin(const esp_partition_t *partition, int size){
+    ota_writer.is_open = true;
+#ifdef CONFIG_OTA_SKIP_UNCHANGED_SECTORS
+    ota_writer.partition = partition;
+    ota_writer.offset = 0;
+    ota_writer.sectors_skipped = 0;
+    ota_writer.sectors_written = 0;
+    // Map the old content so sectors are compared through the flash
+    // cache without copying them to RAM
+    return esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA,
+                              (const void **)&ota_writer.mapped, &ota_writer.map_handle);
+#elif defined(CONFIG_OTA_BACKGROUND_ERASE)
+    size_t erase_end = partition->size;
+    if (size > 0 && size <= partition->size) {
+        erase_end = (size + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+    }
+    // A speculative erase already started for this image is taken over
+    if (ota_writer.is_erasing && ota_writer.partition == partition && ota_writer.erase_end == erase_end) {
+        ota_writer.offset = 0;
+        return ESP_OK;
+    }
+    stop_eraser();
+
+    if (ota_writer.erase_progress == NULL) {
+#ifdef CONFIG_OTA_STATIC_MEMORY
+        static StaticSemaphore_t erase_progress_buffer;
+        ota_writer.erase_progress = xSemaphoreCreateBinaryStatic(&erase_progress_buffer);
+#else
+        ota_writer.erase_progress = xSemaphoreCreateBinary();
+#endif
+    }
+    xSemaphoreTake(ota_writer.erase_progress, 0);
+    ota_writer.partition = partition;
+    ota_writer.offset = 0;
+    ota_writer.erased = 0;
+    ota_writer.erase_end = erase_end;
+    ota_writer.is_erase_stopped = false;
+    ota_writer.is_erase_done = false;
+    ota_writer.erase_err = ESP_OK;
+    if (!start_task(&eraser_task, eraserTask, 5, tskNO_AFFINITY)) {
+        return ESP_ERR_NO_MEM;
+    }
+    ota_writer.is_erasing = true;
+    return ESP_OK;
+#else
+    ota_writer.partition = partition;
+    // Only the area the image needs is erased when its size is known
+    return esp_ota_begin(partition, (size > 0) ? size : OTA_SIZE_UNKNOWN, &ota_writer.handle);
+#endif
+}
+
+// Chunks hold whole sectors except the last one of the image, so every
+// call starts at a sector boundary
+static esp_err_t ota_writer_write(const char *data, int len){
+#ifdef CONFIG_OTA_SKIP_UNCHANGED_SECTORS
+    esp_err_t err;
+    while (len > 0) {
+        int size = (len < SPI_FLASH_SEC_SIZE) ? len : SPI_FLASH_SEC_SIZE;
+        if (ota_writer.offset + size > ota_writer.partition->size) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (memcmp(ota_writer.mapped + ota_writer.offset, data, size) == 0) {
+            ota_writer.sectors_skipped++;
+        } else {
+            err = esp_partition_erase_range(ota_writer.partition, ota_writer.offset, SPI_FLASH_SEC_SIZE);
+            if (err == ESP_OK) {
+                err = esp_partition_write(ota_writer.partition, ota_writer.offset, data, size);
+            }
+            if (err != ESP_OK) {
+                return err;
+            }
+            ota_writer.sectors_written++;
+        }
+        ota_writer.offset += size;
+        data += size;
+        len -= size;
+    }
+    return ESP_OK;
+#elif defined(CONFIG_OTA_BACKGROUND_ERASE)
+    esp_err_t err = wait_erased(ota_writer.offset + len);
+    if (err == ESP_OK) {
+        err = esp_partition_write(ota_writer.partition, ota_writer.offset, data, len);
+    }
+    ota_writer.offset += len;
+    return err;
+#else
+    return esp_ota_write(ota_writer.handle, (const void *)data, len);
+#endif
+}
+
+// Finishes writing and validates the image now in the partition
+static esp_err_t ota_writer_end(void){
+    if (!ota_writer.is_open) {
+        return ESP_OK;
+    }
+    ota_writer.is_open = false;
+#ifdef CONFIG_OTA_SKIP_UNCHANGED_SECTORS
+    spi_flash_munmap(ota_writer.map_handle);
+    ESP_LOGI(TAG, "Skipped %d unchanged sectors, written %d sectors",
+             ota_writer.sectors_skipped, ota_writer.sectors_written);
+    return verify_partition_image(ota_writer.partition);
+#elif defined(CONFIG_OTA_BACKGROUND_ERASE)
+    // Images of unknown size had the whole partition queued for erasing
+    stop_eraser();
+    return verify_partition_image(ota_writer.partition);
+#else
+    return esp_ota_end(ota_writer.handle);
+#endif
+}
+
+static void ota_writer_abort(void){
+    if (!ota_writer.is_open) {
+        return;
+    }
+    ota_writer.is_open = false;
+#ifdef CONFIG_OTA_SKIP_UNCHANGED_SECTORS
+    spi_flash_munmap(ota_writer.map_handle);
+#elif defined(CONFIG_OTA_BACKGROUND_ERASE)
+    stop_eraser();
+#else
+    // esp_ota_end releases the handle even when the partial image fails
+    // validation
+    esp_ota_end(ota_writer.handle);
+#endif
+}
+
+// Writes len bytes of the current data entry at its write cursor. Entry
+// offsets are sector aligned, so each sector is erased as the cursor
+// enters it
+static esp_err_t bundle_write_data(const char *data, int len){
+    const esp_partition_t *partition = bundle.partitions[bundle.current];
+    esp_err_t err;
+
+    while (len > 0) {
+        size_t offset = bundle.entries[bundle.current].offset + bundle.written;
+        int size = SPI_FLASH_SEC_SIZE - offset % SPI_FLASH_SEC_SIZE;
+        if (size > len) {
+            size = len;
+        }
+        if (offset % SPI_FLASH_SEC_SIZE == 0) {
+            err = esp_partition_erase_range(partition, offset, SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+        err = esp_partition_write(partition, offset, data, size);
+        if (err != ESP_OK) {
+            return err;
+        }
+        mbedtls_sha256_update_ret(&bundle.sha256_ctx, (const unsigned char *)data, size);
+        bundle.written += size;
+        data += size;
+        len -= size;
+    }
+    return ESP_OK;
+}
+
+// Checks the entry just completed against its hash and moves to the next.
+// The app image is validated here, before any data partition is touched
+static esp_err_t bundle_next_entry(void){
+    const bundle_entry_t *entry = &bundle.entries[bundle.current];
+    uint8_t sha256[32];
+
+    mbedtls_sha256_finish_ret(&bundle.sha256_ctx, sha256);
+    if (memcmp(sha256, entry->sha256, sizeof(sha256)) != 0) {
+        ESP_LOGE(TAG, "Bundle entry %s does not match its hash", entry->label);
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (bundle.current == 0) {
+        esp_err_t err = ota_writer_end();
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    ESP_LOGI(TAG, "Bundle entry %s written", entry->label);
+    bundle.current++;
+    bundle.written = 0;
+    mbedtls_sha256_starts_ret(&bundle.sha256_ctx, 0);
+    return ESP_OK;
+}
+
+// Splits the bundle data among its entries: the app image goes through
+// ota_writer, the others straight to their data partition
+static esp_err_t bundle_write(const char *data, int len){
+    esp_err_t err;
+
+    while (len > 0) {
+        if (bundle.current >= bundle.count) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        int size = bundle.entries[bundle.current].size - bundle.written;
+        if (size > len) {
+            size = len;
+        }
+        if (bundle.current == 0) {
+            err = ota_writer_write(data, size);
+            mbedtls_sha256_update_ret(&bundle.sha256_ctx, (const unsigned char *)data, size);
+            bundle.written += size;
+        } else {
+            err = bundle_write_data(data, size);
+        }
+        if (err == ESP_OK && bundle.written == bundle.entries[bundle.current].size) {
+            err = bundle_next_entry();
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        data += size;
+        len -= size;
+    }
+    return ESP_OK;
+}
+
+#ifdef CONFIG_OTA_RESUMABLE
+// Progress of an interrupted update, kept in NVS so re-inserting the same
+// card resumes at the last checkpoint instead of starting over
+#define CHECKPOINT_NAMESPACE "ota"
+#define CHECKPOINT_KEY       "checkpoint"
+#define CHECKPOINT_INTERVAL  (CONFIG_OTA_CHECKPOINT_SECTORS * SPI_FLASH_SEC_SIZE)
+
+typedef struct {
+    // Identity of the image and of the partition being written
+    uint32_t image_size;
+    int64_t image_mtime;
+    uint8_t expected_sha256[32];
+    uint32_t partition_address;
+    // Bytes already in flash and the hash of those bytes
+    uint32_t offset;
+    uint8_t sha256[32];
+} ota_checkpoint_t;
+
+static void fill_checkpoint_identity(ota_checkpoint_t *checkpoint){
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->image_size = ota_source.size;
+    checkpoint->image_mtime = ota_source.mtime;
+    if (ota_source.has_expected_sha256) {
+        memcpy(checkpoint->expected_sha256, ota_source.expected_sha256, sizeof(checkpoint->expected_sha256));
+    }
+    checkpoint->partition_address = ota_writer.partition->address;
+}
+
+// Records that the first offset bytes of the image are in flash
+static void save_checkpoint(int offset){
+    nvs_handle_t nvs;
+    ota_checkpoint_t checkpoint;
+    mbedtls_sha256_context sha256_ctx;
+
+    fill_checkpoint_identity(&checkpoint);
+    checkpoint.offset = offset;
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_clone(&sha256_ctx, &ota_source.sha256_ctx);
+    mbedtls_sha256_finish_ret(&sha256_ctx, checkpoint.sha256);
+    mbedtls_sha256_free(&sha256_ctx);
+
+    if (nvs_open(CHECKPOINT_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        if (nvs_set_blob(nvs, CHECKPOINT_KEY, &checkpoint, sizeof(checkpoint)) == ESP_OK) {
+            nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+}
+
+static void clear_checkpoint(void){
+    nvs_handle_t nvs;
+    if (nvs_open(CHECKPOINT_NAMESPACE, NVS_READWRITE, &nvs) == ESP_OK) {
+        nvs_erase_key(nvs, CHECKPOINT_KEY);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+}
+
+// Returns the offset to resume the current image from, or 0 to start over.
+// The flash content up to the checkpoint is hashed again, so a resumed
+// image is only trusted if it still matches what was written
+static int resume_from_checkpoint(void){
+    nvs_handle_t nvs;
+    ota_checkpoint_t saved;
+    ota_checkpoint_t current;
+    size_t size = sizeof(saved);
+    uint8_t sha256[32];
+    mbedtls_sha256_context sha256_ctx;
+
+    // Only full images can be read from the middle
+    if (ota_source.format != OTA_FORMAT_BINARY) {
+        return 0;
+    }
+    if (nvs_open(CHECKPOINT_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return 0;
+    }
+    esp_err_t err = nvs_get_blob(nvs, CHECKPOINT_KEY, &saved, &size);
+    nvs_close(nvs);
+    fill_checkpoint_identity(&current);
+    if (err != ESP_OK || size != sizeof(saved)
+            || memcmp(&saved, &current, offsetof(ota_checkpoint_t, offset)) != 0
+            || saved.offset == 0 || saved.offset >= ota_source.size) {
+        return 0;
+    }
+
+    mbedtls_sha256_update_ret(&ota_source.sha256_ctx, ota_writer.mapped, saved.offset);
+    mbedtls_sha256_init(&sha256_ctx);
+    mbedtls_sha256_clone(&sha256_ctx, &ota_source.sha256_ctx);
+    mbedtls_sha256_finish_ret(&sha256_ctx, sha256);
+    mbedtls_sha256_free(&sha256_ctx);
+    if (memcmp(sha256, saved.sha256, sizeof(sha256)) != 0 || !seek_update_file(saved.offset)) {
+        ESP_LOGW(TAG, "Checkpoint does not match the partition, starting over");
+        mbedtls_sha256_free(&ota_source.sha256_ctx);
+        mbedtls_sha256_init(&ota_source.sha256_ctx);
+        mbedtls_sha256_starts_ret(&ota_source.sha256_ctx, 0);
+        return 0;
+    }
+    ota_writer.offset = saved.offset;
+    ESP_LOGI(TAG, "Resuming update at offset %u", saved.offset);
+    return saved.offset;
+}
+#endif //CONFIG_OTA_RESUMABLE
+
+// Logs update progress every CONFIG_OTA_PROGRESS_PERCENT percent or
+// CONFIG_OTA_PROGRESS_INTERVAL_MS, whichever comes first, instead of
+// once per chunk. Sizes of gzip images are unknown until the end, so
+// those are only logged by time
+typedef struct {
+    int64_t last_us;
+    int last_percent;
+} ota_progress_t;
+
+static ota_progress_t ota_progress;
+
+static void progress_begin(void){
+    ota_progress.last_us = esp_timer_get_time();
+    ota_progress.last_percent = 0;
+}
+
+static void progress_update(int written, int total){
+    int64_t now = esp_timer_get_time();
+    int percent = (total > 0) ? (int)((int64_t)written * 100 / total) : -1;
+    bool is_due = now - ota_progress.last_us >= CONFIG_OTA_PROGRESS_INTERVAL_MS * 1000LL;
+
+    if (percent >= 0 && percent >= ota_progress.last_percent + CONFIG_OTA_PROGRESS_PERCENT) {
+        is_due = true;
+    }
+    if (!is_due) {
+        return;
+    }
+    if (percent >= 0) {
+        ESP_LOGI(TAG, "Written image length %d (%d%%)", written, percent);
+        ota_progress.last_percent = percent - percent % CONFIG_OTA_PROGRESS_PERCENT;
+    } else {
+        ESP_LOGI(TAG, "Written image length %d", written);
+    }
+    ota_progress.last_us = now;
+}
+
+// Set while the reader task may still hand over chunks
+static bool is_reader_running = false;
+// Install attempts since boot and the version of the current one, once
+// its header was read, for the install receipt
+static uint8_t ota_attempts = 0;
+static char attempt_version[32];
+
+// Reads the update file into free buffers and hands them to otaTask
+// until the end of the file, a read error or card removal
+static void readerTask(void * parameter){
+    ota_chunk_t chunk;
+
+    do {
+        xQueueReceive(ota_free_queue, &chunk.index, portMAX_DELAY);
+        if (is_ota_aborted) {
+            chunk.length = OTA_CHUNK_ABORTED;
+        } else {
+            /* Read file in chunks into the OTA buffer */
+            int64_t start = trace_time();
+            chunk.length = read_update_source(ota_write_data[chunk.index], ota_buffer_size);
+            trace_read(start, chunk.length);
+            if (!is_sd_present) {
+                chunk.length = OTA_CHUNK_REMOVED;
+            } else if (chunk.length == OTA_CHUNK_ERROR && update_file.has_read_error) {
+                step_down_sd_tuning();
+            }
+        }
+        xQueueSend(ota_filled_queue, &chunk, portMAX_DELAY);
+    } while (chunk.length > 0);
+
+    end_task();
+}
+
+// Stops the reader task and waits until it no longer uses the update file.
+// Buffers are handed back so the reader is never left blocked on them
+static void stop_reader(void){
+    ota_chunk_t chunk;
+    is_ota_aborted = true;
+    do {
+        xQueueReceive(ota_filled_queue, &chunk, portMAX_DELAY);
+        xQueueSend(ota_free_queue, &chunk.index, portMAX_DELAY);
+    } while (chunk.length > 0);
+    is_reader_running = false;
+}
+
+// Starts ota_writer. esp_ota_begin erases the image area here, in
+// background erase mode this only starts the eraser task
+static esp_err_t begin_ota_writer(const esp_partition_t *partition, int size){
+    trace_begin(TRACE_ERASE);
+    esp_err_t err = ota_writer_begin(partition, size);
+    trace_end(TRACE_ERASE);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
-        fclose(update);
-        vTaskResume(sdTaskHandle);
-        vTaskDelete(NULL);
+        ESP_LOGE(TAG, "ota_writer_begin failed (%s)", esp_err_to_name(err));
+        return err;
     }
-    ESP_LOGI(TAG, "esp_ota_begin succeeded");
-    
-    // Check original filesize to match read size later
-    struct stat st_func;
-    stat(MOUNT_POINT"/update.bin", &st_func);
-    int data_read;
+    ESP_LOGI(TAG, "ota_writer_begin succeeded");
+    return ESP_OK;
+}
+
+// Outcome of an update attempt that did not restart into the new image
+typedef enum {
+    OTA_RESULT_FAILED,
+    // The card was removed during the transfer
+    OTA_RESULT_REMOVED,
+    // The update can never apply, do not retry it from the same card
+    OTA_RESULT_REFUSED,
+    // The image itself was refused, do not read it again on this device
+    OTA_RESULT_REJECTED,
+} ota_result_t;
+
+static const char *ota_result_names[] = {
+    "FAILED", "REMOVED", "REFUSED", "REJECTED",
+};
+
+static const receipt_status_t ota_result_receipts[] = {
+    RECEIPT_FAILED, RECEIPT_REMOVED, RECEIPT_REFUSED, RECEIPT_REJECTED,
+};
+
+typedef enum {
+    OTA_COMMAND_INSTALL,
+} ota_command_t;
+
+// otaTask runs from boot and waits for commands from sdHandleTask, which
+// waits for the result of each one on ota_result_queue
+static QueueHandle_t ota_command_queue = NULL;
+static QueueHandle_t ota_result_queue = NULL;
+// Checks the header of the image being installed and its version against
+// the running one and the one rolled back, and keeps the version for the
+// receipt. Returns false if the image must not be installed
+static bool accept_image_header(const char *data, int len){
+    const esp_app_desc_t *new_app_info = check_image_header(data, len);
+    if (new_app_info == NULL) {
+        return false;
+    }
+    ESP_LOGI(TAG, "New firmware version: %s", new_app_info->version);
+    strlcpy(attempt_version, new_app_info->version, sizeof(attempt_version));
+    ESP_LOGI(TAG, "Running firmware version: %s", running_app_info.version);
+
+    // check current version with last invalid partition
+    if (has_invalid_app_info) {
+        ESP_LOGI(TAG, "Last invalid firmware version: %s", invalid_app_info.version);
+        if (memcmp(invalid_app_info.version, new_app_info->version, sizeof(new_app_info->version)) == 0) {
+            ESP_LOGW(TAG, "New version is the same as invalid version.");
+            ESP_LOGW(TAG, "Previously, there was an attempt to launch the firmware with %s version, but it failed.", invalid_app_info.version);
+            ESP_LOGW(TAG, "The firmware has been rolled back to the previous version.");
+            return false;
+        }
+    }
+#ifndef CONFIG_EXAMPLE_SKIP_VERSION_CHECK
+    if (memcmp(new_app_info->version, running_app_info.version, sizeof(new_app_info->version)) == 0) {
+        ESP_LOGW(TAG, "Current running version is the same as a new. We will not continue the update.");
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Installs the update found on the card. Returns only if the image was
+// not installed; whatever it left open is released by otaTask
+static ota_result_t install_update(void){
+    esp_err_t err;
+    const esp_partition_t *update_partition = NULL;
+
+    ESP_LOGI(TAG, "Starting OTA example");
+
+    const esp_partition_t *configured = esp_ota_get_boot_partition();
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    if (configured != running) {
+        ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08x, but running from offset 0x%08x",
+                 configured->address, running->address);
+        ESP_LOGW(TAG, "(This can happen if either the OTA boot data or preferred boot image become corrupted somehow.)");
+    }
+    ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)",
+             running->type, running->subtype, running->address);
+
+    update_partition = esp_ota_get_next_update_partition(NULL);
+    ESP_LOGI(TAG, "Writing to partition subtype %d at offset 0x%x",
+             update_partition->subtype, update_partition->address);
+    assert(update_partition != NULL);
+
+    if (!alloc_ota_buffers()) {
+        ESP_LOGE(TAG, "Failed to allocate read buffers! Aborting ...");
+        return OTA_RESULT_FAILED;
+    }
+
+    attempt_version[0] = '\0';
+    trace_begin(TRACE_OPEN);
+    ota_source.is_open = open_update_source();
+    trace_end(TRACE_OPEN);
+    if (!ota_source.is_open) {
+        ESP_LOGE(TAG, "Failed to open update file! Aborting ...");
+        // Do not retry an update that cannot apply to this card
+        return OTA_RESULT_REFUSED;
+    }
+    ESP_LOGI(TAG, "Opened update file!");
+
     int binary_file_length = 0;
     bool image_header_was_checked = false;
+    // The writer is started once the header was checked, so bad images
+    // are refused before anything is erased
+    bool is_writer_begun = false;
+    int image_size = (ota_source.format == OTA_FORMAT_BUNDLE) ? bundle.entries[0].size : ota_source.size;
+#ifdef CONFIG_OTA_RESUMABLE
+    // Resuming reads back the mapped partition, mapping it erases nothing
+    err = begin_ota_writer(update_partition, image_size);
+    if (err != ESP_OK) {
+        return OTA_RESULT_FAILED;
+    }
+    is_writer_begun = true;
+    // The header of a resumed image was checked on the first attempt
+    binary_file_length = resume_from_checkpoint();
+    image_header_was_checked = binary_file_length > 0;
+    if (image_header_was_checked) {
+        // and its version for the receipt is read back from the partition
+        const esp_app_desc_t *app_info = check_image_header((const char *)ota_writer.mapped, binary_file_length);
+        if (app_info != NULL) {
+            strlcpy(attempt_version, app_info->version, sizeof(attempt_version));
+        }
+    }
+    int next_checkpoint = binary_file_length + CHECKPOINT_INTERVAL;
+#endif
+
+    // Hand all buffers to the reader task and start reading the card
+    xQueueReset(ota_free_queue);
+    xQueueReset(ota_filled_queue);
+    for (int i = 0; i < BUFFCOUNT; i++) {
+        xQueueSend(ota_free_queue, &i, 0);
+    }
+    is_ota_aborted = false;
+    trace_begin(TRACE_TRANSFER);
+    progress_begin();
+    if (!start_task(&reader_task, readerTask, 5, tskNO_AFFINITY)) {
+        ESP_LOGE(TAG, "Failed to start the reader task! Aborting ...");
+        trace_end(TRACE_TRANSFER);
+        return OTA_RESULT_FAILED;
+    }
+    is_reader_running = true;
 
+    ota_chunk_t chunk;
     do {
-        /* Read file in chunks into the OTA buffer */
-        data_read = fread(ota_write_data, 1, BUFFSIZE, update);
+        // Flash the chunk while the reader task fills the next buffers
+        xQueueReceive(ota_filled_queue, &chunk, portMAX_DELAY);
+        char *data = ota_write_data[chunk.index];
+        int data_read = chunk.length;
+        is_reader_running = data_read > 0;
 
         if (data_read > 0) {
             if (image_header_was_checked == false) {
-                esp_app_desc_t new_app_info;
-                if (data_read > sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                    // check current version with downloading
-                    memcpy(&new_app_info, &ota_write_data[sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t)], sizeof(esp_app_desc_t));
-                    ESP_LOGI(TAG, "New firmware version: %s", new_app_info.version);
-
-                    esp_app_desc_t running_app_info;
-                    if (esp_ota_get_partition_description(running, &running_app_info) == ESP_OK) {
-                        ESP_LOGI(TAG, "Running firmware version: %s", running_app_info.version);
-                    }
-
-                    const esp_partition_t* last_invalid_app = esp_ota_get_last_invalid_partition();
-                    esp_app_desc_t invalid_app_info;
-                    if (esp_ota_get_partition_description(last_invalid_app, &invalid_app_info) == ESP_OK) {
-                        ESP_LOGI(TAG, "Last invalid firmware version: %s", invalid_app_info.version);
-                    }
-
-                    // check current version with last invalid partition
-                    if (last_invalid_app != NULL) {
-                        if (memcmp(invalid_app_info.version, new_app_info.version, sizeof(new_app_info.version)) == 0) {
-                            ESP_LOGW(TAG, "New version is the same as invalid version.");
-                            ESP_LOGW(TAG, "Previously, there was an attempt to launch the firmware with %s version, but it failed.", invalid_app_info.version);
-                            ESP_LOGW(TAG, "The firmware has been rolled back to the previous version.");
-                            fclose(update);
-                            vTaskResume(sdTaskHandle);
-                            vTaskDelete(NULL);
-                        }
-                    }
-#ifndef CONFIG_EXAMPLE_SKIP_VERSION_CHECK
-                    if (memcmp(new_app_info.version, running_app_info.version, sizeof(new_app_info.version)) == 0) {
-                        ESP_LOGW(TAG, "Current running version is the same as a new. We will not continue the update.");
-                        is_ota_already_done = true;
-                        fclose(update);
-                        vTaskResume(sdTaskHandle);
-                        vTaskDelete(NULL);
-                    }
-#endif
-
-                    image_header_was_checked = true;
-
-                } else {
-                    ESP_LOGE(TAG, "Received package length does not fit");
-                    fclose(update);
-                    vTaskResume(sdTaskHandle);
-                    vTaskDelete(NULL);
+                trace_begin(TRACE_HEADER);
+                bool is_accepted = accept_image_header(data, data_read);
+                trace_end(TRACE_HEADER);
+                if (!is_accepted) {
+                    trace_end(TRACE_TRANSFER);
+                    return OTA_RESULT_REJECTED;
+                }
+                image_header_was_checked = true;
+            }
+            if (!is_writer_begun) {
+                err = begin_ota_writer(update_partition, image_size);
+                if (err != ESP_OK) {
+                    trace_end(TRACE_TRANSFER);
+                    return OTA_RESULT_FAILED;
                 }
+                is_writer_begun = true;
+            }
+            int64_t start = trace_time();
+            if (ota_source.format == OTA_FORMAT_BUNDLE) {
+                err = bundle_write(data, data_read);
+            } else {
+                err = ota_writer_write(data, data_read);
             }
-            err = esp_ota_write( update_handle, (const void *)ota_write_data, data_read);
+            trace_write(start, data_read);
             if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
-                fclose(update);
-                vTaskResume(sdTaskHandle);
-                vTaskDelete(NULL);
+                ESP_LOGE(TAG, "ota_writer_write failed (%s)", esp_err_to_name(err));
+                trace_end(TRACE_TRANSFER);
+                return OTA_RESULT_FAILED;
             } 
+            mbedtls_sha256_update_ret(&ota_source.sha256_ctx, (const unsigned char *)data, data_read);
             binary_file_length += data_read;
-            ESP_LOGI(TAG, "Written image length %d", binary_file_length);
+            progress_update(binary_file_length, ota_source.size);
+#ifdef CONFIG_OTA_RESUMABLE
+            if (binary_file_length >= next_checkpoint) {
+                save_checkpoint(binary_file_length);
+                next_checkpoint = binary_file_length + CHECKPOINT_INTERVAL;
+            }
+#endif
         }
 
-    // Keep looping until the whole file is read or if SD card is removed
-    } while (data_read != 0 && is_sd_present);
+        // Give the buffer back to the reader task
+        xQueueSend(ota_free_queue, &chunk.index, portMAX_DELAY);
+
+    // Keep looping until the reader task reaches the end of the file,
+    // fails to read it or sees the SD card removed
+    } while (chunk.length > 0);
+    trace_end(TRACE_TRANSFER);
 
     // Handles SD card removal
-    if (!is_sd_present){
+    if (chunk.length == OTA_CHUNK_REMOVED){
         ESP_LOGE(TAG, "SD Card removed! Aborting ...");
-        fclose(update);
-        vTaskResume(sdTaskHandle);
-        vTaskDelete(NULL);
+        return OTA_RESULT_REMOVED;
     }
 
     // Check if read size and original size are compatible
-    if (binary_file_length != (int)st_func.st_size){
+    if (binary_file_length != ota_source.size){
         ESP_LOGE(TAG, "File not read successfully! Aborting ...");
-        fclose(update);
-        vTaskResume(sdTaskHandle);
-        vTaskDelete(NULL);
+        return OTA_RESULT_FAILED;
+    }
+
+    // Check the image hash against the manifest before it can be booted
+    mbedtls_sha256_finish_ret(&ota_source.sha256_ctx, ota_source.sha256);
+    if (ota_source.has_expected_sha256
+            && memcmp(ota_source.sha256, ota_source.expected_sha256, sizeof(ota_source.sha256)) != 0){
+        ESP_LOGE(TAG, "Image does not match its manifest! Aborting ...");
+#ifdef CONFIG_OTA_RESUMABLE
+        clear_checkpoint();
+#endif
+        return OTA_RESULT_FAILED;
     }
 
-    err = esp_ota_end(update_handle);
+    trace_begin(TRACE_VALIDATE);
+    err = ota_writer_end();
+    trace_end(TRACE_VALIDATE);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
             ESP_LOGE(TAG, "Image validation failed, image is corrupted");
         }
-        ESP_LOGE(TAG, "esp_ota_end failed (%s)!", esp_err_to_name(err));
-        fclose(update);
-        vTaskResume(sdTaskHandle);
-        vTaskDelete(NULL);
+        ESP_LOGE(TAG, "ota_writer_end failed (%s)!", esp_err_to_name(err));
+#ifdef CONFIG_OTA_RESUMABLE
+        clear_checkpoint();
+#endif
+        return OTA_RESULT_FAILED;
     }
 
+    trace_begin(TRACE_SET_BOOT);
     err = esp_ota_set_boot_partition(update_partition);
+    trace_end(TRACE_SET_BOOT);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
-        fclose(update);
-        vTaskResume(sdTaskHandle);
-        vTaskDelete(NULL);
+        return OTA_RESULT_FAILED;
     }
 
-    fclose(update);
+#ifdef CONFIG_OTA_RESUMABLE
+    clear_checkpoint();
+#endif
+    close_update_source();
+    // Written to the card after the reboot, once the image passed or
+    // failed its self-test
+    record_attempt(RECEIPT_INSTALLED, attempt_version, update_partition->address, ota_attempts);
+    remember_image(KNOWN_APPLIED);
+    save_installed_update();
+    trace_report();
     ESP_LOGI(TAG, "Done! Unmounting ...");
     esp_vfs_fat_sdcard_unmount(mount_point, card);
     ESP_LOGI(TAG, "Card unmounted");
@@ -363,25 +3374,122 @@ static void otaTask(void * parameter){
     spi_bus_free(host.slot);
 #endif
     ESP_LOGI(TAG, "Prepare to restart system!");
+    flush_deferred_log();
     esp_restart();
-    return;
+    return OTA_RESULT_FAILED;
 }
 
-static void sdHandleTask(void * parameter){
-    struct stat st_sd;
-    while (1){
-        if(is_sd_present && !is_sd_card_mounted){
-            // If the SD card is present and has not been mounted, try to mount it
-            ESP_LOGI(TAG, "SD CARD FOUND!");
-            ESP_LOGI(TAG, "MOUNTING ...");
-#ifdef USE_SPI_MODE
-            // Initialize the SPI bus to use devices
-            if(!is_spi_started){
-                start_spi_bus();
-            }
+// Update worker. Each attempt ends here, whichever way it failed: the
+// reader is stopped, the partition write aborted and the file closed
+// before the result goes back to sdHandleTask
+static void otaTask(void * parameter){
+    ota_command_t command;
+
+    while (1) {
+        xQueueReceive(ota_command_queue, &command, portMAX_DELAY);
+        set_transfer_active(true);
+        ota_attempts++;
+        ota_result_t result = install_update();
+        if (is_reader_running) {
+            stop_reader();
+        }
+        ota_writer_abort();
+        close_update_source();
+        set_transfer_active(false);
+        if (result == OTA_RESULT_REJECTED) {
+            remember_image(KNOWN_REJECTED);
+        }
+        record_attempt(ota_result_receipts[result], attempt_version, 0, ota_attempts);
+        xQueueSend(ota_result_queue, &result, portMAX_DELAY);
+    }
+}
+
+// Creates the queues of the update path and starts otaTask, once at boot
+static void start_ota_worker(void){
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    static StaticQueue_t command_queue_buffer;
+    static StaticQueue_t result_queue_buffer;
+    static uint8_t command_queue_storage[sizeof(ota_command_t)];
+    static uint8_t result_queue_storage[sizeof(ota_result_t)];
+    ota_free_queue = xQueueCreateStatic(BUFFCOUNT, sizeof(int),
+                                        ota_free_queue_storage, &ota_free_queue_buffer);
+    ota_filled_queue = xQueueCreateStatic(BUFFCOUNT, sizeof(ota_chunk_t),
+                                          ota_filled_queue_storage, &ota_filled_queue_buffer);
+    ota_command_queue = xQueueCreateStatic(1, sizeof(ota_command_t),
+                                           command_queue_storage, &command_queue_buffer);
+    ota_result_queue = xQueueCreateStatic(1, sizeof(ota_result_t),
+                                          result_queue_storage, &result_queue_buffer);
+#else
+    ota_free_queue = xQueueCreate(BUFFCOUNT, sizeof(int));
+    ota_filled_queue = xQueueCreate(BUFFCOUNT, sizeof(ota_chunk_t));
+    ota_command_queue = xQueueCreate(1, sizeof(ota_command_t));
+    ota_result_queue = xQueueCreate(1, sizeof(ota_result_t));
 #endif
-            is_sd_card_mounted = start_sd_card();
-        } else if (!is_sd_present && is_sd_card_mounted){
+    start_task(&ota_task, otaTask, 5, tskNO_AFFINITY);
+}
+
+// States of the SD card handling. sdHandleTask only moves between them
+// on events, blocking while nothing happens
+typedef enum {
+    SD_STATE_ABSENT,
+    SD_STATE_MOUNTING,
+    SD_STATE_SCANNING,
+    SD_STATE_UPDATING,
+    SD_STATE_DONE,
+} sd_state_t;
+
+typedef enum {
+    SD_EVENT_NONE,
+    SD_EVENT_INSERTED,
+    SD_EVENT_REMOVED,
+    SD_EVENT_MOUNTED,
+    SD_EVENT_MOUNT_FAILED,
+    SD_EVENT_UPDATE_FOUND,
+    SD_EVENT_NO_UPDATE,
+    SD_EVENT_UPDATE_ENDED,
+    SD_EVENT_RESCAN,
+} sd_event_t;
+
+static const char *sd_state_names[] = {
+    "ABSENT", "MOUNTING", "SCANNING", "UPDATING", "DONE",
+};
+
+static sd_state_t sd_state = SD_STATE_ABSENT;
+
+// Transition table, free of side effects
+static sd_state_t sd_next_state(sd_state_t state, sd_event_t event){
+    if (event == SD_EVENT_REMOVED) {
+        return SD_STATE_ABSENT;
+    }
+    switch (state) {
+    case SD_STATE_ABSENT:
+        return (event == SD_EVENT_INSERTED) ? SD_STATE_MOUNTING : state;
+    case SD_STATE_MOUNTING:
+        if (event == SD_EVENT_MOUNTED) {
+            return SD_STATE_SCANNING;
+        }
+        return (event == SD_EVENT_MOUNT_FAILED) ? SD_STATE_DONE : state;
+    case SD_STATE_SCANNING:
+        if (event == SD_EVENT_UPDATE_FOUND) {
+            return SD_STATE_UPDATING;
+        }
+        return (event == SD_EVENT_NO_UPDATE) ? SD_STATE_DONE : state;
+    case SD_STATE_UPDATING:
+        return (event == SD_EVENT_UPDATE_ENDED) ? SD_STATE_DONE : state;
+    case SD_STATE_DONE:
+        return (event == SD_EVENT_RESCAN) ? SD_STATE_SCANNING : state;
+    default:
+        return state;
+    }
+}
+
+// Runs the work of a state just entered and returns the event it produced
+static sd_event_t sd_enter_state(sd_state_t state){
+    struct stat st_sd;
+
+    switch (state) {
+    case SD_STATE_ABSENT:
+        if (is_sd_card_mounted) {
             // If the SD card is removed and is still mounted, unmount it
             ESP_LOGE(TAG, "SD CARD REMOVED!");
             ESP_LOGE(TAG, "UNMOUNTING ...");
@@ -393,31 +3501,174 @@ static void sdHandleTask(void * parameter){
             spi_bus_free(host.slot);
             is_spi_started = false;
 #endif
-        } else if(is_sd_present && is_sd_card_mounted){
-            // If the SD card is present and mounted, look for update file
-            if(!is_ota_already_done){
-                if (stat(MOUNT_POINT"/update.bin", &st_sd) == 0) {
-                    // Log if it is found
-                    ESP_LOGI(TAG, "UPDATE FILE FOUND!!");
-                    // Print its size in bytes
-                    printf("SIZE OF FILE: %lu\n", (unsigned long)st_sd.st_size);
-                    ESP_LOGI(TAG, "STARTING UPDATE PROCESS ...");
-                    xTaskCreate(otaTask, "otaTask", 8192, NULL, 5, &otaTaskHandle);
-                    vTaskSuspend( NULL );
-                } else {
-                    // Log if it is not found
-                    ESP_LOGE(TAG, "NO UPDATE FILE FOUND!");
-                }
+            is_update_index_loaded = false;
+        }
+        // A card inserted later may hold another update, keep it
+        is_boot_card_present = false;
+        // and is scanned again, images already handled are skipped by name
+        is_ota_already_done = false;
+        printf("Please, insert SD card to start update...\n");
+        return SD_EVENT_NONE;
+    case SD_STATE_MOUNTING:
+        if (!is_sd_card_mounted) {
+            // If the SD card is present and has not been mounted, try to mount it
+            ESP_LOGI(TAG, "SD CARD FOUND!");
+            ESP_LOGI(TAG, "MOUNTING ...");
+#ifdef USE_SPI_MODE
+            // Initialize the SPI bus to use devices
+            if(!is_spi_started){
+                start_spi_bus();
             }
-        } else {
-            printf("Please, insert SD card to start update...\n");
+#endif
+            trace_begin(TRACE_MOUNT);
+            is_sd_card_mounted = start_sd_card();
+            trace_end(TRACE_MOUNT);
+        }
+        // Receipts left while no card was present, once the image is confirmed
+        if (is_sd_card_mounted && has_pending_receipt
+                && (xEventGroupGetBits(boot_events) & BOOT_IMAGE_CHECKED)) {
+            post_house_job(HOUSE_JOB_WRITE_RECEIPT);
+        }
+        return is_sd_card_mounted ? SD_EVENT_MOUNTED : SD_EVENT_MOUNT_FAILED;
+    case SD_STATE_SCANNING:
+        // If the SD card is present and mounted, look for update file
+        if (!is_sd_card_mounted) {
+            return SD_EVENT_NO_UPDATE;
+        }
+        // Do not install anything before the running image is confirmed
+        if (is_ota_already_done || !(xEventGroupGetBits(boot_events) & BOOT_IMAGE_CHECKED)) {
+            return SD_EVENT_NO_UPDATE;
+        }
+        trace_begin(TRACE_SCAN);
+        const ota_format_file_t *found = find_update_file(&st_sd);
+        trace_end(TRACE_SCAN);
+        if (found == NULL) {
+            // Log if it is not found
+            ESP_LOGE(TAG, "NO UPDATE FILE FOUND!");
+            return SD_EVENT_NO_UPDATE;
+        }
+        // Skip an image installed or rejected before without reading it
+        if (is_known_image(found->name, &st_sd)) {
+            ESP_LOGI(TAG, "%s was already handled on this device, skipping it", found->name);
+            return SD_EVENT_NO_UPDATE;
+        }
+        // Log if it is found
+        ESP_LOGI(TAG, "UPDATE FILE FOUND!!");
+        // Print its size in bytes
+        printf("SIZE OF FILE: %lu\n", (unsigned long)st_sd.st_size);
+#ifdef CONFIG_OTA_SPECULATIVE_ERASE
+        // Start erasing while otaTask checks the header and version
+        if (found->format == OTA_FORMAT_BINARY) {
+            ota_writer_begin(esp_ota_get_next_update_partition(NULL), st_sd.st_size);
+        }
+#endif
+        return SD_EVENT_UPDATE_FOUND;
+    case SD_STATE_UPDATING: {
+        ESP_LOGI(TAG, "STARTING UPDATE PROCESS ...");
+        ota_command_t command = OTA_COMMAND_INSTALL;
+        ota_result_t result;
+        xQueueSend(ota_command_queue, &command, portMAX_DELAY);
+        // otaTask answers only if the update did not complete
+        xQueueReceive(ota_result_queue, &result, portMAX_DELAY);
+        ESP_LOGW(TAG, "UPDATE ENDED: %s", ota_result_names[result]);
+        if (result == OTA_RESULT_REFUSED || result == OTA_RESULT_REJECTED) {
+            is_ota_already_done = true;
+        }
+        return SD_EVENT_UPDATE_ENDED;
+    }
+    default:
+        return SD_EVENT_NONE;
+    }
+}
+
+// Feeds an event to the state machine, following the events produced by
+// each state entered until one waits for the card to change
+static void run_sd_state_machine(sd_event_t event){
+    while (event != SD_EVENT_NONE) {
+        sd_state_t next = sd_next_state(sd_state, event);
+        if (next == sd_state) {
+            return;
+        }
+        ESP_LOGI(TAG, "SD state %s -> %s", sd_state_names[sd_state], sd_state_names[next]);
+        sd_state = next;
+        event = sd_enter_state(next);
+    }
+}
+
+// Mounts and unmounts the card CONFIG_OTA_HEAP_CYCLE_TEST times and logs
+// what the cycles left behind in the heap. A lower largest free block at
+// the end with the same free size means the heap got fragmented
+static void run_heap_cycle_test(void){
+#if CONFIG_OTA_HEAP_CYCLE_TEST > 0
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_before = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    int cycles;
+
+    for (cycles = 0; cycles < CONFIG_OTA_HEAP_CYCLE_TEST && is_sd_present; cycles++) {
+#ifdef USE_SPI_MODE
+        start_spi_bus();
+#endif
+        if (!start_sd_card()) {
+            break;
+        }
+        esp_vfs_fat_sdcard_unmount(mount_point, card);
+#ifdef USE_SPI_MODE
+        spi_bus_free(host.slot);
+#endif
+    }
+    size_t free_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_after = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    ESP_LOGI(TAG, "Heap after %d mount cycles: %u bytes free (%+d), largest block %u (%+d), %u at worst",
+             cycles, (uint32_t)free_after, (int)(free_after - free_before),
+             (uint32_t)largest_after, (int)(largest_after - largest_before),
+             (uint32_t)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+#endif
+}
+
+static void sdHandleTask(void * parameter){
+    // A static task only gets its handle back once it may be running
+    sdTaskHandle = xTaskGetCurrentTaskHandle();
+    set_card_busy(true);
+    run_heap_cycle_test();
+    if (is_sd_present) {
+        run_sd_state_machine(SD_EVENT_INSERTED);
+    } else {
+        sd_enter_state(SD_STATE_ABSENT);
+    }
+    set_card_busy(false);
+    xEventGroupSetBits(boot_events, BOOT_CARD_SETTLED);
+    while (1){
+        // Sleep until the card detect ISR reports an edge
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // Debounce: wait until the pin stops changing before sampling it
+        while (ulTaskNotifyTake(pdTRUE, SD_DEBOUNCE_MS / portTICK_PERIOD_MS) != 0) {
+        }
+        power_report();
+        set_card_busy(true);
+        is_sd_present = !gpio_get_level(PIN_NUM_CD);
+        run_sd_state_machine(is_sd_present ? SD_EVENT_INSERTED : SD_EVENT_REMOVED);
+        if (is_rescan_requested) {
+            is_rescan_requested = false;
+            run_sd_state_machine(SD_EVENT_RESCAN);
         }
-        vTaskDelay(500 / portTICK_PERIOD_MS);
+        set_card_busy(false);
     }
 }
 
 void app_main(void)
 {   
+    trace_boot();
+    start_deferred_log();
+    cache_app_descriptions();
+
+    // Initialize NVS, used to keep update state across resets
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+
     // Configuration of GPIO pin to detect first insertion of SD card
     // and write protect detection
     gpio_config_t io_conf;
@@ -438,19 +3689,12 @@ void app_main(void)
     // Install GPIO ISR service
     gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
 
-    // If card already present, try to mount
-    if(gpio_get_level(PIN_NUM_CD) == 0){
-        is_sd_present = true;
-        ESP_LOGI(TAG, "SD CARD FOUND!");
-        ESP_LOGI(TAG, "MOUNTING ...");
-#ifdef USE_SPI_MODE
-        // Initialize the SPI bus to use devices
-        if(!is_spi_started){
-            start_spi_bus();
-        }
-#endif
-        is_sd_card_mounted = start_sd_card();
-    }
+    // The card is mounted by sdHandleTask, off the boot path
+    int cd_level = gpio_get_level(PIN_NUM_CD);
+    is_sd_present = !cd_level;
+    is_boot_card_present = is_sd_present;
+    start_power_save();
+    arm_card_detect(cd_level);
 
     // Adds ISR handler to detect SD card insertion/removal
     gpio_isr_handler_add(PIN_NUM_CD, gpio_isr_handler, (void*) PIN_NUM_CD);
@@ -461,49 +3705,40 @@ void app_main(void)
              running->type, running->subtype, running->address);
 
     // Check current OTA state to validate new image
-    esp_ota_img_states_t ota_state;
-    struct stat st;
-    int cleanup_update = false;
-
-    if (esp_ota_get_state_partition(running, &ota_state) == ESP_OK) {
-        if (ota_state == ESP_OTA_IMG_PENDING_VERIFY) {
-            ESP_LOGI(TAG, "WP: %u", gpio_get_level(PIN_NUM_WP));
-            // Test image to check if working properly
-            bool diagnostic_is_ok = diagnostic();
-            if (diagnostic_is_ok) {
-                ESP_LOGI(TAG, "Diagnostics completed successfully! Continuing execution ...");
-                esp_ota_mark_app_valid_cancel_rollback();
-                if (gpio_get_level(PIN_NUM_WP) == 1) {
-                    ESP_LOGE(TAG, "SD card is write protected! Cannot erase file ...");
-                    // Set flag to prevent redetection of previously applied update
-                    is_ota_already_done = true;
-                } else if (stat(MOUNT_POINT"/update.bin", &st) == 0) {
-                    // Set flag to perform cleanup outside OTA validity check
-                    cleanup_update = true;
-                }
-            } else {
-                // OTA Validity test failed, perform rollback to previous valid version
-                ESP_LOGE(TAG, "Diagnostics failed! Start rollback to the previous version ...");
-                esp_ota_mark_app_invalid_rollback_and_reboot();
-            }
-        }
-    }
-
-    // Perform cleanup in the SD card of firmware file just applied
-    if(cleanup_update){
-        unlink(MOUNT_POINT"/update.bin");
-        ESP_LOGI(TAG, "Removing done!");
-        cleanup_update = false;
-    }
+#ifdef CONFIG_OTA_STATIC_MEMORY
+    boot_events = xEventGroupCreateStatic(&boot_events_buffer);
+#else
+    boot_events = xEventGroupCreate();
+#endif
+    // Card housekeeping, such as install receipts, runs in the background
+    load_known_images();
+    start_receipts();
+    start_housekeeping();
 
     // Select GPIO to blink LED
     gpio_pad_select_gpio(BLINK_GPIO);
     // Set GPIO to blink LED as output
     gpio_set_direction(BLINK_GPIO, GPIO_MODE_OUTPUT);
-    // Create blink LED task
+    // Create blink LED task before the self-test starts, its heartbeat is
+    // part of the diagnostics
+    is_heartbeat_expected = true;
     xTaskCreate(toggleLED, "toggleLED", 2048, NULL, 1, NULL);
 
+    esp_ota_img_states_t ota_state;
+    bool is_image_pending = esp_ota_get_state_partition(running, &ota_state) == ESP_OK
+                            && ota_state == ESP_OTA_IMG_PENDING_VERIFY;
+    if (is_image_pending) {
+        // Self-test on the APP CPU while the card is mounted on the PRO CPU
+        start_task(&health_task, healthTask, 1, APP_CPU_NUM);
+    } else {
+        xEventGroupSetBits(boot_events, BOOT_IMAGE_CHECKED);
+    }
+
+    // Update worker, idle until sdHandleTask finds an update
+    start_ota_worker();
+
     // Create task to handle SD Card
-    xTaskCreate(sdHandleTask, "sdHandleTask", 8192, NULL, 1, &sdTaskHandle);
+    start_task(&sd_task, sdHandleTask, 1, PRO_CPU_NUM);
+    trace_ready();
 
 }
\ No newline at end of file